@@ -1 +1 @@
-gcc main.c glad.c nanovg-master/src/nanovg.c -I. -I nanovg-master/src -o prog -lm -lSDL2
\ No newline at end of file
+gcc main.c glad.c nanovg-master/src/nanovg.c -I. -I nanovg-master/src -o prog -lm -lSDL2 -pthread
\ No newline at end of file
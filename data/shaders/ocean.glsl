@@ -0,0 +1,26 @@
+#version 330 core
+
+// The spectral ocean under the water, linked into the water shaders. Its
+// heights repeat every u_ocean_length along x and z.
+uniform bool u_ocean_on;
+uniform sampler2D u_ocean;
+uniform float u_ocean_length;
+uniform float u_ocean_cell;
+
+// The ocean's height at xz, and its slopes along x and z per water cell,
+// which is how the water shaders measure theirs.
+vec3 ocean_wave(vec2 xz) {
+    if (!u_ocean_on) {
+        return vec3(0.);
+    }
+
+    // Texel i holds the height at xz = i * u_ocean_length / size.
+    float texel = 1. / float(textureSize(u_ocean, 0).x);
+    vec2 uv = xz / u_ocean_length + 0.5 * texel;
+    float h = textureLod(u_ocean, uv, 0.).r;
+    float hx = textureLod(u_ocean, uv + vec2(texel, 0.), 0.).r;
+    float hz = textureLod(u_ocean, uv + vec2(0., texel), 0.).r;
+
+    float scale = u_ocean_cell / (u_ocean_length * texel);
+    return vec3(h, (hx - h) * scale, (hz - h) * scale);
+}
@@ -0,0 +1,27 @@
+#version 330 core
+
+layout(location = 0) in vec2 a_grid;
+
+uniform mat4 u_mat;
+uniform mat4 u_view;
+
+// The position of grid vertex (0, 0) and the distance between vertices.
+uniform vec2 u_origin;
+uniform float u_spacing;
+
+out vec3 pos;
+out float u;
+out vec3 normal;
+
+vec3 ocean_wave(vec2 xz);
+
+void main() {
+    vec2 xz = u_origin + a_grid * u_spacing;
+    vec3 wave = ocean_wave(xz);
+
+    vec3 ppos = vec3(xz.x, wave.x, xz.y);
+    gl_Position = u_mat * vec4(ppos, 1.);
+    pos = ppos;
+    u = wave.x;
+    normal = normalize(vec3(1., -wave.y, -wave.z));
+}
@@ -8,7 +8,16 @@ layout(location = 0) out vec4 fragColour;
 
 uniform samplerCube skybox;
 
+// Leaves out |xz - u_hole.xy| < u_hole.zw, where something finer is drawn:
+// the water grid inside the far ocean, or the fine grid of a nested
+// simulation inside the coarse one.
+uniform vec4 u_hole;
+
 void main() {
+    if (all(lessThan(abs(pos.xz - u_hole.xy), u_hole.zw))) {
+        discard;
+    }
+
     // vec3 dx = dFdx(pos);
     // vec3 dy = dFdy(pos);
     // vec3 normal = normalize(cross(dx, dy));
@@ -7,14 +7,30 @@ layout(location = 2) in vec3 a_normal;
 uniform mat4 u_mat;
 uniform mat4 u_view;
 
+// Where this copy of a periodic grid is drawn.
+uniform vec2 u_offset;
+
+// How many of this grid's cells make one water cell, which the slopes in the
+// normals are measured per.
+uniform float u_slope_scale;
+
 out vec3 pos;
 out float u;
 out vec3 normal;
 
+vec3 ocean_wave(vec2 xz);
+
 void main() {
-    vec3 ppos = vec3(a_xy.x, a_u, a_xy.y);
+    vec3 ppos = vec3(a_xy.x + u_offset.x, a_u, a_xy.y + u_offset.y);
+    vec3 wave = ocean_wave(ppos.xz);
+    ppos.y += wave.x;
+
     gl_Position = u_mat * vec4(ppos, 1.);
     pos = ppos;
     u = a_u;
-    normal = a_normal;
+
+    // The normals are packed as normalize(1, -u1, -u2).
+    vec3 slopes = a_normal / a_normal.x;
+    slopes.yz *= u_slope_scale;
+    normal = normalize(slopes - vec3(0., wave.y, wave.z));
 }
@@ -0,0 +1,66 @@
+#version 330 core
+
+layout(location = 0) in vec2 a_grid;
+
+uniform mat4 u_mat;
+uniform mat4 u_view;
+uniform sampler2D u_height;
+
+// Placement of the level being drawn: the position of grid vertex (0, 0),
+// the distance between vertices and the height mip with that spacing.
+uniform vec2 u_origin;
+uniform float u_spacing;
+uniform float u_lod;
+
+uniform float u_cells;
+uniform vec2 u_camera;
+uniform float u_half_size;
+uniform float u_cell_size;
+
+// A periodic grid repeats every size - 1 cells, its last texel being a copy
+// of the first, so the levels can reach past the pool.
+uniform bool u_periodic;
+
+out vec3 pos;
+out float u;
+out vec3 normal;
+
+vec3 ocean_wave(vec2 xz);
+
+float height(vec2 xz, float lod) {
+    vec2 cell = (xz + u_half_size) / u_cell_size;
+    if (u_periodic) {
+        cell = mod(cell, vec2(textureSize(u_height, 0) - 1));
+    }
+    vec2 uv = (cell + 0.5) / vec2(textureSize(u_height, 0));
+    return textureLod(u_height, uv, lod).r;
+}
+
+void main() {
+    vec2 xz = u_origin + a_grid * u_spacing;
+
+    // Towards the edge of the level, slide the odd vertices onto the even
+    // ones and sample the next mip, so the outer row matches the next level.
+    // The camera is at most two cells from the centre of the level.
+    vec2 d = abs(xz - u_camera) / u_spacing;
+    float band = u_cells / 8.;
+    float morph = clamp((max(d.x, d.y) - (u_cells / 2. - 2. - band)) / band, 0., 1.);
+    xz -= fract(a_grid * 0.5) * 2. * u_spacing * morph;
+    if (!u_periodic) {
+        xz = clamp(xz, -u_half_size, u_half_size);
+    }
+
+    float lod = u_lod + morph;
+    float step = u_cell_size * exp2(lod);
+
+    float h = height(xz, lod);
+    float u1 = (height(xz + vec2(step, 0.), lod) - h) * u_cell_size / step;
+    float u2 = (height(xz + vec2(0., step), lod) - h) * u_cell_size / step;
+
+    vec3 wave = ocean_wave(xz);
+    vec3 ppos = vec3(xz.x, h + wave.x, xz.y);
+    gl_Position = u_mat * vec4(ppos, 1.);
+    pos = ppos;
+    u = h;
+    normal = normalize(vec3(1., -u1 - wave.y, -u2 - wave.z));
+}
@@ -0,0 +1,44 @@
+#version 330 core
+
+layout(location = 0) in vec2 a_xy;
+
+uniform mat4 u_mat;
+uniform mat4 u_view;
+uniform sampler2D u_height;
+
+// Where this copy of a periodic grid is drawn. The last row and column of a
+// periodic grid repeat the first, so its neighbours wrap past them.
+uniform vec2 u_offset;
+uniform bool u_periodic;
+
+out vec3 pos;
+out float u;
+out vec3 normal;
+
+vec3 ocean_wave(vec2 xz);
+
+float height(ivec2 cell, ivec2 size) {
+    if (u_periodic) {
+        return texelFetch(u_height, cell % (size - 1), 0).r;
+    }
+    return texelFetch(u_height, clamp(cell, ivec2(0), size - 1), 0).r;
+}
+
+void main() {
+    // The grid vertices are laid out row by row, like the height texture.
+    ivec2 size = textureSize(u_height, 0);
+    ivec2 cell = ivec2(gl_VertexID % size.x, gl_VertexID / size.x);
+
+    float h = height(cell, size);
+    float u1 = height(cell + ivec2(1, 0), size) - h;
+    float u2 = height(cell + ivec2(0, 1), size) - h;
+
+    vec3 ppos = vec3(a_xy.x + u_offset.x, h, a_xy.y + u_offset.y);
+    vec3 wave = ocean_wave(ppos.xz);
+    ppos.y += wave.x;
+
+    gl_Position = u_mat * vec4(ppos, 1.);
+    pos = ppos;
+    u = h;
+    normal = normalize(vec3(1., -u1 - wave.y, -u2 - wave.z));
+}
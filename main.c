@@ -9,6 +9,17 @@
 
 #include <signal.h>
 #include <execinfo.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define WATER_X86
+#include <immintrin.h>
+#endif
 
 #include <glad/glad.h>
 #include <SDL2/SDL.h>
@@ -54,10 +65,31 @@ float clampf(float x, float a, float b) {
 	return x;
 }
 
+int clampi(int x, int a, int b) {
+	if (x < a) {
+		return a;
+	}
+	if (x > b) {
+		return b;
+	}
+	return x;
+}
+
 float lerpf(float a, float b, float t) {
 	return a + (b - a) * t;
 }
 
+double time_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int wrapi(int x, int n) {
+	x %= n;
+	return x < 0 ? x + n : x;
+}
+
 SDL_Window* window;
 SDL_Renderer* renderer;
 SDL_GLContext gl;
@@ -92,6 +124,7 @@ float dt = 1 / 60.0f;
 
 mat4 projMat;
 mat4 viewMat;
+float farPlane = 100;
 
 GLuint texturedShader;
 
@@ -177,6 +210,118 @@ void Vector_add(Vector* vec, void* item) {
 	memcpy((uint8_t*)(vec->data) + vec->count++ * vec->size, item, vec->size);
 }
 
+// A persistent pool of threads that all run the same job. WorkerPool_run calls
+// fn(arg, index, count) once on each worker and once on the calling thread,
+// which takes index 0, and returns when every call has finished. Inside fn,
+// WorkerPool_barrier waits for all participants so a job can be split into
+// phases without going back through WorkerPool_run.
+typedef struct WorkerPool WorkerPool;
+
+typedef void (*WorkerFn)(void* arg, int index, int count);
+
+typedef struct WorkerThread {
+	WorkerPool* pool;
+	pthread_t thread;
+	int index;
+} WorkerThread;
+
+struct WorkerPool {
+	WorkerThread* threads;
+	int count;
+
+	pthread_barrier_t start;
+	pthread_barrier_t done;
+	pthread_barrier_t phase;
+
+	WorkerFn fn;
+	void* arg;
+	bool quit;
+};
+
+void* WorkerPool_thread(void* data) {
+	WorkerThread* thread = data;
+	WorkerPool* pool = thread->pool;
+
+	while (true) {
+		pthread_barrier_wait(&pool->start);
+		if (pool->quit) {
+			break;
+		}
+		pool->fn(pool->arg, thread->index, pool->count);
+		pthread_barrier_wait(&pool->done);
+	}
+
+	return NULL;
+}
+
+WorkerPool* WorkerPool_new(int count) {
+	if (count < 1) {
+		count = 1;
+	}
+
+	WorkerPool* pool = xmalloc(sizeof(WorkerPool));
+	pool->count = count;
+	pool->fn = NULL;
+	pool->arg = NULL;
+	pool->quit = false;
+
+	pthread_barrier_init(&pool->start, NULL, count);
+	pthread_barrier_init(&pool->done, NULL, count);
+	pthread_barrier_init(&pool->phase, NULL, count);
+
+	pool->threads = xmalloc(count * sizeof(WorkerThread));
+	for (int i = 1; i < count; i++) {
+		pool->threads[i].pool = pool;
+		pool->threads[i].index = i;
+		if (pthread_create(&pool->threads[i].thread, NULL, WorkerPool_thread, &pool->threads[i]) != 0) {
+			panic("Failed to create worker thread %d\n", i);
+		}
+	}
+
+	return pool;
+}
+
+void WorkerPool_run(WorkerPool* pool, WorkerFn fn, void* arg) {
+	if (pool->count == 1) {
+		fn(arg, 0, 1);
+		return;
+	}
+
+	pool->fn = fn;
+	pool->arg = arg;
+	pthread_barrier_wait(&pool->start);
+	fn(arg, 0, pool->count);
+	pthread_barrier_wait(&pool->done);
+}
+
+void WorkerPool_barrier(WorkerPool* pool) {
+	if (pool->count > 1) {
+		pthread_barrier_wait(&pool->phase);
+	}
+}
+
+void WorkerPool_delete(WorkerPool* pool) {
+	pool->quit = true;
+	if (pool->count > 1) {
+		pthread_barrier_wait(&pool->start);
+	}
+	for (int i = 1; i < pool->count; i++) {
+		pthread_join(pool->threads[i].thread, NULL);
+	}
+
+	pthread_barrier_destroy(&pool->start);
+	pthread_barrier_destroy(&pool->done);
+	pthread_barrier_destroy(&pool->phase);
+
+	xfree(pool->threads);
+	xfree(pool);
+}
+
+int cpu_count() {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n < 1 ? 1 : n;
+}
+
 char* read_file(const char* path) {
 	FILE* file = fopen(path, "r");
 	if (file == NULL) {
@@ -220,13 +365,19 @@ GLuint loadShader(const char* path, GLenum type) {
 	return shader;
 }
 
-GLuint loadShaderProg(const char* vs_path, const char* fs_path) {
+// lib_path, if not NULL, is a second vertex shader holding functions that
+// vs_path declares and calls.
+GLuint loadShaderProgLib(const char* vs_path, const char* lib_path, const char* fs_path) {
 	GLuint vs = loadShader(vs_path, GL_VERTEX_SHADER);
+	GLuint lib = lib_path != NULL ? loadShader(lib_path, GL_VERTEX_SHADER) : 0;
 	GLuint fs = loadShader(fs_path, GL_FRAGMENT_SHADER);
 
 	GLuint prog = glCreateProgram();
 
 	glAttachShader(prog, vs);
+	if (lib_path != NULL) {
+		glAttachShader(prog, lib);
+	}
 	glAttachShader(prog, fs);
 
 	glLinkProgram(prog);
@@ -249,14 +400,86 @@ GLuint loadShaderProg(const char* vs_path, const char* fs_path) {
 	glDeleteShader(vs);
 	glDeleteShader(fs);
 
+	if (lib_path != NULL) {
+		glDetachShader(prog, lib);
+		glDeleteShader(lib);
+	}
+
+	return prog;
+}
+
+GLuint loadShaderProg(const char* vs_path, const char* fs_path) {
+	return loadShaderProgLib(vs_path, NULL, fs_path);
+}
+
+// Needs a GL 4.3 context.
+GLuint loadComputeProg(const char* path) {
+	GLuint cs = loadShader(path, GL_COMPUTE_SHADER);
+	GLuint prog = glCreateProgram();
+
+	glAttachShader(prog, cs);
+	glLinkProgram(prog);
+
+	GLint status;
+	glGetProgramiv(prog, GL_LINK_STATUS, &status);
+	if (status == GL_FALSE) {
+		GLint len;
+		glGetProgramiv(prog, GL_INFO_LOG_LENGTH, &len);
+
+		char* buf = xmalloc(len);
+		glGetProgramInfoLog(prog, len, NULL, buf);
+		panic("Shader link error %s: %s\n", path, buf);
+		xfree(buf);
+	}
+
+	glDetachShader(prog, cs);
+	glDeleteShader(cs);
+
 	return prog;
 }
 
+// Creates the GL context for window. With compute asked for it tries GL 4.3
+// first, and settles for the 3.3 everything else needs if that fails.
+SDL_GLContext create_gl_context(bool compute) {
+	if (compute) {
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4);
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+		SDL_GLContext context = SDL_GL_CreateContext(window);
+		if (context != NULL) {
+			return context;
+		}
+	}
+
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+	SDL_GLContext context = SDL_GL_CreateContext(window);
+	if (context == NULL) {
+		panic("Failed to create a GL 3.3 context: %s\n", SDL_GetError());
+	}
+	return context;
+}
+
+// Whether the current context lists an extension, which core profiles only
+// tell one name at a time.
+bool gl_has_extension(const char* name) {
+	GLint count = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+	for (GLint i = 0; i < count; i++) {
+		if (strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), name) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
 typedef struct Model {
 	GLuint vao;
 	GLuint vbo;
+	GLuint ebo;
 	GLuint texture;
 	int vertexCount;
+	int indexCount;
+	GLenum indexType;
 } Model;
 
 typedef struct ModelVertex {
@@ -265,123 +488,632 @@ typedef struct ModelVertex {
 	vec3 normal;
 } ModelVertex;
 
-Model* Model_load(const char* path) {
-	FILE* file = fopen(path, "r");
-	if (file == NULL) {
-		panic("Unable to open file %s\n", path);
+// An OBJ file parsed into a vertex for each distinct face corner, three
+// uint32_t indices into them per triangle, and the material library it
+// names, or NULL.
+typedef struct ModelData {
+	Vector* vertices;
+	Vector* indices;
+	char* mtllib;
+} ModelData;
+
+// A face corner as read from the file. key holds its 0-based position,
+// texcoord and normal indices, with -1 for a missing texcoord or normal.
+typedef struct ModelCorner {
+	ModelVertex vertex;
+	int key[3];
+} ModelCorner;
+
+typedef struct ModelCornerEntry {
+	int key[3];
+	uint32_t index;
+} ModelCornerEntry;
+
+// Maps the key of every corner seen so far to the vertex emitted for it,
+// with open addressing and linear probing. Empty slots have key[0] = -1.
+typedef struct ModelCornerTable {
+	ModelCornerEntry* entries;
+	size_t capacity;
+	size_t count;
+} ModelCornerTable;
+
+// Cursor helpers for Model_parse. The file is memory mapped with no
+// terminating NUL, so each one stops at end, and none of them look at the
+// locale, which sscanf and strtof consult for every number they read.
+static inline const char* Model_skip_spaces(const char* p, const char* end) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+		p++;
 	}
+	return p;
+}
 
-	Vector* vertices = Vector_new(sizeof(vec3));
-	Vector* texcoords = Vector_new(sizeof(vec2));
-	Vector* normals = Vector_new(sizeof(vec3));
-	Vector* modelVertices = Vector_new(sizeof(ModelVertex));
+static inline bool Model_parse_int(const char** cursor, const char* end, int* out) {
+	const char* p = *cursor;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = *p++ == '-';
+	}
 
-	int texture;
+	const char* digits = p;
+	int value = 0;
+	while (p < end && *p >= '0' && *p <= '9') {
+		if (value < 100000000) {
+			value = value * 10 + (*p - '0');
+		}
+		p++;
+	}
+	if (p == digits) {
+		return false;
+	}
 
-	char line[256];
-	while (fgets(line, sizeof(line), file) != NULL) {
-		if (line[0] == 'v') {
-			if (line[1] == 't') {
-				vec2 texcoord;
-				sscanf(line, "vt %f %f", &texcoord[0], &texcoord[1]);
+	*out = negative ? -value : value;
+	*cursor = p;
+	return true;
+}
 
-				Vector_add(texcoords, texcoord);
+bool Model_parse_float(const char** cursor, const char* end, float* out) {
+	// Every power of ten up to 1e22 is exact in a double, so one multiply or
+	// divide rounds the decimal correctly before the cast to float.
+	static const double powers[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+	};
+
+	const char* p = *cursor;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = *p++ == '-';
+	}
+
+	// Digits past the 18th cannot change a float, so they only move the
+	// exponent.
+	uint64_t mantissa = 0;
+	int exponent = 0;
+	int digits = 0;
+	while (p < end && *p >= '0' && *p <= '9') {
+		if (mantissa < 100000000000000000ull) {
+			mantissa = mantissa * 10 + (*p - '0');
+		}
+		else {
+			exponent++;
+		}
+		digits++;
+		p++;
+	}
+	if (p < end && *p == '.') {
+		p++;
+		while (p < end && *p >= '0' && *p <= '9') {
+			if (mantissa < 100000000000000000ull) {
+				mantissa = mantissa * 10 + (*p - '0');
+				exponent--;
 			}
-			else if (line[1] == 'n') {
-				vec3 normal;
-				sscanf(line, "vn %f %f %f", &normal[0], &normal[1], &normal[2]);
-				
-				Vector_add(normals, normal);
+			digits++;
+			p++;
+		}
+	}
+	if (digits == 0) {
+		return false;
+	}
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		const char* q = p + 1;
+		int e;
+		if (Model_parse_int(&q, end, &e)) {
+			exponent += e;
+			p = q;
+		}
+	}
+
+	double value = mantissa;
+	while (exponent > 22) {
+		value *= 1e22;
+		exponent -= 22;
+	}
+	while (exponent < -22) {
+		value /= 1e22;
+		exponent += 22;
+	}
+	value = exponent < 0 ? value / powers[-exponent] : value * powers[exponent];
+
+	*out = negative ? -value : value;
+	*cursor = p;
+	return true;
+}
+
+// Reads count floats into out, returning false if the line has fewer.
+static inline bool Model_parse_floats(const char** cursor, const char* end, float* out, int count) {
+	for (int i = 0; i < count; i++) {
+		*cursor = Model_skip_spaces(*cursor, end);
+		if (!Model_parse_float(cursor, end, &out[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Turns a 1-based OBJ index, or a negative one counting back from the last
+// element read so far, into a 0-based one. Returns -1 if it is out of range.
+static inline int Model_resolve_index(int index, size_t count) {
+	if (index > 0 && (size_t)index <= count) {
+		return index - 1;
+	}
+	if (index < 0 && (size_t)-index <= count) {
+		return count + index;
+	}
+	return -1;
+}
+
+// Reads one v, v/t, v//n or v/t/n corner of a face. A corner without a
+// texcoord gets (0, 0) and one without a normal is flagged so the triangle's
+// own normal can be used instead.
+static inline bool Model_parse_corner(const char** cursor, const char* end, Vector* positions, Vector* texcoords, Vector* normals, ModelCorner* out) {
+	int v;
+	if (!Model_parse_int(cursor, end, &v) || (v = Model_resolve_index(v, positions->count)) < 0) {
+		return false;
+	}
+	memcpy(out->vertex.pos, ((vec3*)positions->data)[v], sizeof(vec3));
+	out->vertex.uv[0] = 0;
+	out->vertex.uv[1] = 0;
+	out->key[0] = v;
+	out->key[1] = -1;
+	out->key[2] = -1;
+
+	const char* p = *cursor;
+	if (p < end && *p == '/') {
+		p++;
+		int t;
+		if (Model_parse_int(&p, end, &t)) {
+			if ((t = Model_resolve_index(t, texcoords->count)) < 0) {
+				return false;
 			}
-			else {
-				vec3 pos;
-				sscanf(line, "v %f %f %f", &pos[0], &pos[1], &pos[2]);
-				
-				Vector_add(vertices, pos);
+			memcpy(out->vertex.uv, ((vec2*)texcoords->data)[t], sizeof(vec2));
+			out->key[1] = t;
+		}
+		if (p < end && *p == '/') {
+			p++;
+			int n;
+			if (!Model_parse_int(&p, end, &n) || (n = Model_resolve_index(n, normals->count)) < 0) {
+				return false;
 			}
+			memcpy(out->vertex.normal, ((vec3*)normals->data)[n], sizeof(vec3));
+			out->key[2] = n;
 		}
-		else if (line[0] == 'm') {
-			char filename[256];
-			sscanf(line, "mtllib %s", filename);
+	}
+	*cursor = p;
+	return true;
+}
+
+static inline size_t Model_corner_hash(const int key[3], size_t capacity) {
+	uint64_t h = (uint64_t)key[0] * 0x9E3779B97F4A7C15ull;
+	h ^= (uint64_t)(uint32_t)key[1] * 0xC2B2AE3D27D4EB4Full;
+	h ^= (uint64_t)(uint32_t)key[2] * 0x165667B19E3779F9ull;
+	return (h ^ (h >> 29)) & (capacity - 1);
+}
 
-			FILE* mtlFile = fopen(filename, "r");
-			if (mtlFile == NULL) {
-				panic("Unable to open file %s\n", path);
+// Returns the index of the vertex for a corner's key, adding the vertex if
+// the key is new. The table doubles whenever it would pass half full.
+uint32_t Model_add_corner(ModelData* model, ModelCornerTable* table, const ModelCorner* corner) {
+	if (2 * (table->count + 1) > table->capacity) {
+		ModelCornerEntry* old = table->entries;
+		size_t oldCapacity = table->capacity;
+
+		table->capacity = oldCapacity > 0 ? oldCapacity * 2 : 1024;
+		table->entries = xmalloc(table->capacity * sizeof(ModelCornerEntry));
+		memset(table->entries, 0xff, table->capacity * sizeof(ModelCornerEntry));
+		for (size_t i = 0; i < oldCapacity; i++) {
+			if (old[i].key[0] >= 0) {
+				size_t slot = Model_corner_hash(old[i].key, table->capacity);
+				while (table->entries[slot].key[0] >= 0) {
+					slot = (slot + 1) & (table->capacity - 1);
+				}
+				table->entries[slot] = old[i];
 			}
+		}
+		xfree(old);
+	}
+
+	size_t slot = Model_corner_hash(corner->key, table->capacity);
+	while (table->entries[slot].key[0] >= 0) {
+		ModelCornerEntry* entry = &table->entries[slot];
+		if (entry->key[0] == corner->key[0] && entry->key[1] == corner->key[1] && entry->key[2] == corner->key[2]) {
+			return entry->index;
+		}
+		slot = (slot + 1) & (table->capacity - 1);
+	}
+
+	ModelCornerEntry* entry = &table->entries[slot];
+	memcpy(entry->key, corner->key, sizeof(entry->key));
+	entry->index = model->vertices->count;
+	table->count++;
+	Vector_add(model->vertices, (void*)&corner->vertex);
+	return entry->index;
+}
 
-			char line2[256];
-			while (fgets(line2, sizeof(line2), mtlFile)) {
-				if (line2[0] == 'm') {
-					char imgName[256];
-					sscanf(line2, "map_Kd %s", imgName);
+// Adds a triangle's indices, sharing vertices between corners with the same
+// key. Corners without a normal take the triangle's own, so they depend on
+// the triangle and always get a vertex of their own.
+static inline void Model_add_triangle(ModelData* model, ModelCornerTable* table, ModelCorner* a, ModelCorner* b, ModelCorner* c) {
+	ModelCorner* corners[3] = {a, b, c};
+	if (a->key[2] < 0 || b->key[2] < 0 || c->key[2] < 0) {
+		vec3 ab;
+		vec3 ac;
+		vec3 normal;
+		glm_vec3_sub(b->vertex.pos, a->vertex.pos, ab);
+		glm_vec3_sub(c->vertex.pos, a->vertex.pos, ac);
+		glm_vec3_cross(ab, ac, normal);
+		glm_vec3_normalize(normal);
+		for (int i = 0; i < 3; i++) {
+			if (corners[i]->key[2] < 0) {
+				glm_vec3_copy(normal, corners[i]->vertex.normal);
+			}
+		}
+	}
 
-					int texW;
-					int texH;
-					int comp;
+	for (int i = 0; i < 3; i++) {
+		uint32_t index;
+		if (corners[i]->key[2] < 0) {
+			index = model->vertices->count;
+			Vector_add(model->vertices, &corners[i]->vertex);
+		}
+		else {
+			index = Model_add_corner(model, table, corners[i]);
+		}
+		Vector_add(model->indices, &index);
+	}
+}
 
-					stbi_set_flip_vertically_on_load(1);
-					void* pixelData = stbi_load(imgName, &texW, &texH, &comp, 3);
+// Parses the geometry of an OBJ file without touching GL. The file is
+// memory mapped and read in place, so lines can be any length. Faces can
+// have any number of corners and are split into a fan of triangles. Corners
+// that repeat the same position, texcoord and normal share one vertex.
+ModelData Model_parse(const char* path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		panic("Unable to open file %s\n", path);
+	}
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		panic("Unable to stat file %s\n", path);
+	}
 
-					glActiveTexture(GL_TEXTURE0);
-					glGenTextures(1, &texture);
-					glBindTexture(GL_TEXTURE_2D, texture);
+	size_t size = info.st_size;
+	const char* data = "";
+	if (size > 0) {
+		data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			panic("Unable to map file %s\n", path);
+		}
+		madvise((void*)data, size, MADV_SEQUENTIAL);
+	}
+	close(fd);
 
-					glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_MIRRORED_REPEAT);
-					glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_MIRRORED_REPEAT);
+	Vector* positions = Vector_new(sizeof(vec3));
+	Vector* texcoords = Vector_new(sizeof(vec2));
+	Vector* normals = Vector_new(sizeof(vec3));
+	ModelData model = {Vector_new(sizeof(ModelVertex)), Vector_new(sizeof(uint32_t)), NULL};
+	ModelCornerTable table = {NULL, 0, 0};
+
+	const char* end = data + size;
+	const char* line = data;
+	int lineNumber = 0;
+	while (line < end) {
+		const char* lineEnd = memchr(line, '\n', end - line);
+		if (lineEnd == NULL) {
+			lineEnd = end;
+		}
+		lineNumber++;
 
-					glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-					glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		const char* p = Model_skip_spaces(line, lineEnd);
+		size_t length = lineEnd - p;
 
-					glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, texW, texH, 0, GL_RGB, GL_UNSIGNED_BYTE, pixelData);
-				
-					stbi_image_free(pixelData);
+		if (length >= 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+			vec3 pos;
+			p += 1;
+			if (!Model_parse_floats(&p, lineEnd, pos, 3)) {
+				panic("Bad vertex in %s line %d\n", path, lineNumber);
+			}
+			Vector_add(positions, pos);
+		}
+		else if (length >= 3 && p[0] == 'v' && p[1] == 't' && (p[2] == ' ' || p[2] == '\t')) {
+			vec2 texcoord;
+			p += 2;
+			if (!Model_parse_floats(&p, lineEnd, texcoord, 2)) {
+				panic("Bad texcoord in %s line %d\n", path, lineNumber);
+			}
+			Vector_add(texcoords, texcoord);
+		}
+		else if (length >= 3 && p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t')) {
+			vec3 normal;
+			p += 2;
+			if (!Model_parse_floats(&p, lineEnd, normal, 3)) {
+				panic("Bad normal in %s line %d\n", path, lineNumber);
+			}
+			Vector_add(normals, normal);
+		}
+		else if (length >= 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+			ModelCorner first;
+			ModelCorner previous;
+			ModelCorner corner;
+
+			p += 1;
+			int corners = 0;
+			while ((p = Model_skip_spaces(p, lineEnd)) < lineEnd) {
+				if (!Model_parse_corner(&p, lineEnd, positions, texcoords, normals, &corner)) {
+					panic("Bad face in %s line %d\n", path, lineNumber);
+				}
+				if (corners == 0) {
+					first = corner;
+				}
+				else if (corners >= 2) {
+					ModelCorner a = first;
+					ModelCorner b = previous;
+					ModelCorner c = corner;
+					Model_add_triangle(&model, &table, &a, &b, &c);
 				}
+				previous = corner;
+				corners++;
 			}
+			if (corners < 3) {
+				panic("Face with fewer than 3 corners in %s line %d\n", path, lineNumber);
+			}
+		}
+		else if (length > 7 && strncmp(p, "mtllib", 6) == 0 && (p[6] == ' ' || p[6] == '\t')) {
+			const char* name = Model_skip_spaces(p + 6, lineEnd);
+			const char* nameEnd = lineEnd;
+			while (nameEnd > name && (nameEnd[-1] == ' ' || nameEnd[-1] == '\t' || nameEnd[-1] == '\r')) {
+				nameEnd--;
+			}
+			xfree(model.mtllib);
+			model.mtllib = xmalloc(nameEnd - name + 1);
+			memcpy(model.mtllib, name, nameEnd - name);
+			model.mtllib[nameEnd - name] = '\0';
+		}
+
+		line = lineEnd + 1;
+	}
+
+	if (size > 0) {
+		munmap((void*)data, size);
+	}
 
-			fclose(mtlFile);
+	Vector_delete(positions);
+	Vector_delete(texcoords);
+	Vector_delete(normals);
+	xfree(table.entries);
+
+	return model;
+}
+
+GLuint Assets_texture(const char* path);
+void Assets_release_texture(GLuint texture);
+
+// Finds the last map_Kd image named in a material library, returning false
+// if there is none. imgName must hold 256 bytes.
+bool Model_mtl_image(const char* path, char* imgName) {
+	FILE* file = fopen(path, "r");
+	if (file == NULL) {
+		panic("Unable to open file %s\n", path);
+	}
+
+	bool found = false;
+	char line[256];
+	while (fgets(line, sizeof(line), file)) {
+		found = sscanf(line, "map_Kd %255s", imgName) == 1 || found;
+	}
+
+	fclose(file);
+	return found;
+}
+
+// Returns the texture of a material library's map_Kd image, shared through
+// the asset registry, or 0 if it has none.
+GLuint Model_load_mtl(const char* path) {
+	char imgName[256];
+	return Model_mtl_image(path, imgName) ? Assets_texture(imgName) : 0;
+}
+
+// Model_load keeps a binary copy of each OBJ next to it, at <path>.mesh, so
+// later loads map it and hand its streams straight to GL instead of parsing
+// text. The file is the header, the material library name, the vertices in
+// ModelVertex layout and the indices already narrowed to indexSize bytes,
+// each stream starting on a 16 byte boundary. It is written in the host's
+// byte order and is only trusted while the source's size and mtime match.
+#define MODEL_CACHE_MAGIC 0x4853454d4a48424cull
+#define MODEL_CACHE_VERSION 1
+
+typedef struct ModelCacheHeader {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t vertexSize;
+	uint64_t sourceSize;
+	int64_t sourceMtimeSec;
+	int64_t sourceMtimeNsec;
+	uint32_t vertexCount;
+	uint32_t indexCount;
+	uint32_t indexSize;
+	uint32_t mtllibLength;
+} ModelCacheHeader;
+
+// A mesh ready for GL, pointing into a packed cache file in memory.
+typedef struct ModelMesh {
+	const ModelVertex* vertices;
+	uint32_t vertexCount;
+	const void* indices;
+	uint32_t indexCount;
+	uint32_t indexSize;
+	const char* mtllib;
+} ModelMesh;
+
+static inline size_t Model_cache_align(size_t offset) {
+	return (offset + 15) & ~(size_t)15;
+}
+
+// Packs parsed geometry into the cache file layout, returning its size.
+size_t Model_pack(const ModelData* data, const struct stat* source, void** out) {
+	ModelCacheHeader header = {0};
+	header.magic = MODEL_CACHE_MAGIC;
+	header.version = MODEL_CACHE_VERSION;
+	header.vertexSize = sizeof(ModelVertex);
+	header.sourceSize = source->st_size;
+	header.sourceMtimeSec = source->st_mtim.tv_sec;
+	header.sourceMtimeNsec = source->st_mtim.tv_nsec;
+	header.vertexCount = data->vertices->count;
+	header.indexCount = data->indices->count;
+	header.indexSize = data->vertices->count <= 65536 ? sizeof(uint16_t) : sizeof(uint32_t);
+	header.mtllibLength = data->mtllib != NULL ? strlen(data->mtllib) : 0;
+
+	size_t vertexOffset = Model_cache_align(sizeof(header) + header.mtllibLength + 1);
+	size_t indexOffset = Model_cache_align(vertexOffset + (size_t)header.vertexCount * sizeof(ModelVertex));
+	size_t size = indexOffset + (size_t)header.indexCount * header.indexSize;
+
+	uint8_t* blob = xmalloc(size);
+	memset(blob, 0, size);
+	memcpy(blob, &header, sizeof(header));
+	if (data->mtllib != NULL) {
+		memcpy(blob + sizeof(header), data->mtllib, header.mtllibLength);
+	}
+	memcpy(blob + vertexOffset, data->vertices->data, (size_t)header.vertexCount * sizeof(ModelVertex));
+
+	const uint32_t* indices = data->indices->data;
+	if (header.indexSize == sizeof(uint16_t)) {
+		uint16_t* narrow = (uint16_t*)(blob + indexOffset);
+		for (uint32_t i = 0; i < header.indexCount; i++) {
+			narrow[i] = indices[i];
 		}
-		else if (line[0] == 'f') {
-			int v1;
-			int v2;
-			int v3;
-			int t1;
-			int t2;
-			int t3;
-			int n1;
-			int n2;
-			int n3;
+	}
+	else {
+		memcpy(blob + indexOffset, indices, (size_t)header.indexCount * sizeof(uint32_t));
+	}
 
-			sscanf(line, "f %d/%d/%d %d/%d/%d %d/%d/%d",
-				&v1, &t1, &n1,
-				&v2, &t2, &n2,
-				&v3, &t3, &n3);
+	*out = blob;
+	return size;
+}
+
+// Points a mesh into a packed cache file. Returns false if the file is not
+// one, was written for another layout or source, or is cut short.
+bool Model_unpack(const void* blob, size_t size, const struct stat* source, ModelMesh* mesh) {
+	ModelCacheHeader header;
+	if (size < sizeof(header)) {
+		return false;
+	}
+	memcpy(&header, blob, sizeof(header));
+
+	if (header.magic != MODEL_CACHE_MAGIC || header.version != MODEL_CACHE_VERSION || header.vertexSize != sizeof(ModelVertex)) {
+		return false;
+	}
+	if (header.sourceSize != (uint64_t)source->st_size || header.sourceMtimeSec != source->st_mtim.tv_sec || header.sourceMtimeNsec != source->st_mtim.tv_nsec) {
+		return false;
+	}
+	if (header.indexSize != sizeof(uint16_t) && header.indexSize != sizeof(uint32_t)) {
+		return false;
+	}
+
+	size_t vertexOffset = Model_cache_align(sizeof(header) + (size_t)header.mtllibLength + 1);
+	size_t indexOffset = Model_cache_align(vertexOffset + (size_t)header.vertexCount * sizeof(ModelVertex));
+	if (indexOffset + (size_t)header.indexCount * header.indexSize != size) {
+		return false;
+	}
+
+	const uint8_t* bytes = blob;
+	mesh->vertices = (const ModelVertex*)(bytes + vertexOffset);
+	mesh->vertexCount = header.vertexCount;
+	mesh->indices = bytes + indexOffset;
+	mesh->indexCount = header.indexCount;
+	mesh->indexSize = header.indexSize;
+	mesh->mtllib = header.mtllibLength > 0 ? (const char*)(bytes + sizeof(header)) : NULL;
+	return true;
+}
+
+// Maps a cache file, the .mesh and .tex files baked beside their sources,
+// returning its mapping and size, or NULL if there is none.
+void* Cache_map(const char* cachePath, size_t* size) {
+	int fd = open(cachePath, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat info;
+	void* map = NULL;
+	if (fstat(fd, &info) == 0 && info.st_size > 0) {
+		map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		map = map != MAP_FAILED ? map : NULL;
+		*size = info.st_size;
+	}
+	close(fd);
+	return map;
+}
 
-			ModelVertex mv1;
-			ModelVertex mv2;
-			ModelVertex mv3;
+// Writes a packed cache file. It goes through a temporary file and a rename
+// so a crash or another instance never sees half of one. A read-only data
+// directory just means every load parses or decodes the source again.
+void Cache_write(const char* cachePath, const void* blob, size_t size) {
+	char tempPath[4096 + 16];
+	snprintf(tempPath, sizeof(tempPath), "%s.%d.tmp", cachePath, (int)getpid());
 
-			memcpy(mv1.pos, ((vec3*)vertices->data)[v1 - 1], sizeof(vec3));
-			memcpy(mv1.uv, ((vec2*)texcoords->data)[t1 - 1], sizeof(vec2));
-			memcpy(mv1.normal, ((vec3*)normals->data)[n1 - 1], sizeof(vec3));
+	FILE* file = fopen(tempPath, "wb");
+	if (file == NULL) {
+		return;
+	}
+	bool written = fwrite(blob, 1, size, file) == size;
+	written = fclose(file) == 0 && written;
+	if (!written || rename(tempPath, cachePath) != 0) {
+		unlink(tempPath);
+	}
+}
 
-			memcpy(mv2.pos, ((vec3*)vertices->data)[v2 - 1], sizeof(vec3));
-			memcpy(mv2.uv, ((vec2*)texcoords->data)[t2 - 1], sizeof(vec2));
-			memcpy(mv2.normal, ((vec3*)normals->data)[n2 - 1], sizeof(vec3));
+// An OBJ file's mesh, from the mapped cache file or from packing it afresh.
+typedef struct ModelFile {
+	ModelMesh mesh;
+	void* map;
+	size_t mapSize;
+	void* packed;
+} ModelFile;
+
+// Reads an OBJ file from its cache file if that is up to date, otherwise
+// parses it and writes the cache file for next time. Doesn't touch GL, so
+// it can run on any thread.
+void Model_open(const char* path, ModelFile* file) {
+	struct stat source;
+	if (stat(path, &source) != 0) {
+		panic("Unable to open file %s\n", path);
+	}
 
-			memcpy(mv3.pos, ((vec3*)vertices->data)[v3 - 1], sizeof(vec3));
-			memcpy(mv3.uv, ((vec2*)texcoords->data)[t3 - 1], sizeof(vec2));
-			memcpy(mv3.normal, ((vec3*)normals->data)[n3 - 1], sizeof(vec3));
+	char cachePath[4096];
+	snprintf(cachePath, sizeof(cachePath), "%s.mesh", path);
 
-			Vector_add(modelVertices, &mv1);
-			Vector_add(modelVertices, &mv2);
-			Vector_add(modelVertices, &mv3);
+	file->mapSize = 0;
+	file->map = Cache_map(cachePath, &file->mapSize);
+	file->packed = NULL;
+	if (file->map == NULL || !Model_unpack(file->map, file->mapSize, &source, &file->mesh)) {
+		if (file->map != NULL) {
+			munmap(file->map, file->mapSize);
+			file->map = NULL;
 		}
+
+		ModelData data = Model_parse(path);
+		size_t size = Model_pack(&data, &source, &file->packed);
+		Cache_write(cachePath, file->packed, size);
+		Model_unpack(file->packed, size, &source, &file->mesh);
+
+		Vector_delete(data.vertices);
+		Vector_delete(data.indices);
+		xfree(data.mtllib);
 	}
+}
 
-	fclose(file);
+void Model_close(ModelFile* file) {
+	if (file->map != NULL) {
+		munmap(file->map, file->mapSize);
+	}
+	xfree(file->packed);
+}
 
+// Creates the GL buffers of a mesh. The model takes over a reference to
+// texture, which may be 0.
+Model* Model_upload(const ModelMesh* mesh, GLuint texture) {
 	Model* model = xmalloc(sizeof(Model));
-	model->vertexCount = modelVertices->count;
+	model->vertexCount = mesh->vertexCount;
+	model->indexCount = mesh->indexCount;
+	model->indexType = mesh->indexSize == sizeof(uint16_t) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
 	model->texture = texture;
 
 	glGenVertexArrays(1, &model->vao);
@@ -389,7 +1121,11 @@ Model* Model_load(const char* path) {
 
 	glGenBuffers(1, &model->vbo);
 	glBindBuffer(GL_ARRAY_BUFFER, model->vbo);
-	glBufferData(GL_ARRAY_BUFFER, modelVertices->count * sizeof(ModelVertex), modelVertices->data, GL_STATIC_DRAW);
+	glBufferData(GL_ARRAY_BUFFER, (size_t)mesh->vertexCount * sizeof(ModelVertex), mesh->vertices, GL_STATIC_DRAW);
+
+	glGenBuffers(1, &model->ebo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model->ebo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, (size_t)mesh->indexCount * mesh->indexSize, mesh->indices, GL_STATIC_DRAW);
 
 	glEnableVertexAttribArray(0);
 	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(ModelVertex), 0);
@@ -400,18 +1136,931 @@ Model* Model_load(const char* path) {
 	glEnableVertexAttribArray(2);
 	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(ModelVertex), (void*)(5 * sizeof(float)));
 
-	Vector_delete(vertices);
-	Vector_delete(texcoords);
-	Vector_delete(normals);
-	Vector_delete(modelVertices);
+	// The index buffer binding belongs to the VAO, so unbind it before any
+	// later element buffer can be bound into it.
+	glBindVertexArray(0);
 
 	return model;
 }
 
-GLuint mat_loc;
-GLuint view_loc;
-GLuint tex_loc;
-
+Model* Model_load(const char* path) {
+	ModelFile file;
+	Model_open(path, &file);
+	Model* model = Model_upload(&file.mesh, file.mesh.mtllib != NULL ? Model_load_mtl(file.mesh.mtllib) : 0);
+	Model_close(&file);
+	return model;
+}
+
+// The GPU memory of a model's buffers.
+size_t Model_bytes(const Model* model) {
+	return (size_t)model->vertexCount * sizeof(ModelVertex) + (size_t)model->indexCount * (model->indexType == GL_UNSIGNED_SHORT ? 2 : 4);
+}
+
+// Frees a model's buffers and drops its reference to its texture.
+void Model_delete(Model* model) {
+	glDeleteVertexArrays(1, &model->vao);
+	glDeleteBuffers(1, &model->vbo);
+	glDeleteBuffers(1, &model->ebo);
+	if (model->texture != 0) {
+		Assets_release_texture(model->texture);
+	}
+	xfree(model);
+}
+
+// Decoded pixels of an image file.
+typedef struct Image {
+	unsigned char* pixels;
+	int w;
+	int h;
+	int comp;
+} Image;
+
+// Decodes an image file to channels components, or the file's own if 0.
+// stb_image's own flip is one flag shared by every thread, which is always
+// left off, so rows are flipped here and any thread can load images.
+Image Image_load(const char* path, bool flip, int channels) {
+	Image image;
+	image.pixels = stbi_load(path, &image.w, &image.h, &image.comp, channels);
+	if (image.pixels == NULL) {
+		panic("Unable to load image %s\n", path);
+	}
+	image.comp = channels != 0 ? channels : image.comp;
+
+	if (flip) {
+		size_t stride = (size_t)image.w * image.comp;
+		unsigned char* row = xmalloc(stride);
+		for (int y = 0; y < image.h / 2; y++) {
+			unsigned char* top = image.pixels + y * stride;
+			unsigned char* bottom = image.pixels + (image.h - 1 - y) * stride;
+			memcpy(row, top, stride);
+			memcpy(top, bottom, stride);
+			memcpy(bottom, row, stride);
+		}
+		xfree(row);
+	}
+	return image;
+}
+
+// Textures are baked into a container beside their source, <path>.tex, or
+// <first face>.cube.tex for a cubemap, which holds every face of a full mip
+// chain ready to upload level by level with nothing to decode. The header
+// and a table of levels come first, then the levels from the largest down,
+// each holding its faces in order and starting on a 16 byte boundary. The
+// levels are RGB8 rows bottom up, or BC1 blocks with --texture-bc1.
+// A file is only trusted while its sources' sizes and mtimes hash to the
+// same key. Like the .mesh files it is in the host's byte order.
+#define TEXTURE_MAGIC 0x5845544a48424c42ull
+#define TEXTURE_VERSION 1
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+
+typedef enum TextureFormat {
+	TEXTURE_RGB8,
+	TEXTURE_BC1,
+} TextureFormat;
+
+typedef struct TextureHeader {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t format;
+	uint32_t width;
+	uint32_t height;
+	uint32_t faces;
+	uint32_t levels;
+	uint64_t sourceKey;
+} TextureHeader;
+
+typedef struct TextureLevel {
+	uint32_t w;
+	uint32_t h;
+	// Where the level's first face starts in the file, and the size of each.
+	uint64_t offset;
+	uint64_t faceBytes;
+} TextureLevel;
+
+// A baked texture, mapped from its file or packed afresh.
+typedef struct TextureFile {
+	const TextureHeader* header;
+	const TextureLevel* levels;
+	const uint8_t* data;
+	void* map;
+	size_t mapSize;
+	void* packed;
+} TextureFile;
+
+// The format textures are baked in and used in, set once the context exists:
+// BC1 with --texture-bc1 where the GL has S3TC, otherwise RGB8.
+TextureFormat textureFormat;
+
+uint64_t Texture_source_key(const char* const* paths, int count) {
+	uint64_t key = 0xcbf29ce484222325ull;
+	for (int i = 0; i < count; i++) {
+		struct stat info;
+		if (stat(paths[i], &info) != 0) {
+			panic("Unable to open file %s\n", paths[i]);
+		}
+		int64_t fields[3] = {info.st_size, info.st_mtim.tv_sec, info.st_mtim.tv_nsec};
+		const uint8_t* bytes = (const uint8_t*)fields;
+		for (size_t b = 0; b < sizeof(fields); b++) {
+			key = (key ^ bytes[b]) * 0x100000001b3ull;
+		}
+	}
+	return key;
+}
+
+// out must hold 4096 bytes.
+void Texture_bake_path(const char* const* paths, int count, char* out) {
+	snprintf(out, 4096, count == 6 ? "%s.cube.tex" : "%s.tex", paths[0]);
+}
+
+size_t Texture_level_bytes(TextureFormat format, int w, int h) {
+	if (format == TEXTURE_BC1) {
+		return (size_t)((w + 3) / 4) * ((h + 3) / 4) * 8;
+	}
+	return (size_t)w * h * 3;
+}
+
+// Halves an RGB image with a 2x2 box filter, repeating the last row or
+// column of an odd size.
+Image Image_downsample(const Image* src) {
+	Image dst;
+	dst.w = src->w > 1 ? src->w / 2 : 1;
+	dst.h = src->h > 1 ? src->h / 2 : 1;
+	dst.comp = 3;
+	dst.pixels = xmalloc((size_t)dst.w * dst.h * 3);
+
+	for (int y = 0; y < dst.h; y++) {
+		int y0 = clampi(2 * y, 0, src->h - 1);
+		int y1 = clampi(2 * y + 1, 0, src->h - 1);
+		for (int x = 0; x < dst.w; x++) {
+			int x0 = clampi(2 * x, 0, src->w - 1);
+			int x1 = clampi(2 * x + 1, 0, src->w - 1);
+			for (int c = 0; c < 3; c++) {
+				int sum = src->pixels[((size_t)y0 * src->w + x0) * 3 + c] + src->pixels[((size_t)y0 * src->w + x1) * 3 + c]
+					+ src->pixels[((size_t)y1 * src->w + x0) * 3 + c] + src->pixels[((size_t)y1 * src->w + x1) * 3 + c];
+				dst.pixels[((size_t)y * dst.w + x) * 3 + c] = (sum + 2) / 4;
+			}
+		}
+	}
+	return dst;
+}
+
+static inline uint16_t Texture_pack_565(const int* rgb) {
+	return ((rgb[0] * 31 + 127) / 255) << 11 | ((rgb[1] * 63 + 127) / 255) << 5 | ((rgb[2] * 31 + 127) / 255);
+}
+
+static inline void Texture_unpack_565(uint16_t c, int* rgb) {
+	rgb[0] = (c >> 11) * 255 / 31;
+	rgb[1] = (c >> 5 & 63) * 255 / 63;
+	rgb[2] = (c & 31) * 255 / 31;
+}
+
+// Encodes an RGB image as BC1 blocks. Each block's endpoints are the corners
+// of its colours' bounding box pulled in by a sixteenth, and each pixel takes
+// the nearest of the four colours between them.
+void Texture_encode_bc1(const Image* image, uint8_t* out) {
+	for (int by = 0; by < image->h; by += 4) {
+		for (int bx = 0; bx < image->w; bx += 4) {
+			int block[16][3];
+			int lo[3] = {255, 255, 255};
+			int hi[3] = {0, 0, 0};
+			for (int i = 0; i < 16; i++) {
+				int x = clampi(bx + i % 4, 0, image->w - 1);
+				int y = clampi(by + i / 4, 0, image->h - 1);
+				for (int c = 0; c < 3; c++) {
+					block[i][c] = image->pixels[((size_t)y * image->w + x) * 3 + c];
+					lo[c] = block[i][c] < lo[c] ? block[i][c] : lo[c];
+					hi[c] = block[i][c] > hi[c] ? block[i][c] : hi[c];
+				}
+			}
+			for (int c = 0; c < 3; c++) {
+				int inset = (hi[c] - lo[c]) / 16;
+				lo[c] += inset;
+				hi[c] -= inset;
+			}
+
+			uint16_t c0 = Texture_pack_565(hi);
+			uint16_t c1 = Texture_pack_565(lo);
+			if (c0 < c1) {
+				uint16_t swap = c0;
+				c0 = c1;
+				c1 = swap;
+			}
+
+			int palette[4][3];
+			Texture_unpack_565(c0, palette[0]);
+			Texture_unpack_565(c1, palette[1]);
+			for (int c = 0; c < 3; c++) {
+				palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+				palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+			}
+
+			// With c0 == c1 the block is in its 3 colour mode, where index 0
+			// is still c0 and every pixel is nearest to it anyway.
+			uint32_t indices = 0;
+			for (int i = 0; i < 16; i++) {
+				int best = 0;
+				int bestDist = INT32_MAX;
+				for (int p = 0; p < (c0 == c1 ? 1 : 4); p++) {
+					int dr = block[i][0] - palette[p][0];
+					int dg = block[i][1] - palette[p][1];
+					int db = block[i][2] - palette[p][2];
+					int dist = dr * dr + dg * dg + db * db;
+					if (dist < bestDist) {
+						bestDist = dist;
+						best = p;
+					}
+				}
+				indices |= (uint32_t)best << (2 * i);
+			}
+
+			memcpy(out, &c0, 2);
+			memcpy(out + 2, &c1, 2);
+			memcpy(out + 4, &indices, 4);
+			out += 8;
+		}
+	}
+}
+
+// Bakes RGB faces of the same size and their mip chains down to 1x1 into
+// the container layout, returning its size. The faces are left as they were.
+size_t Texture_pack(const Image* faces, int count, TextureFormat format, uint64_t sourceKey, void** out) {
+	int levels = 1;
+	while ((faces[0].w >> levels) > 0 || (faces[0].h >> levels) > 0) {
+		levels++;
+	}
+
+	TextureHeader header = {0};
+	header.magic = TEXTURE_MAGIC;
+	header.version = TEXTURE_VERSION;
+	header.format = format;
+	header.width = faces[0].w;
+	header.height = faces[0].h;
+	header.faces = count;
+	header.levels = levels;
+	header.sourceKey = sourceKey;
+
+	TextureLevel table[levels];
+	size_t size = Model_cache_align(sizeof(header) + levels * sizeof(TextureLevel));
+	for (int l = 0; l < levels; l++) {
+		table[l].w = faces[0].w >> l > 0 ? faces[0].w >> l : 1;
+		table[l].h = faces[0].h >> l > 0 ? faces[0].h >> l : 1;
+		table[l].offset = size;
+		table[l].faceBytes = Texture_level_bytes(format, table[l].w, table[l].h);
+		size = Model_cache_align(size + count * table[l].faceBytes);
+	}
+
+	uint8_t* blob = xmalloc(size);
+	memset(blob, 0, size);
+	memcpy(blob, &header, sizeof(header));
+	memcpy(blob + sizeof(header), table, levels * sizeof(TextureLevel));
+
+	for (int f = 0; f < count; f++) {
+		Image level = faces[f];
+		for (int l = 0; l < levels; l++) {
+			uint8_t* dst = blob + table[l].offset + f * table[l].faceBytes;
+			if (format == TEXTURE_BC1) {
+				Texture_encode_bc1(&level, dst);
+			}
+			else {
+				memcpy(dst, level.pixels, table[l].faceBytes);
+			}
+
+			if (l + 1 < levels) {
+				Image next = Image_downsample(&level);
+				if (l > 0) {
+					xfree(level.pixels);
+				}
+				level = next;
+			}
+			else if (l > 0) {
+				xfree(level.pixels);
+			}
+		}
+	}
+
+	*out = blob;
+	return size;
+}
+
+// Points a texture file into a baked container. Returns false if it is not
+// one, was baked from other sources, or is cut short.
+bool Texture_unpack(const void* blob, size_t size, uint64_t sourceKey, TextureFile* file) {
+	const TextureHeader* header = blob;
+	if (size < sizeof(TextureHeader) || header->magic != TEXTURE_MAGIC || header->version != TEXTURE_VERSION || header->sourceKey != sourceKey) {
+		return false;
+	}
+	if ((header->format != TEXTURE_RGB8 && header->format != TEXTURE_BC1) || (header->faces != 1 && header->faces != 6) || header->levels < 1 || header->levels > 32) {
+		return false;
+	}
+	if (sizeof(TextureHeader) + header->levels * sizeof(TextureLevel) > size) {
+		return false;
+	}
+
+	const TextureLevel* levels = (const TextureLevel*)((const uint8_t*)blob + sizeof(TextureHeader));
+	for (uint32_t l = 0; l < header->levels; l++) {
+		uint32_t w = header->width >> l > 0 ? header->width >> l : 1;
+		uint32_t h = header->height >> l > 0 ? header->height >> l : 1;
+		if (levels[l].w != w || levels[l].h != h) {
+			return false;
+		}
+		if (levels[l].faceBytes != Texture_level_bytes(header->format, levels[l].w, levels[l].h) || levels[l].offset + header->faces * levels[l].faceBytes > size) {
+			return false;
+		}
+	}
+
+	file->header = header;
+	file->levels = levels;
+	file->data = blob;
+	return true;
+}
+
+// Decodes the sources of a texture, one file or a cubemap's six faces, and
+// bakes them in format, writing the container beside them.
+void Texture_bake(const char* const* paths, int count, TextureFormat format, TextureFile* file) {
+	// The faces of the sky have always been loaded flipped, like the model
+	// textures, so v points up in both.
+	Image faces[6] = {0};
+	for (int i = 0; i < count; i++) {
+		faces[i] = Image_load(paths[i], true, 3);
+		if (faces[i].w != faces[0].w || faces[i].h != faces[0].h) {
+			panic("The faces of cubemap %s differ in size\n", paths[0]);
+		}
+	}
+
+	uint64_t key = Texture_source_key(paths, count);
+	size_t size = Texture_pack(faces, count, format, key, &file->packed);
+	for (int i = 0; i < count; i++) {
+		stbi_image_free(faces[i].pixels);
+	}
+
+	char bakePath[4096];
+	Texture_bake_path(paths, count, bakePath);
+	Cache_write(bakePath, file->packed, size);
+
+	file->map = NULL;
+	file->mapSize = 0;
+	Texture_unpack(file->packed, size, key, file);
+}
+
+// Maps the baked container of a texture if it is up to date and in
+// textureFormat, otherwise bakes it afresh in textureFormat. Doesn't touch
+// GL, so it can run on any thread.
+void Texture_open(const char* const* paths, int count, TextureFile* file) {
+	char bakePath[4096];
+	Texture_bake_path(paths, count, bakePath);
+
+	file->packed = NULL;
+	file->mapSize = 0;
+	file->map = Cache_map(bakePath, &file->mapSize);
+	if (file->map != NULL) {
+		if (Texture_unpack(file->map, file->mapSize, Texture_source_key(paths, count), file) && file->header->format == textureFormat) {
+			return;
+		}
+		munmap(file->map, file->mapSize);
+	}
+
+	Texture_bake(paths, count, textureFormat, file);
+}
+
+void Texture_close(TextureFile* file) {
+	if (file->map != NULL) {
+		munmap(file->map, file->mapSize);
+	}
+	xfree(file->packed);
+}
+
+// The GPU memory of every level and face.
+size_t Texture_bytes(const TextureFile* file) {
+	size_t bytes = 0;
+	for (uint32_t l = 0; l < file->header->levels; l++) {
+		bytes += file->header->faces * file->levels[l].faceBytes;
+	}
+	return bytes;
+}
+
+// Creates an empty texture for a baked file, sampled trilinearly through its
+// mips. A 2D texture repeats mirrored the way the models expect, a cubemap
+// clamps.
+GLuint Texture_create(const TextureFile* file) {
+	GLenum target = file->header->faces == 6 ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+	GLenum wrap = file->header->faces == 6 ? GL_CLAMP_TO_EDGE : GL_MIRRORED_REPEAT;
+
+	GLuint texture;
+	glActiveTexture(GL_TEXTURE0);
+	glGenTextures(1, &texture);
+	glBindTexture(target, texture);
+
+	glTexParameteri(target, GL_TEXTURE_WRAP_S, wrap);
+	glTexParameteri(target, GL_TEXTURE_WRAP_T, wrap);
+	glTexParameteri(target, GL_TEXTURE_WRAP_R, wrap);
+
+	glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(target, GL_TEXTURE_MAX_LEVEL, file->header->levels - 1);
+
+	return texture;
+}
+
+void Texture_upload_level(GLuint texture, const TextureFile* file, int level, int face) {
+	const TextureLevel* l = &file->levels[level];
+	const uint8_t* pixels = file->data + l->offset + face * l->faceBytes;
+	GLenum target = GL_TEXTURE_2D;
+	if (file->header->faces == 6) {
+		glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+		target = GL_TEXTURE_CUBE_MAP_POSITIVE_X + face;
+	}
+	else {
+		glBindTexture(GL_TEXTURE_2D, texture);
+	}
+
+	if (file->header->format == TEXTURE_BC1) {
+		glCompressedTexImage2D(target, level, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, l->w, l->h, 0, l->faceBytes, pixels);
+	}
+	else {
+		// The small levels' rows are not 4 byte aligned.
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexImage2D(target, level, GL_RGB, l->w, l->h, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	}
+}
+
+GLuint Texture_upload(const TextureFile* file) {
+	GLuint texture = Texture_create(file);
+	for (uint32_t l = 0; l < file->header->levels; l++) {
+		for (uint32_t f = 0; f < file->header->faces; f++) {
+			Texture_upload_level(texture, file, l, f);
+		}
+	}
+	return texture;
+}
+
+// Loads a texture from one image file, or a cubemap from six, through its
+// baked container, and reports its size in bytes.
+GLuint Texture_load(const char* const* paths, int count, size_t* bytes) {
+	TextureFile file;
+	Texture_open(paths, count, &file);
+	GLuint texture = Texture_upload(&file);
+	*bytes = Texture_bytes(&file);
+	Texture_close(&file);
+	return texture;
+}
+
+// Models, textures, shader programs and nanovg images shared by the paths
+// they were loaded from. Each Assets_<type> call takes a reference, loading
+// the asset only if nobody holds it yet, and each Assets_release_<type>
+// drops one, freeing the asset with the last. To swap an asset for a fresh
+// copy of itself, as the init functions do on every round, take the new
+// reference before releasing the old one so it stays loaded.
+typedef enum AssetType {
+	ASSET_MODEL,
+	ASSET_TEXTURE,
+	ASSET_SHADER,
+	ASSET_IMAGE,
+	ASSET_TYPE_COUNT,
+} AssetType;
+
+const char* assetTypeNames[ASSET_TYPE_COUNT] = {"model", "texture", "shader", "image"};
+
+typedef struct Asset {
+	AssetType type;
+	char* key;
+	int refs;
+
+	// An estimate of the GPU memory it holds, 0 for shader programs.
+	size_t bytes;
+
+	Model* model;
+	// The texture, program or nanovg image.
+	GLuint handle;
+} Asset;
+
+typedef struct AssetStats {
+	int count;
+	int refs;
+	size_t bytes;
+
+	// Since startup, how many requests loaded the asset and how many found
+	// it already loaded.
+	int loads;
+	int hits;
+} AssetStats;
+
+struct {
+	Vector* assets;
+	int loads[ASSET_TYPE_COUNT];
+	int hits[ASSET_TYPE_COUNT];
+} Assets;
+
+// Takes another reference to a loaded asset, or returns NULL if there is
+// none with this type and key.
+Asset* Assets_reuse(AssetType type, const char* key) {
+	if (Assets.assets == NULL) {
+		Assets.assets = Vector_new(sizeof(Asset));
+	}
+
+	Asset* assets = Assets.assets->data;
+	for (size_t i = 0; i < Assets.assets->count; i++) {
+		if (assets[i].type == type && strcmp(assets[i].key, key) == 0) {
+			assets[i].refs++;
+			Assets.hits[type]++;
+			return &assets[i];
+		}
+	}
+	return NULL;
+}
+
+Asset* Assets_add(AssetType type, const char* key) {
+	Asset asset = {0};
+	asset.type = type;
+	asset.key = xmalloc(strlen(key) + 1);
+	strcpy(asset.key, key);
+	asset.refs = 1;
+
+	Assets.loads[type]++;
+	Vector_add(Assets.assets, &asset);
+	return &((Asset*)Assets.assets->data)[Assets.assets->count - 1];
+}
+
+Model* Assets_model(const char* path) {
+	Asset* asset = Assets_reuse(ASSET_MODEL, path);
+	if (asset != NULL) {
+		return asset->model;
+	}
+
+	// Loading the model can add its texture, which moves the assets.
+	Model* model = Model_load(path);
+	asset = Assets_add(ASSET_MODEL, path);
+	asset->model = model;
+	asset->bytes = Model_bytes(model);
+	return model;
+}
+
+GLuint Assets_texture(const char* path) {
+	Asset* asset = Assets_reuse(ASSET_TEXTURE, path);
+	if (asset != NULL) {
+		return asset->handle;
+	}
+
+	size_t bytes;
+	GLuint texture = Texture_load(&path, 1, &bytes);
+	asset = Assets_add(ASSET_TEXTURE, path);
+	asset->handle = texture;
+	asset->bytes = bytes;
+	return texture;
+}
+
+// The registry key of a cubemap, built from its faces. key must hold 1024
+// bytes.
+void Assets_cubemap_key(const char* const* faces, char* key) {
+	snprintf(key, 1024, "cubemap %s %s %s %s %s %s", faces[0], faces[1], faces[2], faces[3], faces[4], faces[5]);
+}
+
+// A cubemap is a texture asset too, released with Assets_release_texture.
+GLuint Assets_cubemap(const char* const* faces) {
+	char key[1024];
+	Assets_cubemap_key(faces, key);
+
+	Asset* asset = Assets_reuse(ASSET_TEXTURE, key);
+	if (asset != NULL) {
+		return asset->handle;
+	}
+
+	size_t bytes;
+	GLuint texture = Texture_load(faces, 6, &bytes);
+	asset = Assets_add(ASSET_TEXTURE, key);
+	asset->handle = texture;
+	asset->bytes = bytes;
+	return texture;
+}
+
+// lib_path may be NULL, as for loadShaderProgLib.
+GLuint Assets_shader(const char* vs_path, const char* lib_path, const char* fs_path) {
+	char key[1024];
+	snprintf(key, sizeof(key), "%s %s %s", vs_path, lib_path != NULL ? lib_path : "-", fs_path);
+
+	Asset* asset = Assets_reuse(ASSET_SHADER, key);
+	if (asset != NULL) {
+		return asset->handle;
+	}
+
+	GLuint prog = loadShaderProgLib(vs_path, lib_path, fs_path);
+	asset = Assets_add(ASSET_SHADER, key);
+	asset->handle = prog;
+	return prog;
+}
+
+// A nanovg image on vg.
+int Assets_image(const char* path, int flags) {
+	char key[1024];
+	snprintf(key, sizeof(key), "%s %d", path, flags);
+
+	Asset* asset = Assets_reuse(ASSET_IMAGE, key);
+	if (asset != NULL) {
+		return asset->handle;
+	}
+
+	int image = nvgCreateImage(vg, path, flags);
+	if (image == 0) {
+		panic("Unable to load image %s\n", path);
+	}
+	int imageW;
+	int imageH;
+	nvgImageSize(vg, image, &imageW, &imageH);
+
+	asset = Assets_add(ASSET_IMAGE, key);
+	asset->handle = image;
+	asset->bytes = (size_t)imageW * imageH * 4;
+	return image;
+}
+
+// Drops a reference to the asset of the given type with the given model or
+// handle, freeing it if that was the last.
+void Assets_release(AssetType type, Model* model, GLuint handle) {
+	Asset* assets = Assets.assets != NULL ? Assets.assets->data : NULL;
+	size_t count = Assets.assets != NULL ? Assets.assets->count : 0;
+
+	size_t i = 0;
+	while (i < count && !(assets[i].type == type && assets[i].model == model && assets[i].handle == handle)) {
+		i++;
+	}
+	if (i == count) {
+		panic("Releasing a %s that is not loaded\n", assetTypeNames[type]);
+	}
+	if (--assets[i].refs > 0) {
+		return;
+	}
+
+	// Take it out of the registry first, since freeing a model releases its
+	// texture in turn.
+	Asset asset = assets[i];
+	assets[i] = assets[count - 1];
+	Assets.assets->count--;
+
+	switch (asset.type) {
+	case ASSET_MODEL:
+		Model_delete(asset.model);
+		break;
+	case ASSET_TEXTURE:
+		glDeleteTextures(1, &asset.handle);
+		break;
+	case ASSET_SHADER:
+		glDeleteProgram(asset.handle);
+		break;
+	case ASSET_IMAGE:
+		nvgDeleteImage(vg, asset.handle);
+		break;
+	default:
+		break;
+	}
+	xfree(asset.key);
+}
+
+void Assets_release_model(Model* model) {
+	Assets_release(ASSET_MODEL, model, 0);
+}
+
+void Assets_release_texture(GLuint texture) {
+	Assets_release(ASSET_TEXTURE, NULL, texture);
+}
+
+void Assets_release_shader(GLuint prog) {
+	Assets_release(ASSET_SHADER, NULL, prog);
+}
+
+void Assets_release_image(int image) {
+	Assets_release(ASSET_IMAGE, NULL, image);
+}
+
+AssetStats Assets_stats(AssetType type) {
+	AssetStats stats = {0};
+	stats.loads = Assets.loads[type];
+	stats.hits = Assets.hits[type];
+
+	size_t count = Assets.assets != NULL ? Assets.assets->count : 0;
+	for (size_t i = 0; i < count; i++) {
+		Asset* asset = &((Asset*)Assets.assets->data)[i];
+		if (asset->type == type) {
+			stats.count++;
+			stats.refs += asset->refs;
+			stats.bytes += asset->bytes;
+		}
+	}
+	return stats;
+}
+
+void Assets_print_stats() {
+	printf("%-8s %6s %6s %12s %6s %6s\n", "assets", "loaded", "refs", "bytes", "loads", "hits");
+	for (int type = 0; type < ASSET_TYPE_COUNT; type++) {
+		AssetStats stats = Assets_stats(type);
+		printf("%-8s %6d %6d %12zu %6d %6d\n", assetTypeNames[type], stats.count, stats.refs, stats.bytes, stats.loads, stats.hits);
+	}
+}
+
+// Loads assets in the background while the menu is up. The CPU half of
+// every job, decoding images and parsing or mapping meshes, runs on a pool
+// of workers. The GL thread calls Loader_update every frame to upload the
+// jobs the workers have finished, in order and for no longer than a time
+// budget, and adds each to the asset registry. The loader holds a reference
+// to everything it loaded until Loader_finish, so the init functions find
+// their assets resident however late they run.
+#define LOADER_MAX_JOBS 16
+
+typedef enum LoadJobType {
+	LOAD_MODEL,
+	LOAD_CUBEMAP,
+} LoadJobType;
+
+typedef struct LoadJob {
+	LoadJobType type;
+	// The model's OBJ file, or the cubemap's six faces.
+	const char* paths[6];
+
+	// Filled in by a worker before it sets decoded. A model's texture, if
+	// its material library names one, or the cubemap is in texture.
+	ModelFile model;
+	char textureName[256];
+	bool hasTexture;
+	TextureFile texture;
+	atomic_bool decoded;
+
+	// Set by Loader_update once the asset is in the registry. A cubemap is
+	// uploaded a face of a mip level per step, a model all in one.
+	int step;
+	bool resident;
+	AssetType assetType;
+	Model* asset;
+	GLuint handle;
+} LoadJob;
+
+struct {
+	LoadJob jobs[LOADER_MAX_JOBS];
+	int count;
+	atomic_int next;
+	int uploaded;
+
+	WorkerPool* workers;
+	pthread_t thread;
+	bool started;
+} Loader;
+
+LoadJob* Loader_add(LoadJobType type) {
+	if (Loader.started || Loader.count == LOADER_MAX_JOBS) {
+		panic("Can't add more load jobs\n");
+	}
+	LoadJob* job = &Loader.jobs[Loader.count++];
+	memset(job, 0, sizeof(LoadJob));
+	job->type = type;
+	return job;
+}
+
+void Loader_add_model(const char* path) {
+	LoadJob* job = Loader_add(LOAD_MODEL);
+	job->paths[0] = path;
+}
+
+void Loader_add_cubemap(const char* const* faces) {
+	LoadJob* job = Loader_add(LOAD_CUBEMAP);
+	memcpy(job->paths, faces, sizeof(job->paths));
+}
+
+void Loader_decode(LoadJob* job) {
+	if (job->type == LOAD_MODEL) {
+		Model_open(job->paths[0], &job->model);
+		if (job->model.mesh.mtllib != NULL) {
+			job->hasTexture = Model_mtl_image(job->model.mesh.mtllib, job->textureName);
+			if (job->hasTexture) {
+				const char* textureName = job->textureName;
+				Texture_open(&textureName, 1, &job->texture);
+			}
+		}
+	}
+	else {
+		Texture_open(job->paths, 6, &job->texture);
+	}
+}
+
+// Each participant takes the next job until there are none left.
+void Loader_work(void* arg, int index, int count) {
+	while (true) {
+		int i = atomic_fetch_add(&Loader.next, 1);
+		if (i >= Loader.count) {
+			break;
+		}
+		Loader_decode(&Loader.jobs[i]);
+		atomic_store_explicit(&Loader.jobs[i].decoded, true, memory_order_release);
+	}
+}
+
+void* Loader_thread(void* arg) {
+	WorkerPool_run(Loader.workers, Loader_work, NULL);
+	return NULL;
+}
+
+void Loader_start(int threads) {
+	Loader.workers = WorkerPool_new(threads);
+	Loader.started = true;
+	if (pthread_create(&Loader.thread, NULL, Loader_thread, NULL) != 0) {
+		panic("Failed to create the loader thread\n");
+	}
+}
+
+// Uploads the next part of a decoded job. Once it is all uploaded, puts its
+// asset in the registry, the loader holding the first reference, frees the
+// CPU copy and returns true.
+bool Loader_upload(LoadJob* job) {
+	char key[1024];
+	Asset* asset;
+
+	if (job->type == LOAD_MODEL) {
+		GLuint texture = 0;
+		if (job->hasTexture) {
+			asset = Assets_reuse(ASSET_TEXTURE, job->textureName);
+			if (asset != NULL) {
+				texture = asset->handle;
+			}
+			else {
+				texture = Texture_upload(&job->texture);
+				asset = Assets_add(ASSET_TEXTURE, job->textureName);
+				asset->handle = texture;
+				asset->bytes = Texture_bytes(&job->texture);
+			}
+			Texture_close(&job->texture);
+		}
+
+		Model* model = Model_upload(&job->model.mesh, texture);
+		Model_close(&job->model);
+
+		asset = Assets_add(ASSET_MODEL, job->paths[0]);
+		asset->model = model;
+		asset->bytes = Model_bytes(model);
+		job->assetType = ASSET_MODEL;
+		job->asset = model;
+	}
+	else {
+		if (job->step == 0) {
+			job->handle = Texture_create(&job->texture);
+		}
+		Texture_upload_level(job->handle, &job->texture, job->step / 6, job->step % 6);
+		if (++job->step < 6 * (int)job->texture.header->levels) {
+			return false;
+		}
+
+		Assets_cubemap_key(job->paths, key);
+		asset = Assets_add(ASSET_TEXTURE, key);
+		asset->handle = job->handle;
+		asset->bytes = Texture_bytes(&job->texture);
+		Texture_close(&job->texture);
+		job->assetType = ASSET_TEXTURE;
+	}
+
+	job->resident = true;
+	return true;
+}
+
+// Uploads finished jobs in the order they were added until budget seconds
+// have passed, always at least one step if one is ready. Returns true once
+// every job is resident.
+bool Loader_update(double budget) {
+	double start = time_seconds();
+	while (Loader.uploaded < Loader.count && time_seconds() - start < budget) {
+		LoadJob* job = &Loader.jobs[Loader.uploaded];
+		if (!atomic_load_explicit(&job->decoded, memory_order_acquire)) {
+			break;
+		}
+		if (Loader_upload(job)) {
+			Loader.uploaded++;
+		}
+	}
+	return Loader.uploaded == Loader.count;
+}
+
+// Stops the workers and drops the loader's references, once whatever needs
+// the assets has taken its own.
+void Loader_finish() {
+	pthread_join(Loader.thread, NULL);
+	WorkerPool_delete(Loader.workers);
+
+	for (int i = 0; i < Loader.count; i++) {
+		if (Loader.jobs[i].assetType == ASSET_MODEL) {
+			Assets_release_model(Loader.jobs[i].asset);
+		}
+		else {
+			Assets_release_texture(Loader.jobs[i].handle);
+		}
+	}
+	Loader.count = 0;
+	Loader.uploaded = 0;
+	Loader.started = false;
+	atomic_store(&Loader.next, 0);
+}
+
+GLuint mat_loc;
+GLuint view_loc;
+GLuint tex_loc;
+
 struct {
 	vec3 pos;
 	vec3 dir;
@@ -434,7 +2083,11 @@ struct {
 } Blahaj;
 
 void Blahaj_init() {
-	Blahaj.model = Model_load("data/models/blahaj.obj");
+	Model* model = Assets_model("data/models/blahaj.obj");
+	if (Blahaj.model != NULL) {
+		Assets_release_model(Blahaj.model);
+	}
+	Blahaj.model = model;
 
 	Blahaj.yaw = 0;
 
@@ -449,6 +2102,193 @@ void Blahaj_init() {
 	glm_vec3_copy((vec3){2, 2, 0}, Blahaj.camPos);
 }
 
+// The wave equation kernels work on one grid row at a time. step advances
+// the row `mid` over columns [j0, j1) with the damped Verlet update
+// next = mid + keep * (mid - prev) + k * laplacian(mid), where prev holds the
+// row's previous heights on entry and the next heights on return.
+// normals writes the packed normals of the row u, whose next row is down.
+// maxDiff returns the largest |a - b| over count cells.
+// sample interpolates the heights u of the whole n x n grid at count world
+// space positions, see Water_sample.
+// The half variants do the same on heights stored as fp16.
+// The ocean's inverse FFT works on the columns [j0, j1) at once, each complex
+// row split into a re and an im array. fft4 turns the rows a, b, c, d in
+// x = {a re, a im, b re, ..., d im} into the rows of y in the same order:
+// a + b + c + d, w1 (a - c + i (b - d)), w2 (a - b + c - d) and
+// w3 (a - c - i (b - d)), with w = {w1 re, w1 im, w2 re, ..., w3 im}.
+// fft2 turns a, b into a + b and w1 (a - b).
+// spectrum turns the phasors p by step and writes the ocean's spectrum
+// re = c[0] p re + c[1] p im, im = c[2] p im + c[3] p re, see Ocean_init_sim.
+typedef struct WaterKernel {
+	const char* name;
+	bool (*supported)();
+	void (*step)(float* prev, const float* up, const float* mid, const float* down, int j0, int j1, float k, float keep);
+	void (*normals)(uint32_t* normals, const float* u, const float* down, int j0, int j1);
+	float (*maxDiff)(const float* a, const float* b, int count);
+	void (*stepHalf)(uint16_t* prev, const uint16_t* up, const uint16_t* mid, const uint16_t* down, int j0, int j1, float k, float keep);
+	void (*normalsHalf)(uint32_t* normals, const uint16_t* u, const uint16_t* down, int j0, int j1);
+	float (*maxDiffHalf)(const uint16_t* a, const uint16_t* b, int count);
+	void (*sample)(const float* u, int n, float spacing, const float* x, const float* z, int count, float* heights, vec3* normals);
+	void (*sampleHalf)(const uint16_t* u, int n, float spacing, const float* x, const float* z, int count, float* heights, vec3* normals);
+	void (*fft4)(float* const* y, const float* const* x, const float* w, int j0, int j1);
+	void (*fft2)(float* const* y, const float* const* x, const float* w, int j0, int j1);
+	void (*spectrum)(float* re, float* im, float* pRe, float* pIm, const float* stepRe, const float* stepIm, const float* const* c, int j0, int j1);
+} WaterKernel;
+
+// A pulse's Gaussian is sampled once per (size, sub-cell offset) into a small
+// square stamp that covers every cell where it is above WATER_STAMP_EPSILON
+// of its peak. The centre is snapped to 1 / WATER_STAMP_SUBCELLS of a cell.
+#define WATER_STAMP_SUBCELLS 8
+#define WATER_STAMP_EPSILON 1e-4f
+#define WATER_STAMP_CACHE_SIZE 256
+#define WATER_STAMP_PROBES 8
+
+typedef struct WaterStamp {
+	float size;
+	float spacing;
+	int qx;
+	int qy;
+
+	// Stamps referenced by queued impulses are pinned until the queue is
+	// applied; a stamp is pinned while generation == Water.stampGeneration.
+	int generation;
+
+	int radius;
+	int width;
+	int capacity;
+	float* weights;
+} WaterStamp;
+
+// Impulses are queued during the frame and applied at the start of the next
+// Water_step_sim. (x, y) is the grid cell under the stamp's top-left corner.
+typedef struct WaterImpulse {
+	const WaterStamp* stamp;
+	float strength;
+	int x;
+	int y;
+} WaterImpulse;
+
+#define WATER_TILE_SIZE 32
+
+#define WATER_CFL_LIMIT 0.6f
+
+#define WATER_PATCH_SIZE 64
+#define WATER_PATCH_RESTART 0xFFFF
+
+// A finished frame of heights and normals, handed from the simulation thread
+// to the renderer. tileVersion says which changes to each tile it contains.
+typedef struct WaterFrame {
+	void* heights;
+	uint32_t* normals;
+	uint32_t* tileVersion;
+	int activeTiles;
+
+	// The fine grid of a nested simulation and the coarse cell under its
+	// corner, see Water_init_fine.
+	float* fine;
+	uint32_t* fineNormals;
+	int fineX;
+	int fineY;
+} WaterFrame;
+
+// A Water_add_pulse call waiting for the simulation thread.
+typedef struct WaterPulse {
+	float strength;
+	float size;
+	float cx;
+	float cy;
+} WaterPulse;
+
+// Set in Water.frameLatest when the frame there has not been taken yet.
+#define WATER_FRAME_FRESH 4
+
+// The most frames one step catches up on when the simulation falls behind.
+#define WATER_ASYNC_MAX_FRAMES 4
+
+struct {
+	const char* waterKernel;
+	int waterThreads;
+	const char* bench;
+
+	// Where --bench sweep writes its results as JSON.
+	const char* benchJson;
+
+	// Tiles are measured by the largest height change of any of their cells
+	// in one step. A tile goes to sleep once it and its neighbours are all
+	// below waterSleepThreshold, and wakes when a neighbour is above
+	// waterWakeThreshold or an impulse lands on it.
+	float waterSleepThreshold;
+	float waterWakeThreshold;
+	bool waterStats;
+
+	// The fraction of the water's velocity lost per second.
+	float waterDamping;
+
+	// The most substeps advanced together in one sweep over the grid.
+	int waterBlockSteps;
+
+	// Store the heights as fp16, converting to float only to compute.
+	bool waterHalf;
+
+	// Step the water on its own thread while the last frame is drawn, which
+	// draws the water a simulation frame behind Blahaj.
+	bool waterAsync;
+
+	// Wrap the water around at its edges and draw copies of it out to the
+	// far plane, instead of holding the edges still.
+	bool waterPeriodic;
+
+	// Upload the heights as a texture and derive the normals in the vertex
+	// shader, instead of streaming heights and normals as vertex attributes.
+	bool waterHeightTexture;
+
+	// Draw the water as a clipmap centred on the camera: waterClipmapLevels
+	// nested rings, each waterClipmap cells across and twice as coarse as
+	// the one inside it. Needs waterHeightTexture.
+	int waterClipmap;
+	int waterClipmapLevels;
+
+	// The water grid's cells across. The ocean carries the waves far from
+	// the player, so this can go down to what the ripples need.
+	int waterCells;
+
+	// Layer a spectral ocean, oceanSize cells across, under the ripples and
+	// draw it out to the far plane. 0 turns it off.
+	int oceanSize;
+
+	// Simulate the pool waterNested times coarser, with a grid at the full
+	// waterCells resolution following Blahaj. 0 turns it off.
+	int waterNested;
+
+	// Step the water in compute shaders when the context has GL 4.3, and on
+	// the CPU otherwise.
+	bool waterGpu;
+
+	// Ask Mesa for its software rasteriser, llvmpipe, which has compute
+	// shaders wherever Mesa runs.
+	bool glSoftware;
+
+	// Print what the asset registry holds at the end of every round and on
+	// exit.
+	bool assetStats;
+
+	// Bake and draw textures as BC1 where the GL has S3TC, a sixth the size
+	// of RGB8 but lossy.
+	bool textureBc1;
+
+	// Bake every texture into its .tex container, in the format textureBc1
+	// asks for, and exit.
+	bool bake;
+} Settings = {
+	.waterSleepThreshold = 1e-5f,
+	.waterWakeThreshold = 5e-5f,
+	.waterDamping = 0.1f,
+	.waterBlockSteps = 8,
+	.waterClipmapLevels = 5,
+	.waterCells = 500,
+	.benchJson = "water_bench.json",
+};
+
 struct {
 	GLuint vao;
 	GLuint ebo;
@@ -456,17 +2296,242 @@ struct {
 	GLuint vbo_u;
 	GLuint vbo_normal;
 
-	float* u;
-	float* dudt;
-	vec3* normals;
+	// The current and previous heights. Each step writes the next heights
+	// over the previous ones and swaps the two. They are floats, or fp16 when
+	// half is set; cellBytes is the size of one either way.
+	void* u;
+	void* uPrev;
+	bool half;
+	size_t cellBytes;
+
+	// With periodic set, the last row and column are copies of the first,
+	// so the n x n grid repeats every n - 1 cells and tiles seamlessly.
+	bool periodic;
+	uint32_t* normals;
+	bool cpuNormals;
 	float c;
 	int sim_size;
 	float size;
+	int substeps;
+
+	// Copies of the neighbouring rows for each band, see Water_step_band.
+	void* blockScratch;
+	size_t blockScratchCapacity;
+
+	const WaterKernel* kernel;
+	WorkerPool* workers;
+
+	GLuint heightTexture;
+	GLuint pbo;
+	int indexCount;
+
+	// Frustum-culled patches, see Water_init_grid. The height range of each
+	// tile is kept for the patch bounding boxes.
+	int patchesX;
+	int patchIndexOffset[4];
+	int patchIndexCount[4];
+	GLsizei* patchCounts;
+	void** patchOffsets;
+	GLint* patchBaseVertex;
+	int visiblePatches;
+	int copies;
+	float* tileMin;
+	float* tileMax;
+
+	// Clipmap rendering, see Water_init_clipmap.
+	float clipmapSpacing;
+	int clipmapLod;
+	int clipmapRingCells;
+	int clipmapTriangles;
+	GLint originLoc;
+	GLint spacingLoc;
+	GLint lodLoc;
+	GLint cameraLoc;
+
+	// Where the copy of a periodic grid being drawn goes.
+	GLint offsetLoc;
+
+	// Asynchronous simulation, see Water_start_async. simLock guards
+	// framesRequested, pulses and simQuit. Of the three frames, the
+	// simulation owns frames[frameBack], the renderer frames[frameFront], and
+	// frameLatest holds the index of the third.
+	bool async;
+	pthread_t simThread;
+	pthread_mutex_t simLock;
+	pthread_cond_t simWake;
+	pthread_cond_t frameReady;
+	bool simQuit;
+	int framesRequested;
+	Vector* pulses;
+	Vector* pulsesTaken;
+	WaterFrame frames[3];
+	int frameBack;
+	int frameFront;
+	atomic_int frameLatest;
+	bool frameReceived;
+	uint32_t* tileVersion;
+	uint32_t* uploadedVersion;
+	uint8_t* frameDirty;
+
+	WaterStamp stamps[WATER_STAMP_CACHE_SIZE];
+	int stampGeneration;
+
+	Vector* impulses;
+	int tilesX;
+	int* tileStart;
+	int* tileImpulses;
+	int tileImpulsesCapacity;
+	int* tileScratch;
+
+	// Per-tile activity. Only active tiles are simulated, and only dirty
+	// tiles are uploaded to the GPU.
+	uint8_t* tileActive;
+	uint8_t* tileNext;
+	uint8_t* tileChanged;
+	uint8_t* tileDirty;
+	float* tileEnergy;
+	int activeTiles;
+
+	// Nested simulation, see Water_init_fine. The fine grid is fineSize cells
+	// across, fineRatio to each coarse cell, covers the fineCells x fineCells
+	// coarse cells from (fineX, fineY) and takes fineStepRatio substeps to
+	// each coarse one. fineEdges holds the heights along its four edges at
+	// the start and the end of a frame. The renderer sets focus, under
+	// simLock when async, and the grid moves to it.
+	int fineRatio;
+	int fineCells;
+	int fineSize;
+	float fineStepRatio;
+	int fineX;
+	int fineY;
+	float* fineU;
+	float* fineUPrev;
+	float* fineScratch[2];
+	uint32_t* fineNormals;
+	float* fineEdges[2];
+	vec2 focus;
+	vec2 fineFocus;
+
+	// What Water_snapshot returns without the simulation thread.
+	WaterFrame live;
+
+	// GPU simulation, see Water_init_gpu. The heights ping-pong between the
+	// buffers gpuU, gpuCurrent holding the current ones, and the normals are
+	// written straight into vbo_normal. The tile bounds and the samples the
+	// frame asked for come back through gpuResults once gpuFence says they
+	// have arrived, see Water_read_gpu.
+	bool gpu;
+	GLuint gpuU[2];
+	int gpuCurrent;
+	GLsync gpuFence;
+	Vector* gpuPulses;
+	GLuint gpuPositions;
+	GLuint gpuResults;
+	int gpuSampleCapacity;
+	// The positions Water_sample queued this frame, and the count of each
+	// call. gpuFlightCalls are those of the dispatch in flight, gpuFlightSamples
+	// their total.
+	Vector* gpuSampleX;
+	Vector* gpuSampleZ;
+	Vector* gpuSampleCalls;
+	Vector* gpuFlightCalls;
+	int gpuFlightSamples;
+	// The last results to arrive, laid out like gpuResults, and the calls
+	// they answer.
+	float* gpuResultData;
+	Vector* gpuResultCalls;
+	int gpuResultSamples;
+	GLuint stepProg;
+	GLuint normalsProg;
+	GLuint pulseProg;
+	GLuint boundsProg;
+	GLuint sampleProg;
+	GLint sampleCountLoc;
+	GLint sampleOffsetLoc;
+	GLint stepKLoc;
+	GLint stepKeepLoc;
+	GLint pulseCornerLoc;
+	GLint pulseRadiusLoc;
+	GLint pulseOffsetLoc;
+	GLint pulseSizeLoc;
+	GLint pulseStrengthLoc;
+
+	GLuint fineVao;
+	GLuint fineEbo;
+	GLuint fineVboXy;
+	GLuint fineVboU;
+	GLuint fineVboNormal;
+	int fineIndexCount;
+	GLint holeLoc;
+	GLint slopeScaleLoc;
 
 	GLuint shader;
 } Water;
 
+// Tessendorf's ocean: a Phillips spectrum, turned in frequency space and
+// brought back to heights by an inverse 2D FFT every frame. Its cost only
+// depends on size, however many wakes the water grid has. See Ocean_init_sim.
+// It repeats every OCEAN_LENGTH, the width of the pool, so it wraps around
+// with Blahaj and the fish.
+#define OCEAN_LENGTH 100.0f
+#define OCEAN_WIND_SPEED 6.0f
+#define OCEAN_RMS_HEIGHT 0.25f
+#define OCEAN_GRAVITY 9.81f
+
+// The far ocean is a grid of OCEAN_MESH_CELLS x OCEAN_MESH_CELLS quads
+// reaching out to the far plane around the camera.
+#define OCEAN_MESH_CELLS 128
+
+
+struct {
+	int size;
+	const WaterKernel* kernel;
+	WorkerPool* workers;
+
+	// Everything in frequency space is stored transposed, with kx along
+	// the rows, see Ocean_step_band. The spectrum is c[0] p re + c[1] p im
+	// + i (c[2] p im + c[3] p re) for the phasor p = e^(i w t) of each wave.
+	float* coeffs[4];
+	float* phaseRe;
+	float* phaseIm;
+	float* stepRe;
+	float* stepIm;
+
+	// e^(2 pi i k / size), re and im interleaved.
+	float* twiddles;
+
+	// The two buffers of the Stockham FFT, and which one the heights of the
+	// last step ended up in.
+	float* re[2];
+	float* im[2];
+	int result;
+
+	// The heights of the last step, size x size cells over OCEAN_LENGTH,
+	// and the largest of them. peaks holds each worker's part.
+	const float* heights;
+	float peak;
+	float* peaks;
+	float* zeros;
+
+	GLuint texture;
+	GLuint shader;
+	GLuint vao;
+	GLuint vbo;
+	GLuint ebo;
+	GLint matLoc;
+	GLint viewLoc;
+	GLint originLoc;
+	GLint spacingLoc;
+	GLint holeLoc;
+} Ocean;
+
+void Ocean_add_heights(const float* x, const float* z, int count, float* heights);
 void Water_add_pulse(float strength, float size, float cx, float cy);
+void Water_start_async();
+void Water_init_gpu();
+void Water_sample_gpu(const float* x, const float* z, int count, float* heights, vec3* normals);
+const WaterFrame* Water_snapshot();
+void Water_sample(const WaterFrame* snapshot, const float* x, const float* z, int count, float* heights, vec3* normals);
 
 void Blahaj_update() {
 	const float turnRoll = deg2rad(30);
@@ -541,6 +2606,9 @@ void Blahaj_update() {
 		Blahaj.pos[2] = -Water.size / 2;
 	}
 
+	Water_sample(Water_snapshot(), &Blahaj.pos[0], &Blahaj.pos[2], 1, &Blahaj.pos[1], NULL);
+	Ocean_add_heights(&Blahaj.pos[0], &Blahaj.pos[2], 1, &Blahaj.pos[1]);
+
 	glUseProgram(texturedShader);
 	glBindVertexArray(Blahaj.model->vao);
 
@@ -561,597 +2629,5429 @@ void Blahaj_update() {
 
 	glBindTexture(GL_TEXTURE_2D, Blahaj.model->texture);
 
-	glDrawArrays(GL_TRIANGLES, 0, Blahaj.model->vertexCount);
+	glDrawElements(GL_TRIANGLES, Blahaj.model->indexCount, Blahaj.model->indexType, 0);
 }
 
-GLuint mat_loc2;
-GLuint view_loc2;
+bool Water_kernel_always_supported() {
+	return true;
+}
 
-void Water_init() {
-	Water.sim_size = 500;
-	Water.c = 400;
-	Water.size = 100;
-	Water.u = xmalloc(Water.sim_size * Water.sim_size * sizeof(float));
-	Water.dudt = xmalloc(Water.sim_size * Water.sim_size * sizeof(float));
-	Water.normals = xmalloc(Water.sim_size * Water.sim_size * sizeof(vec3));
+void Water_step_scalar(float* prev, const float* up, const float* mid, const float* down, int j0, int j1, float k, float keep) {
+	for (int j = j0; j < j1; j++) {
+		float lap = mid[j - 1] + mid[j + 1] + up[j] + down[j] - 4 * mid[j];
+		prev[j] = mid[j] + keep * (mid[j] - prev[j]) + k * lap;
+	}
+}
 
-	glGenVertexArrays(1, &Water.vao);
-	glBindVertexArray(Water.vao);
+float Water_max_diff_scalar(const float* a, const float* b, int count) {
+	float m = 0;
+	for (int i = 0; i < count; i++) {
+		float d = fabsf(a[i] - b[i]);
+		m = d > m ? d : m;
+	}
+	return m;
+}
 
-	glGenBuffers(1, &Water.ebo);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, Water.ebo);
+// Packs a unit vector as GL_INT_2_10_10_10_REV, with x in the low bits.
+// Adding 512.5 keeps the value positive so the cast rounds to nearest.
+static inline uint32_t pack_normal(float x, float y, float z) {
+	uint32_t px = (int)(x * 511 + 512.5f) - 512;
+	uint32_t py = (int)(y * 511 + 512.5f) - 512;
+	uint32_t pz = (int)(z * 511 + 512.5f) - 512;
+	return (px & 0x3ff) | (py & 0x3ff) << 10 | (pz & 0x3ff) << 20;
+}
 
-	int numTris = (Water.sim_size - 1) * (Water.sim_size - 1) * 2;
-	unsigned int* indices = xmalloc(numTris * 3 * sizeof(unsigned int));
-	int indicesI = 0;
-	for (int i = 0; i < Water.sim_size - 1; i++) {
-		for (int j = 0; j < Water.sim_size - 1; j++) {
-			indices[indicesI++] = j * Water.sim_size + i;
-			indices[indicesI++] = (j + 1) * Water.sim_size + i;
-			indices[indicesI++] = j * Water.sim_size + i + 1;
+// The normal is cross((u1, 1, 0), (u2, 0, 1)) = (1, -u1, -u2), normalised,
+// where u1 and u2 are the height differences to the next cell along each axis.
+void Water_normals_scalar(uint32_t* normals, const float* u, const float* down, int j0, int j1) {
+	for (int j = j0; j < j1; j++) {
+		float u1 = u[j + 1] - u[j];
+		float u2 = down[j] - u[j];
 
-			indices[indicesI++] = j * Water.sim_size + i + 1;
-			indices[indicesI++] = (j + 1) * Water.sim_size + i;
-			indices[indicesI++] = (j + 1) * Water.sim_size + i + 1;
-		}
+		float inv = 1 / sqrtf(1 + u1 * u1 + u2 * u2);
+		normals[j] = pack_normal(inv, -u1 * inv, -u2 * inv);
 	}
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, numTris * 3 * sizeof(unsigned int), indices, GL_STATIC_DRAW);
-
-	glGenBuffers(1, &Water.vbo_xy);
-	glBindBuffer(GL_ARRAY_BUFFER, Water.vbo_xy);
-	
-	float* xy = xmalloc(Water.sim_size * Water.sim_size * 2 * sizeof(float));
-	for (int i = 0; i < Water.sim_size; i++) {
-		for (int j = 0; j < Water.sim_size; j++) {
-			float x = mapf(j, 0, Water.sim_size - 1, -Water.size / 2, Water.size / 2);
-			float y = mapf(i, 0, Water.sim_size - 1, -Water.size / 2, Water.size / 2);
+}
 
-			xy[2 * (i * Water.sim_size + j) + 0] = x;
-			xy[2 * (i * Water.sim_size + j) + 1] = y;
-		}
+// Converts between float and IEEE half precision, rounding to nearest even
+// like F16C does. Out of range values become infinity.
+static inline uint16_t float_to_half(float f) {
+	const uint32_t f16max = (127 + 16) << 23;
+	const uint32_t denormMagicBits = ((127 - 15) + (23 - 10) + 1) << 23;
+	float denormMagic;
+	memcpy(&denormMagic, &denormMagicBits, sizeof(float));
+
+	uint32_t x;
+	memcpy(&x, &f, sizeof(x));
+	uint32_t sign = x & 0x80000000u;
+	x ^= sign;
+
+	uint16_t h;
+	if (x >= f16max) {
+		h = x > 0x7f800000u ? 0x7e00 : 0x7c00;
+	}
+	else if (x < (113u << 23)) {
+		// The result is subnormal, so let the float adder do the rounding.
+		float fx;
+		memcpy(&fx, &x, sizeof(fx));
+		fx += denormMagic;
+		uint32_t bits;
+		memcpy(&bits, &fx, sizeof(bits));
+		h = bits - denormMagicBits;
+	}
+	else {
+		uint32_t odd = (x >> 13) & 1;
+		x += ((uint32_t)(15 - 127) << 23) + 0xfff + odd;
+		h = x >> 13;
 	}
-	glBufferData(GL_ARRAY_BUFFER, Water.sim_size * Water.sim_size * 2 * sizeof(float), xy, GL_STATIC_DRAW);
-
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
 
-	glGenBuffers(1, &Water.vbo_u);
-	glBindBuffer(GL_ARRAY_BUFFER, Water.vbo_u);
-	glBufferData(GL_ARRAY_BUFFER, Water.sim_size * Water.sim_size * sizeof(float), NULL, GL_STREAM_DRAW);
+	return h | sign >> 16;
+}
 
-	glEnableVertexAttribArray(1);
-	glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 0, 0);
+static inline float half_to_float(uint16_t h) {
+	const uint32_t shiftedExp = 0x7c00 << 13;
+	const uint32_t magicBits = 113 << 23;
 
-	glGenBuffers(1, &Water.vbo_normal);
-	glBindBuffer(GL_ARRAY_BUFFER, Water.vbo_normal);
-	glBufferData(GL_ARRAY_BUFFER, Water.sim_size * Water.sim_size * sizeof(vec3), NULL, GL_STREAM_DRAW);
+	uint32_t x = (h & 0x7fff) << 13;
+	uint32_t exp = x & shiftedExp;
+	x += (127 - 15) << 23;
 
-	glEnableVertexAttribArray(2);
-	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, 0);
+	if (exp == shiftedExp) {
+		x += (128 - 16) << 23;
+	}
+	else if (exp == 0) {
+		float f, magic;
+		x += 1 << 23;
+		memcpy(&f, &x, sizeof(f));
+		memcpy(&magic, &magicBits, sizeof(magic));
+		f -= magic;
+		memcpy(&x, &f, sizeof(x));
+	}
 
-	Water.shader = loadShaderProg("data/shaders/water.vs", "data/shaders/water.fs");
-	mat_loc2 = glGetUniformLocation(Water.shader, "u_mat");
-	view_loc2 = glGetUniformLocation(Water.shader, "u_view");
+	x |= (uint32_t)(h & 0x8000) << 16;
+	float f;
+	memcpy(&f, &x, sizeof(f));
+	return f;
 }
 
-void Water_add_pulse(float strength, float size, float cx, float cy) {
-	for (int i = 0; i < Water.sim_size; i++) {
-		for (int j = 0; j < Water.sim_size; j++) {
-			float x = mapf(j, 0, Water.sim_size - 1, -Water.size / 2, Water.size / 2);
-			float y = mapf(i, 0, Water.sim_size - 1, -Water.size / 2, Water.size / 2);
+void Water_step_half_scalar(uint16_t* prev, const uint16_t* up, const uint16_t* mid, const uint16_t* down, int j0, int j1, float k, float keep) {
+	for (int j = j0; j < j1; j++) {
+		float m = half_to_float(mid[j]);
+		float lap = half_to_float(mid[j - 1]) + half_to_float(mid[j + 1]) + half_to_float(up[j]) + half_to_float(down[j]) - 4 * m;
+		prev[j] = float_to_half(m + keep * (m - half_to_float(prev[j])) + k * lap);
+	}
+}
 
-			x -= cx;
-			y -= cy;
+float Water_max_diff_half_scalar(const uint16_t* a, const uint16_t* b, int count) {
+	float m = 0;
+	for (int i = 0; i < count; i++) {
+		float d = fabsf(half_to_float(a[i]) - half_to_float(b[i]));
+		m = d > m ? d : m;
+	}
+	return m;
+}
 
-			float u = strength * expf(-(x * x + y * y) / size);
+void Water_normals_half_scalar(uint32_t* normals, const uint16_t* u, const uint16_t* down, int j0, int j1) {
+	for (int j = j0; j < j1; j++) {
+		float m = half_to_float(u[j]);
+		float u1 = half_to_float(u[j + 1]) - m;
+		float u2 = half_to_float(down[j]) - m;
 
-			Water.u[i * Water.sim_size + j] += u;
-		}
+		float inv = 1 / sqrtf(1 + u1 * u1 + u2 * u2);
+		normals[j] = pack_normal(inv, -u1 * inv, -u2 * inv);
 	}
 }
 
-void Water_step_sim() {
-	float c = 4;
-
-	for (int i = 1; i < Water.sim_size - 1; i++) {
-		for (int j = 1; j < Water.sim_size - 1; j++) {
-			float dx = Water.size / Water.sim_size;
+// Finds the cell under world position (x, z) on an n x n grid centred on the
+// origin, clamped to the grid, and the position within it. The normal jumps
+// from one cell to the next, so the vector version must round the same way:
+// an add and then a multiply, which GCC cannot fuse into an FMA.
+static inline int Water_sample_cell(float x, float z, int n, float spacing, float* fx, float* fz) {
+	float inv = 1 / spacing;
+	float half = (n - 1) * 0.5f * spacing;
+	float gx = clampf((x + half) * inv, 0, n - 1);
+	float gz = clampf((z + half) * inv, 0, n - 1);
+	int j = gx < n - 2 ? (int)gx : n - 2;
+	int i = gz < n - 2 ? (int)gz : n - 2;
+	*fx = gx - j;
+	*fz = gz - i;
+	return i * n + j;
+}
 
-			float dudx = Water.u[i * Water.sim_size + j - 1] - 2 * Water.u[i * Water.sim_size + j] + Water.u[i * Water.sim_size + j + 1];
-	  		float dudy = Water.u[(i - 1) * Water.sim_size + j] - 2 * Water.u[i * Water.sim_size + j] + Water.u[(i + 1) * Water.sim_size + j];
-	  		dudx /= dx * dx;
-			dudy /= dx * dx;
-			Water.dudt[i * Water.sim_size + j] += (dudx + dudy) * c * c * dt;
-		}
+// Interpolates the corner heights of a cell, h01 being to the right of h00
+// and h10 below it, and gives the normal of the interpolated surface.
+static inline float Water_sample_bilinear(float h00, float h01, float h10, float h11, float fx, float fz, float spacing, float* normal) {
+	float top = h00 + (h01 - h00) * fx;
+	float bottom = h10 + (h11 - h10) * fx;
+
+	if (normal != NULL) {
+		float dx = ((h01 - h00) + ((h11 - h10) - (h01 - h00)) * fz) / spacing;
+		float dz = ((h10 - h00) + ((h11 - h01) - (h10 - h00)) * fx) / spacing;
+		float inv = 1 / sqrtf(1 + dx * dx + dz * dz);
+		normal[0] = -dx * inv;
+		normal[1] = inv;
+		normal[2] = -dz * inv;
 	}
 
-	for (int i = 0; i < Water.sim_size; i++) {
-		for (int j = 0; j < Water.sim_size; j++) {
-			// float x = mapf(j, 0, Water.sim_size - 1, -Water.size / 2, Water.size / 2);
-			// float y = mapf(i, 0, Water.sim_size - 1, -Water.size / 2, Water.size / 2);
-
-			// Water.u[i * Water.sim_size + j] = sin(sqrtf(x * x + y * y)*4 + globalTime) / 16;
+	return top + (bottom - top) * fz;
+}
 
-			Water.u[i * Water.sim_size + j] += Water.dudt[i * Water.sim_size + j] * dt;
-		}
+void Water_sample_scalar(const float* u, int n, float spacing, const float* x, const float* z, int count, float* heights, vec3* normals) {
+	for (int p = 0; p < count; p++) {
+		float fx, fz;
+		int c = Water_sample_cell(x[p], z[p], n, spacing, &fx, &fz);
+		heights[p] = Water_sample_bilinear(u[c], u[c + 1], u[c + n], u[c + n + 1], fx, fz, spacing, normals != NULL ? normals[p] : NULL);
 	}
-	glBindBuffer(GL_ARRAY_BUFFER, Water.vbo_u);
-	glBufferSubData(GL_ARRAY_BUFFER, 0, Water.sim_size * Water.sim_size * sizeof(float), Water.u);
+}
 
-	for (int i = 1; i < Water.sim_size - 1; i++) {
-		for (int j = 1; j < Water.sim_size - 1; j++) {
-			float dx = Water.size / Water.sim_size;
+void Water_sample_half_scalar(const uint16_t* u, int n, float spacing, const float* x, const float* z, int count, float* heights, vec3* normals) {
+	for (int p = 0; p < count; p++) {
+		float fx, fz;
+		int c = Water_sample_cell(x[p], z[p], n, spacing, &fx, &fz);
+		heights[p] = Water_sample_bilinear(half_to_float(u[c]), half_to_float(u[c + 1]), half_to_float(u[c + n]), half_to_float(u[c + n + 1]), fx, fz, spacing, normals != NULL ? normals[p] : NULL);
+	}
+}
 
-			float u1 = Water.u[i * Water.sim_size + j + 1] - Water.u[i * Water.sim_size + j];
-			float u2 = Water.u[(i + 1) * Water.sim_size + j] - Water.u[i * Water.sim_size + j];
+static inline void Ocean_twiddle(float re, float im, float wr, float wi, float* outRe, float* outIm) {
+	*outRe = re * wr - im * wi;
+	*outIm = re * wi + im * wr;
+}
 
-			// u1 /= (2 * dx);
-			// u2 /= (2 * dx);
+void Ocean_fft4_scalar(float* const* y, const float* const* x, const float* w, int j0, int j1) {
+	for (int j = j0; j < j1; j++) {
+		float sr = x[0][j] + x[4][j];
+		float si = x[1][j] + x[5][j];
+		float tr = x[0][j] - x[4][j];
+		float ti = x[1][j] - x[5][j];
+		float ur = x[2][j] + x[6][j];
+		float ui = x[3][j] + x[7][j];
+
+		// i (b - d)
+		float vr = x[7][j] - x[3][j];
+		float vi = x[2][j] - x[6][j];
+
+		y[0][j] = sr + ur;
+		y[1][j] = si + ui;
+		Ocean_twiddle(tr + vr, ti + vi, w[0], w[1], &y[2][j], &y[3][j]);
+		Ocean_twiddle(sr - ur, si - ui, w[2], w[3], &y[4][j], &y[5][j]);
+		Ocean_twiddle(tr - vr, ti - vi, w[4], w[5], &y[6][j], &y[7][j]);
+	}
+}
 
-			vec3 vx = {0};
-			vec3 vy = {0};
-			
-			vx[1] = 1;
-			vx[0] = u1;
-			vy[0] = u2;
-			vy[2] = 1;
+void Ocean_fft2_scalar(float* const* y, const float* const* x, const float* w, int j0, int j1) {
+	for (int j = j0; j < j1; j++) {
+		float dr = x[0][j] - x[2][j];
+		float di = x[1][j] - x[3][j];
+		y[0][j] = x[0][j] + x[2][j];
+		y[1][j] = x[1][j] + x[3][j];
+		Ocean_twiddle(dr, di, w[0], w[1], &y[2][j], &y[3][j]);
+	}
+}
 
-			vec3 normal;
-			glm_vec3_cross(vx, vy, normal);
-			glm_vec3_normalize(normal);
-			glm_vec3_copy(normal, Water.normals[i * Water.sim_size + j]);
-		}
+// The phasors are pulled back onto the unit circle every step, so rounding
+// only ever drifts their phase.
+void Ocean_spectrum_scalar(float* re, float* im, float* pRe, float* pIm, const float* stepRe, const float* stepIm, const float* const* c, int j0, int j1) {
+	for (int j = j0; j < j1; j++) {
+		float pr, pi;
+		Ocean_twiddle(pRe[j], pIm[j], stepRe[j], stepIm[j], &pr, &pi);
+		float g = 1.5f - 0.5f * (pr * pr + pi * pi);
+		pRe[j] = pr * g;
+		pIm[j] = pi * g;
+
+		re[j] = c[0][j] * pRe[j] + c[1][j] * pIm[j];
+		im[j] = c[2][j] * pIm[j] + c[3][j] * pRe[j];
 	}
-	glBindBuffer(GL_ARRAY_BUFFER, Water.vbo_normal);
-	glBufferSubData(GL_ARRAY_BUFFER, 0, Water.sim_size * Water.sim_size * sizeof(vec3), Water.normals);
 }
 
-struct {
-	GLuint shader;
-	GLuint vao;
-	GLuint vbo;
-	GLuint texture;
-} Sky;
+#ifdef WATER_X86
+bool Water_kernel_sse2_supported() {
+	return __builtin_cpu_supports("sse2");
+}
 
-void Water_update() {
-	glBindVertexArray(Water.vao);
-	glBindBuffer(GL_ARRAY_BUFFER, Water.vbo_u);
+__attribute__((target("sse2")))
+void Water_step_sse2(float* prev, const float* up, const float* mid, const float* down, int j0, int j1, float k, float keep) {
+	const __m128 k4 = _mm_set1_ps(k);
+	const __m128 keep4 = _mm_set1_ps(keep);
+	const __m128 four = _mm_set1_ps(4);
+
+	int j = j0;
+	for (; j + 4 <= j1; j += 4) {
+		__m128 m = _mm_loadu_ps(mid + j);
+		__m128 sum = _mm_add_ps(_mm_loadu_ps(mid + j - 1), _mm_loadu_ps(mid + j + 1));
+		sum = _mm_add_ps(sum, _mm_add_ps(_mm_loadu_ps(up + j), _mm_loadu_ps(down + j)));
+		__m128 lap = _mm_sub_ps(sum, _mm_mul_ps(four, m));
+		__m128 v = _mm_add_ps(m, _mm_mul_ps(keep4, _mm_sub_ps(m, _mm_loadu_ps(prev + j))));
+		_mm_storeu_ps(prev + j, _mm_add_ps(v, _mm_mul_ps(k4, lap)));
+	}
+	Water_step_scalar(prev, up, mid, down, j, j1, k, keep);
+}
 
-	Water_step_sim();
+// rsqrt is good to 12 bits, which is more than the packed normal keeps.
+__attribute__((target("sse2")))
+void Water_normals_sse2(uint32_t* normals, const float* u, const float* down, int j0, int j1) {
+	const __m128 one = _mm_set1_ps(1);
+	const __m128 scale = _mm_set1_ps(511);
+	const __m128i mask = _mm_set1_epi32(0x3ff);
+
+	int j = j0;
+	for (; j + 4 <= j1; j += 4) {
+		__m128 mid = _mm_loadu_ps(u + j);
+		__m128 u1 = _mm_sub_ps(_mm_loadu_ps(u + j + 1), mid);
+		__m128 u2 = _mm_sub_ps(_mm_loadu_ps(down + j), mid);
+		__m128 len2 = _mm_add_ps(one, _mm_add_ps(_mm_mul_ps(u1, u1), _mm_mul_ps(u2, u2)));
+		__m128 inv = _mm_mul_ps(_mm_rsqrt_ps(len2), scale);
+
+		__m128i x = _mm_cvtps_epi32(inv);
+		__m128i y = _mm_cvtps_epi32(_mm_mul_ps(u1, inv));
+		__m128i z = _mm_cvtps_epi32(_mm_mul_ps(u2, inv));
+		y = _mm_sub_epi32(_mm_setzero_si128(), y);
+		z = _mm_sub_epi32(_mm_setzero_si128(), z);
+
+		__m128i packed = _mm_and_si128(x, mask);
+		packed = _mm_or_si128(packed, _mm_slli_epi32(_mm_and_si128(y, mask), 10));
+		packed = _mm_or_si128(packed, _mm_slli_epi32(_mm_and_si128(z, mask), 20));
+		_mm_storeu_si128((__m128i*)(normals + j), packed);
+	}
+	Water_normals_scalar(normals, u, down, j, j1);
+}
 
-	glUseProgram(Water.shader);
+__attribute__((target("sse2")))
+float Water_max_diff_sse2(const float* a, const float* b, int count) {
+	const __m128 abs = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128 m = _mm_setzero_ps();
 
-	mat4 modelMat;
-	glm_mat4_identity(modelMat);
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		m = _mm_max_ps(m, _mm_and_ps(_mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)), abs));
+	}
 
-	mat4 mvp;
-	glm_mat4_mul(projMat, viewMat, mvp);
-	glm_mat4_mul(mvp, modelMat, mvp);
+	float lanes[4];
+	_mm_storeu_ps(lanes, m);
+	float tail = Water_max_diff_scalar(a + i, b + i, count - i);
+	return fmaxf(fmaxf(fmaxf(lanes[0], lanes[1]), fmaxf(lanes[2], lanes[3])), tail);
+}
 
-	glUniformMatrix4fv(mat_loc2, 1, GL_FALSE, (float*)mvp);
-	glUniformMatrix4fv(view_loc2, 1, GL_FALSE, (float*)viewMat);
+__attribute__((target("sse2")))
+static inline void Ocean_twiddle_sse2(__m128 re, __m128 im, __m128 wr, __m128 wi, float* outRe, float* outIm) {
+	_mm_storeu_ps(outRe, _mm_sub_ps(_mm_mul_ps(re, wr), _mm_mul_ps(im, wi)));
+	_mm_storeu_ps(outIm, _mm_add_ps(_mm_mul_ps(re, wi), _mm_mul_ps(im, wr)));
+}
 
-	glDrawElements(GL_TRIANGLES, Water.sim_size * Water.sim_size * 6, GL_UNSIGNED_INT, NULL);
+__attribute__((target("sse2")))
+void Ocean_fft4_sse2(float* const* y, const float* const* x, const float* w, int j0, int j1) {
+	int j = j0;
+	for (; j + 4 <= j1; j += 4) {
+		__m128 ar = _mm_loadu_ps(x[0] + j);
+		__m128 ai = _mm_loadu_ps(x[1] + j);
+		__m128 br = _mm_loadu_ps(x[2] + j);
+		__m128 bi = _mm_loadu_ps(x[3] + j);
+		__m128 cr = _mm_loadu_ps(x[4] + j);
+		__m128 ci = _mm_loadu_ps(x[5] + j);
+		__m128 dr = _mm_loadu_ps(x[6] + j);
+		__m128 di = _mm_loadu_ps(x[7] + j);
+
+		__m128 sr = _mm_add_ps(ar, cr);
+		__m128 si = _mm_add_ps(ai, ci);
+		__m128 tr = _mm_sub_ps(ar, cr);
+		__m128 ti = _mm_sub_ps(ai, ci);
+		__m128 ur = _mm_add_ps(br, dr);
+		__m128 ui = _mm_add_ps(bi, di);
+		__m128 vr = _mm_sub_ps(di, bi);
+		__m128 vi = _mm_sub_ps(br, dr);
+
+		_mm_storeu_ps(y[0] + j, _mm_add_ps(sr, ur));
+		_mm_storeu_ps(y[1] + j, _mm_add_ps(si, ui));
+		Ocean_twiddle_sse2(_mm_add_ps(tr, vr), _mm_add_ps(ti, vi), _mm_set1_ps(w[0]), _mm_set1_ps(w[1]), y[2] + j, y[3] + j);
+		Ocean_twiddle_sse2(_mm_sub_ps(sr, ur), _mm_sub_ps(si, ui), _mm_set1_ps(w[2]), _mm_set1_ps(w[3]), y[4] + j, y[5] + j);
+		Ocean_twiddle_sse2(_mm_sub_ps(tr, vr), _mm_sub_ps(ti, vi), _mm_set1_ps(w[4]), _mm_set1_ps(w[5]), y[6] + j, y[7] + j);
+	}
 
-	glBindVertexArray(0);
+	Ocean_fft4_scalar(y, x, w, j, j1);
 }
 
-GLuint projLoc3;
-GLuint viewLoc3;
+__attribute__((target("sse2")))
+void Ocean_fft2_sse2(float* const* y, const float* const* x, const float* w, int j0, int j1) {
+	int j = j0;
+	for (; j + 4 <= j1; j += 4) {
+		__m128 ar = _mm_loadu_ps(x[0] + j);
+		__m128 ai = _mm_loadu_ps(x[1] + j);
+		__m128 br = _mm_loadu_ps(x[2] + j);
+		__m128 bi = _mm_loadu_ps(x[3] + j);
+		_mm_storeu_ps(y[0] + j, _mm_add_ps(ar, br));
+		_mm_storeu_ps(y[1] + j, _mm_add_ps(ai, bi));
+		Ocean_twiddle_sse2(_mm_sub_ps(ar, br), _mm_sub_ps(ai, bi), _mm_set1_ps(w[0]), _mm_set1_ps(w[1]), y[2] + j, y[3] + j);
+	}
 
-// https://learnopengl.com/Advanced-OpenGL/Cubemaps
-unsigned int loadCubemap(const char** faces)
-{
-    unsigned int textureID;
-    glGenTextures(1, &textureID);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, textureID);
-
-    int width, height, nrChannels;
-    for (unsigned int i = 0; i < 6; i++)
-    {
-        unsigned char *data = stbi_load(faces[i], &width, &height, &nrChannels, 0);
-        if (data)
-        {
-            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 
-                         0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data
-            );
-            stbi_image_free(data);
-        }
-    }
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-
-    return textureID;
+	Ocean_fft2_scalar(y, x, w, j, j1);
 }
 
-void Sky_init() {
-	Sky.shader = loadShaderProg("data/shaders/sky.vs", "data/shaders/sky.fs");
-	projLoc3 = glGetUniformLocation(Sky.shader, "projection");
-	viewLoc3 = glGetUniformLocation(Sky.shader, "view");
+__attribute__((target("sse2")))
+void Ocean_spectrum_sse2(float* re, float* im, float* pRe, float* pIm, const float* stepRe, const float* stepIm, const float* const* c, int j0, int j1) {
+	int j = j0;
+	for (; j + 4 <= j1; j += 4) {
+		__m128 sr = _mm_loadu_ps(stepRe + j);
+		__m128 si = _mm_loadu_ps(stepIm + j);
+		__m128 qr = _mm_loadu_ps(pRe + j);
+		__m128 qi = _mm_loadu_ps(pIm + j);
+		__m128 pr = _mm_sub_ps(_mm_mul_ps(qr, sr), _mm_mul_ps(qi, si));
+		__m128 pi = _mm_add_ps(_mm_mul_ps(qr, si), _mm_mul_ps(qi, sr));
+		__m128 g = _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(_mm_set1_ps(0.5f), _mm_add_ps(_mm_mul_ps(pr, pr), _mm_mul_ps(pi, pi))));
+		pr = _mm_mul_ps(pr, g);
+		pi = _mm_mul_ps(pi, g);
+		_mm_storeu_ps(pRe + j, pr);
+		_mm_storeu_ps(pIm + j, pi);
+
+		_mm_storeu_ps(re + j, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(c[0] + j), pr), _mm_mul_ps(_mm_loadu_ps(c[1] + j), pi)));
+		_mm_storeu_ps(im + j, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(c[2] + j), pi), _mm_mul_ps(_mm_loadu_ps(c[3] + j), pr)));
+	}
 
-	char* faces[6] = {
-		"data/sky/right.jpg",
-		"data/sky/left.jpg",
-		"data/sky/bottom.jpg",
-		"data/sky/top.jpg",
-		"data/sky/front.jpg",
-		"data/sky/back.jpg",
-	};
-	Sky.texture = loadCubemap((const char**)faces);
+	Ocean_spectrum_scalar(re, im, pRe, pIm, stepRe, stepIm, c, j, j1);
+}
 
-	glGenVertexArrays(1, &Sky.vao);
-	glBindVertexArray(Sky.vao);
+// Every CPU with AVX2 also has F16C, which the half kernels need.
+bool Water_kernel_avx2_supported() {
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c");
+}
 
-	glGenBuffers(1, &Sky.vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, Sky.vbo);
+__attribute__((target("avx2,fma")))
+static inline __m256 Water_verlet_avx2(__m256 left, __m256 m, __m256 right, __m256 up, __m256 down, __m256 prev, __m256 k8, __m256 keep8) {
+	__m256 sum = _mm256_add_ps(_mm256_add_ps(left, right), _mm256_add_ps(up, down));
+	__m256 lap = _mm256_fmadd_ps(_mm256_set1_ps(-4), m, sum);
+	__m256 v = _mm256_fmadd_ps(keep8, _mm256_sub_ps(m, prev), m);
+	return _mm256_fmadd_ps(k8, lap, v);
+}
 
-	float skyboxVertices[] = {
-		// positions          
-		-1.0f,  1.0f, -1.0f,
-		-1.0f, -1.0f, -1.0f,
-		1.0f, -1.0f, -1.0f,
-		1.0f, -1.0f, -1.0f,
-		1.0f,  1.0f, -1.0f,
-		-1.0f,  1.0f, -1.0f,
+__attribute__((target("avx2,fma")))
+static inline __m256i Water_pack_normals_avx2(__m256 mid, __m256 right, __m256 down) {
+	const __m256 scale = _mm256_set1_ps(511);
+	const __m256 minusScale = _mm256_set1_ps(-511);
+	const __m256i mask = _mm256_set1_epi32(0x3ff);
 
-		-1.0f, -1.0f,  1.0f,
-		-1.0f, -1.0f, -1.0f,
-		-1.0f,  1.0f, -1.0f,
-		-1.0f,  1.0f, -1.0f,
-		-1.0f,  1.0f,  1.0f,
-		-1.0f, -1.0f,  1.0f,
+	__m256 u1 = _mm256_sub_ps(right, mid);
+	__m256 u2 = _mm256_sub_ps(down, mid);
+	__m256 len2 = _mm256_fmadd_ps(u1, u1, _mm256_fmadd_ps(u2, u2, _mm256_set1_ps(1)));
+	__m256 inv = _mm256_rsqrt_ps(len2);
 
-		1.0f, -1.0f, -1.0f,
-		1.0f, -1.0f,  1.0f,
-		1.0f,  1.0f,  1.0f,
-		1.0f,  1.0f,  1.0f,
-		1.0f,  1.0f, -1.0f,
-		1.0f, -1.0f, -1.0f,
+	__m256i x = _mm256_cvtps_epi32(_mm256_mul_ps(inv, scale));
+	__m256i y = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_mul_ps(u1, inv), minusScale));
+	__m256i z = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_mul_ps(u2, inv), minusScale));
 
-		-1.0f, -1.0f,  1.0f,
-		-1.0f,  1.0f,  1.0f,
-		1.0f,  1.0f,  1.0f,
-		1.0f,  1.0f,  1.0f,
-		1.0f, -1.0f,  1.0f,
-		-1.0f, -1.0f,  1.0f,
+	__m256i packed = _mm256_and_si256(x, mask);
+	packed = _mm256_or_si256(packed, _mm256_slli_epi32(_mm256_and_si256(y, mask), 10));
+	return _mm256_or_si256(packed, _mm256_slli_epi32(_mm256_and_si256(z, mask), 20));
+}
 
-		-1.0f,  1.0f, -1.0f,
-		1.0f,  1.0f, -1.0f,
-		1.0f,  1.0f,  1.0f,
-		1.0f,  1.0f,  1.0f,
-		-1.0f,  1.0f,  1.0f,
-		-1.0f,  1.0f, -1.0f,
+__attribute__((target("avx2,fma")))
+void Water_step_avx2(float* prev, const float* up, const float* mid, const float* down, int j0, int j1, float k, float keep) {
+	const __m256 k8 = _mm256_set1_ps(k);
+	const __m256 keep8 = _mm256_set1_ps(keep);
 
-		-1.0f, -1.0f, -1.0f,
-		-1.0f, -1.0f,  1.0f,
-		1.0f, -1.0f, -1.0f,
-		1.0f, -1.0f, -1.0f,
-		-1.0f, -1.0f,  1.0f,
-		1.0f, -1.0f,  1.0f
-	};
-	glBufferData(GL_ARRAY_BUFFER, sizeof(skyboxVertices), skyboxVertices, GL_STATIC_DRAW);
+	int j = j0;
+	for (; j + 8 <= j1; j += 8) {
+		__m256 v = Water_verlet_avx2(_mm256_loadu_ps(mid + j - 1), _mm256_loadu_ps(mid + j), _mm256_loadu_ps(mid + j + 1),
+			_mm256_loadu_ps(up + j), _mm256_loadu_ps(down + j), _mm256_loadu_ps(prev + j), k8, keep8);
+		_mm256_storeu_ps(prev + j, v);
+	}
+	// GCC leaves out the vzeroupper before a tail call, and the scalar code
+	// after it would pay for the dirty upper halves on every instruction.
+	_mm256_zeroupper();
+	Water_step_scalar(prev, up, mid, down, j, j1, k, keep);
+}
 
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+__attribute__((target("avx2,fma")))
+void Water_normals_avx2(uint32_t* normals, const float* u, const float* down, int j0, int j1) {
+	int j = j0;
+	for (; j + 8 <= j1; j += 8) {
+		__m256i packed = Water_pack_normals_avx2(_mm256_loadu_ps(u + j), _mm256_loadu_ps(u + j + 1), _mm256_loadu_ps(down + j));
+		_mm256_storeu_si256((__m256i*)(normals + j), packed);
+	}
+	_mm256_zeroupper();
+	Water_normals_scalar(normals, u, down, j, j1);
 }
 
-void Sky_update() {
-	glBindVertexArray(Sky.vao);
-	glUseProgram(Sky.shader);
+__attribute__((target("avx2,fma")))
+static inline float Water_reduce_max_avx2(__m256 m) {
+	__m128 h = _mm_max_ps(_mm256_castps256_ps128(m), _mm256_extractf128_ps(m, 1));
+	h = _mm_max_ps(h, _mm_movehl_ps(h, h));
+	h = _mm_max_ss(h, _mm_shuffle_ps(h, h, 1));
+	return _mm_cvtss_f32(h);
+}
 
-	glDepthMask(GL_FALSE);
+__attribute__((target("avx2,fma")))
+float Water_max_diff_avx2(const float* a, const float* b, int count) {
+	const __m256 abs = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+	__m256 m = _mm256_setzero_ps();
 
-	glUniformMatrix4fv(projLoc3, 1, GL_FALSE, (float*)projMat);
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		m = _mm256_max_ps(m, _mm256_and_ps(_mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)), abs));
+	}
+	// Reduce first so no ymm register is live across the scalar call,
+	// otherwise GCC keeps the accumulator there and skips the vzeroupper.
+	float head = Water_reduce_max_avx2(m);
+	_mm256_zeroupper();
+	return fmaxf(head, Water_max_diff_scalar(a + i, b + i, count - i));
+}
 
-	mat4 matmat;
-	glm_mat4_copy(viewMat, matmat);
-	matmat[3][0] = 0;
-	matmat[3][1] = 0;
-	matmat[3][2] = 0;
-	glUniformMatrix4fv(viewLoc3, 1, GL_FALSE, (float*)matmat);
+__attribute__((target("avx2,fma,f16c")))
+static inline __m256 load_half8(const uint16_t* p) {
+	return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)p));
+}
 
-	glDrawArrays(GL_TRIANGLES, 0, 36);
+__attribute__((target("avx2,fma,f16c")))
+float Water_max_diff_half_avx2(const uint16_t* a, const uint16_t* b, int count) {
+	const __m256 abs = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+	__m256 m = _mm256_setzero_ps();
 
-	glDepthMask(GL_TRUE);
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		m = _mm256_max_ps(m, _mm256_and_ps(_mm256_sub_ps(load_half8(a + i), load_half8(b + i)), abs));
+	}
+	float head = Water_reduce_max_avx2(m);
+	_mm256_zeroupper();
+	return fmaxf(head, Water_max_diff_half_scalar(a + i, b + i, count - i));
 }
 
-typedef struct Fish {
-	vec3 pos;
-	float scale;
-	float yaw;
-	float targetYaw;
+__attribute__((target("avx2,fma,f16c")))
+void Water_step_half_avx2(uint16_t* prev, const uint16_t* up, const uint16_t* mid, const uint16_t* down, int j0, int j1, float k, float keep) {
+	const __m256 k8 = _mm256_set1_ps(k);
+	const __m256 keep8 = _mm256_set1_ps(keep);
 
-	float roll;
+	int j = j0;
+	for (; j + 8 <= j1; j += 8) {
+		__m256 v = Water_verlet_avx2(load_half8(mid + j - 1), load_half8(mid + j), load_half8(mid + j + 1),
+			load_half8(up + j), load_half8(down + j), load_half8(prev + j), k8, keep8);
+		_mm_storeu_si128((__m128i*)(prev + j), _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+	}
+	_mm256_zeroupper();
+	Water_step_half_scalar(prev, up, mid, down, j, j1, k, keep);
+}
 
-	int turnTimer;
+__attribute__((target("avx2,fma,f16c")))
+void Water_normals_half_avx2(uint32_t* normals, const uint16_t* u, const uint16_t* down, int j0, int j1) {
+	int j = j0;
+	for (; j + 8 <= j1; j += 8) {
+		__m256i packed = Water_pack_normals_avx2(load_half8(u + j), load_half8(u + j + 1), load_half8(down + j));
+		_mm256_storeu_si256((__m256i*)(normals + j), packed);
+	}
+	_mm256_zeroupper();
+	Water_normals_half_scalar(normals, u, down, j, j1);
+}
 
-	bool dead;
-} Fish;
+// Finds the cells under eight positions like Water_sample_cell.
+__attribute__((target("avx2,fma")))
+static inline __m256i Water_sample_cell_avx2(const float* x, const float* z, int n, float spacing, __m256* fx, __m256* fz) {
+	const __m256 inv = _mm256_set1_ps(1 / spacing);
+	const __m256 half = _mm256_set1_ps((n - 1) * 0.5f * spacing);
+	const __m256 last = _mm256_set1_ps(n - 1);
+	const __m256i lastCell = _mm256_set1_epi32(n - 2);
+
+	__m256 gx = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(x), half), inv), _mm256_setzero_ps()), last);
+	__m256 gz = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(z), half), inv), _mm256_setzero_ps()), last);
+	__m256i j = _mm256_min_epi32(_mm256_cvttps_epi32(gx), lastCell);
+	__m256i i = _mm256_min_epi32(_mm256_cvttps_epi32(gz), lastCell);
+	*fx = _mm256_sub_ps(gx, _mm256_cvtepi32_ps(j));
+	*fz = _mm256_sub_ps(gz, _mm256_cvtepi32_ps(i));
+	return _mm256_add_epi32(_mm256_mullo_epi32(i, _mm256_set1_epi32(n)), j);
+}
 
-Vector* fishes;
-Model* fishModel;
+// Interpolates like Water_sample_bilinear, writing eight heights and, if
+// normals is not NULL, eight normals.
+__attribute__((target("avx2,fma")))
+static inline void Water_sample_bilinear_avx2(__m256 h00, __m256 h01, __m256 h10, __m256 h11, __m256 fx, __m256 fz, float spacing, float* heights, vec3* normals) {
+	__m256 right = _mm256_sub_ps(h01, h00);
+	__m256 down = _mm256_sub_ps(h10, h00);
+	__m256 top = _mm256_fmadd_ps(right, fx, h00);
+	__m256 bottom = _mm256_fmadd_ps(_mm256_sub_ps(h11, h10), fx, h10);
+	_mm256_storeu_ps(heights, _mm256_fmadd_ps(_mm256_sub_ps(bottom, top), fz, top));
+
+	if (normals == NULL) {
+		return;
+	}
 
-void Fishs_init() {
-	fishModel = Model_load("data/models/blahaj.obj");
+	const __m256 inv = _mm256_set1_ps(1 / spacing);
+	const __m256 one = _mm256_set1_ps(1);
+	__m256 dx = _mm256_mul_ps(_mm256_fmadd_ps(_mm256_sub_ps(_mm256_sub_ps(h11, h10), right), fz, right), inv);
+	__m256 dz = _mm256_mul_ps(_mm256_fmadd_ps(_mm256_sub_ps(_mm256_sub_ps(h11, h01), down), fx, down), inv);
+	__m256 len = _mm256_div_ps(one, _mm256_sqrt_ps(_mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dz, dz, one))));
+
+	float nx[8], ny[8], nz[8];
+	_mm256_storeu_ps(nx, _mm256_mul_ps(_mm256_sub_ps(_mm256_setzero_ps(), dx), len));
+	_mm256_storeu_ps(ny, len);
+	_mm256_storeu_ps(nz, _mm256_mul_ps(_mm256_sub_ps(_mm256_setzero_ps(), dz), len));
+	for (int k = 0; k < 8; k++) {
+		normals[k][0] = nx[k];
+		normals[k][1] = ny[k];
+		normals[k][2] = nz[k];
+	}
+}
 
-	fishes = Vector_new(sizeof(Fish));
+__attribute__((target("avx2,fma")))
+void Water_sample_avx2(const float* u, int n, float spacing, const float* x, const float* z, int count, float* heights, vec3* normals) {
+	int p = 0;
+	for (; p + 8 <= count; p += 8) {
+		__m256 fx, fz;
+		__m256i c = Water_sample_cell_avx2(x + p, z + p, n, spacing, &fx, &fz);
+		Water_sample_bilinear_avx2(_mm256_i32gather_ps(u, c, 4), _mm256_i32gather_ps(u + 1, c, 4),
+			_mm256_i32gather_ps(u + n, c, 4), _mm256_i32gather_ps(u + n + 1, c, 4),
+			fx, fz, spacing, heights + p, normals != NULL ? normals + p : NULL);
+	}
+	_mm256_zeroupper();
+	Water_sample_scalar(u, n, spacing, x + p, z + p, count - p, heights + p, normals != NULL ? normals + p : NULL);
+}
 
-	int n = 100;
-	for (int i = 0; i < n; i++) {
-		Fish fish;
-		fish.pos[0] = float_rand(-Water.size / 2, Water.size / 2);
-		fish.pos[1] = 0;
-		fish.pos[2] = float_rand(-Water.size / 2, Water.size / 2);
-		fish.yaw = float_rand(0, 2 * PI);
-		fish.roll = float_rand(0, 2 * PI);
-		fish.scale = 1;
-		fish.targetYaw = fish.yaw;
-		fish.turnTimer = 0;
-		fish.dead = false;
-		Vector_add(fishes, &fish);
+// Widens the halves in the low and high 16 bits of each lane to two vectors.
+__attribute__((target("avx2,fma,f16c")))
+static inline void unpack_half_pairs(__m256i pairs, __m256* low, __m256* high) {
+	__m256i packed = _mm256_packus_epi32(_mm256_and_si256(pairs, _mm256_set1_epi32(0xffff)), _mm256_srli_epi32(pairs, 16));
+	packed = _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0));
+	*low = _mm256_cvtph_ps(_mm256_castsi256_si128(packed));
+	*high = _mm256_cvtph_ps(_mm256_extracti128_si256(packed, 1));
+}
+
+// A 32-bit gather at a cell's address fetches the cell and the one to its
+// right together. The cell is never in the last column, so it never reads
+// past the end of the grid.
+__attribute__((target("avx2,fma,f16c")))
+void Water_sample_half_avx2(const uint16_t* u, int n, float spacing, const float* x, const float* z, int count, float* heights, vec3* normals) {
+	int p = 0;
+	for (; p + 8 <= count; p += 8) {
+		__m256 fx, fz;
+		__m256i c = Water_sample_cell_avx2(x + p, z + p, n, spacing, &fx, &fz);
+
+		__m256 h00, h01, h10, h11;
+		unpack_half_pairs(_mm256_i32gather_epi32((const int*)u, c, 2), &h00, &h01);
+		unpack_half_pairs(_mm256_i32gather_epi32((const int*)(u + n), c, 2), &h10, &h11);
+		Water_sample_bilinear_avx2(h00, h01, h10, h11, fx, fz, spacing, heights + p, normals != NULL ? normals + p : NULL);
 	}
+	_mm256_zeroupper();
+	Water_sample_half_scalar(u, n, spacing, x + p, z + p, count - p, heights + p, normals != NULL ? normals + p : NULL);
 }
 
-void Fishs_update() {
-	const float fishSpeed = 15;
-	const float turnMax = deg2rad(90);
+__attribute__((target("avx2,fma")))
+static inline void Ocean_twiddle_avx2(__m256 re, __m256 im, __m256 wr, __m256 wi, float* outRe, float* outIm) {
+	_mm256_storeu_ps(outRe, _mm256_fmsub_ps(re, wr, _mm256_mul_ps(im, wi)));
+	_mm256_storeu_ps(outIm, _mm256_fmadd_ps(re, wi, _mm256_mul_ps(im, wr)));
+}
 
-	glUseProgram(texturedShader);
-	glBindVertexArray(fishModel->vao);
+__attribute__((target("avx2,fma")))
+void Ocean_fft4_avx2(float* const* y, const float* const* x, const float* w, int j0, int j1) {
+	int j = j0;
+	for (; j + 8 <= j1; j += 8) {
+		__m256 ar = _mm256_loadu_ps(x[0] + j);
+		__m256 ai = _mm256_loadu_ps(x[1] + j);
+		__m256 br = _mm256_loadu_ps(x[2] + j);
+		__m256 bi = _mm256_loadu_ps(x[3] + j);
+		__m256 cr = _mm256_loadu_ps(x[4] + j);
+		__m256 ci = _mm256_loadu_ps(x[5] + j);
+		__m256 dr = _mm256_loadu_ps(x[6] + j);
+		__m256 di = _mm256_loadu_ps(x[7] + j);
+
+		__m256 sr = _mm256_add_ps(ar, cr);
+		__m256 si = _mm256_add_ps(ai, ci);
+		__m256 tr = _mm256_sub_ps(ar, cr);
+		__m256 ti = _mm256_sub_ps(ai, ci);
+		__m256 ur = _mm256_add_ps(br, dr);
+		__m256 ui = _mm256_add_ps(bi, di);
+		__m256 vr = _mm256_sub_ps(di, bi);
+		__m256 vi = _mm256_sub_ps(br, dr);
+
+		_mm256_storeu_ps(y[0] + j, _mm256_add_ps(sr, ur));
+		_mm256_storeu_ps(y[1] + j, _mm256_add_ps(si, ui));
+		Ocean_twiddle_avx2(_mm256_add_ps(tr, vr), _mm256_add_ps(ti, vi), _mm256_set1_ps(w[0]), _mm256_set1_ps(w[1]), y[2] + j, y[3] + j);
+		Ocean_twiddle_avx2(_mm256_sub_ps(sr, ur), _mm256_sub_ps(si, ui), _mm256_set1_ps(w[2]), _mm256_set1_ps(w[3]), y[4] + j, y[5] + j);
+		Ocean_twiddle_avx2(_mm256_sub_ps(tr, vr), _mm256_sub_ps(ti, vi), _mm256_set1_ps(w[4]), _mm256_set1_ps(w[5]), y[6] + j, y[7] + j);
+	}
+	_mm256_zeroupper();
 
-	for (int i = 0; i < fishes->count; i++) {
-		Fish* fish = &((Fish*)fishes->data)[i];
+	Ocean_fft4_scalar(y, x, w, j, j1);
+}
 
-		fish->pos[0] += fishSpeed * cosf(fish->yaw) * dt;
-		fish->pos[2] += fishSpeed * sinf(fish->yaw) * dt;
+__attribute__((target("avx2,fma")))
+void Ocean_fft2_avx2(float* const* y, const float* const* x, const float* w, int j0, int j1) {
+	int j = j0;
+	for (; j + 8 <= j1; j += 8) {
+		__m256 ar = _mm256_loadu_ps(x[0] + j);
+		__m256 ai = _mm256_loadu_ps(x[1] + j);
+		__m256 br = _mm256_loadu_ps(x[2] + j);
+		__m256 bi = _mm256_loadu_ps(x[3] + j);
+		_mm256_storeu_ps(y[0] + j, _mm256_add_ps(ar, br));
+		_mm256_storeu_ps(y[1] + j, _mm256_add_ps(ai, bi));
+		Ocean_twiddle_avx2(_mm256_sub_ps(ar, br), _mm256_sub_ps(ai, bi), _mm256_set1_ps(w[0]), _mm256_set1_ps(w[1]), y[2] + j, y[3] + j);
+	}
+	_mm256_zeroupper();
 
-		if (fish->pos[0] < -Water.size / 2) {
-			fish->pos[0] = Water.size / 2;
-			// fish->pos[1] = 10;
-		}
-		if (fish->pos[0] > Water.size / 2) {
-			fish->pos[0] = -Water.size / 2;
-			// fish->pos[1] = 10;
-		}
-		if (fish->pos[2] < -Water.size / 2) {
-			fish->pos[2] = Water.size / 2;
-			// fish->pos[1] = 10;
-		}
-		if (fish->pos[2] > Water.size / 2) {
-			fish->pos[2] = -Water.size / 2;
-			// fish->pos[1] = 10;
-		}
+	Ocean_fft2_scalar(y, x, w, j, j1);
+}
 
-		if (fish->turnTimer++ > 60) {
-			fish->turnTimer = 0;
+__attribute__((target("avx2,fma")))
+void Ocean_spectrum_avx2(float* re, float* im, float* pRe, float* pIm, const float* stepRe, const float* stepIm, const float* const* c, int j0, int j1) {
+	int j = j0;
+	for (; j + 8 <= j1; j += 8) {
+		__m256 sr = _mm256_loadu_ps(stepRe + j);
+		__m256 si = _mm256_loadu_ps(stepIm + j);
+		__m256 qr = _mm256_loadu_ps(pRe + j);
+		__m256 qi = _mm256_loadu_ps(pIm + j);
+		__m256 pr = _mm256_fmsub_ps(qr, sr, _mm256_mul_ps(qi, si));
+		__m256 pi = _mm256_fmadd_ps(qr, si, _mm256_mul_ps(qi, sr));
+		__m256 g = _mm256_fnmadd_ps(_mm256_set1_ps(0.5f), _mm256_fmadd_ps(pr, pr, _mm256_mul_ps(pi, pi)), _mm256_set1_ps(1.5f));
+		pr = _mm256_mul_ps(pr, g);
+		pi = _mm256_mul_ps(pi, g);
+		_mm256_storeu_ps(pRe + j, pr);
+		_mm256_storeu_ps(pIm + j, pi);
+
+		_mm256_storeu_ps(re + j, _mm256_fmadd_ps(_mm256_loadu_ps(c[0] + j), pr, _mm256_mul_ps(_mm256_loadu_ps(c[1] + j), pi)));
+		_mm256_storeu_ps(im + j, _mm256_fmadd_ps(_mm256_loadu_ps(c[2] + j), pi, _mm256_mul_ps(_mm256_loadu_ps(c[3] + j), pr)));
+	}
+	_mm256_zeroupper();
 
-			fish->targetYaw = fish->yaw + float_rand(-turnMax, turnMax);
-		}
-		fish->yaw = lerpf(fish->yaw, fish->targetYaw, 0.05f);
+	Ocean_spectrum_scalar(re, im, pRe, pIm, stepRe, stepIm, c, j, j1);
+}
+#endif
+
+// Ordered from slowest to fastest; the scalar kernel is the reference.
+const WaterKernel waterKernels[] = {
+	{"scalar", Water_kernel_always_supported, Water_step_scalar, Water_normals_scalar, Water_max_diff_scalar, Water_step_half_scalar, Water_normals_half_scalar, Water_max_diff_half_scalar,
+		Water_sample_scalar, Water_sample_half_scalar, Ocean_fft4_scalar, Ocean_fft2_scalar, Ocean_spectrum_scalar},
+#ifdef WATER_X86
+	// SSE2 has no half conversions or gathers, so its half variants and its
+	// sampling are the scalar ones.
+	{"sse2", Water_kernel_sse2_supported, Water_step_sse2, Water_normals_sse2, Water_max_diff_sse2, Water_step_half_scalar, Water_normals_half_scalar, Water_max_diff_half_scalar,
+		Water_sample_scalar, Water_sample_half_scalar, Ocean_fft4_sse2, Ocean_fft2_sse2, Ocean_spectrum_sse2},
+	{"avx2", Water_kernel_avx2_supported, Water_step_avx2, Water_normals_avx2, Water_max_diff_avx2, Water_step_half_avx2, Water_normals_half_avx2, Water_max_diff_half_avx2,
+		Water_sample_avx2, Water_sample_half_avx2, Ocean_fft4_avx2, Ocean_fft2_avx2, Ocean_spectrum_avx2},
+#endif
+};
 
-		fish->roll += deg2rad(90) * dt;
+#define WATER_KERNEL_COUNT (sizeof(waterKernels) / sizeof(waterKernels[0]))
 
-		float d2 = glm_vec3_distance2(Blahaj.pos, fish->pos);
-		if (d2 < Blahaj.scale * 4) {
-			Blahaj.scaleTarget += 0.1f;
-			fish->dead = true;
+const WaterKernel* Water_select_kernel(const char* name) {
+	if (name != NULL) {
+		for (int i = 0; i < WATER_KERNEL_COUNT; i++) {
+			if (strcmp(waterKernels[i].name, name) == 0) {
+				if (!waterKernels[i].supported()) {
+					panic("Water kernel %s is not supported by this CPU\n", name);
+				}
+				return &waterKernels[i];
+			}
+		}
+		panic("Unknown water kernel %s\n", name);
+	}
+
+	for (int i = WATER_KERNEL_COUNT - 1; i >= 0; i--) {
+		if (waterKernels[i].supported()) {
+			return &waterKernels[i];
+		}
+	}
+	return &waterKernels[0];
+}
+
+GLuint mat_loc2;
+GLuint view_loc2;
+
+static inline void* Water_cells(const void* buffer, size_t index) {
+	return (char*)buffer + index * Water.cellBytes;
+}
+
+static inline float Water_height(const void* buffer, size_t index) {
+	return Water.half ? half_to_float(((const uint16_t*)buffer)[index]) : ((const float*)buffer)[index];
+}
+
+static inline void Water_set_height(void* buffer, size_t index, float height) {
+	if (Water.half) {
+		((uint16_t*)buffer)[index] = float_to_half(height);
+	}
+	else {
+		((float*)buffer)[index] = height;
+	}
+}
+
+// The number of distinct rows and columns, after which the grid repeats.
+static inline int Water_period() {
+	return Water.periodic ? Water.sim_size - 1 : Water.sim_size;
+}
+
+static inline void Water_add_height(void* buffer, size_t index, float amount) {
+	if (Water.half) {
+		uint16_t* h = &((uint16_t*)buffer)[index];
+		*h = float_to_half(half_to_float(*h) + amount);
+	}
+	else {
+		((float*)buffer)[index] += amount;
+	}
+}
+
+// A nested simulation runs the whole pool on a coarse grid, and the
+// WATER_FINE_SPAN around Blahaj again on a grid ratio times finer. Each frame
+// the coarse grid steps first, then the fine grid steps with its edges
+// following the coarse heights there, and then hands its heights back to the
+// coarse cells it covers. The fine grid moves in whole coarse cells, keeping
+// the heights it already has, see Water_move_fine.
+#define WATER_FINE_SPAN 20.0f
+
+void Water_init_fine(int ratio) {
+	int n = Water.sim_size;
+	float cell = Water.size / (n - 1);
+
+	Water.fineRatio = ratio;
+	Water.fineStepRatio = ratio;
+	Water.fineCells = ceilf(WATER_FINE_SPAN / cell);
+	Water.fineCells = Water.fineCells < n - 1 ? Water.fineCells : n - 1;
+	Water.fineSize = Water.fineCells * ratio + 1;
+	Water.fineX = (n - 1 - Water.fineCells) / 2;
+	Water.fineY = Water.fineX;
+	glm_vec2_zero(Water.focus);
+	glm_vec2_zero(Water.fineFocus);
+
+	int f = Water.fineSize;
+	Water.fineU = xmalloc(f * f * sizeof(float));
+	Water.fineUPrev = xmalloc(f * f * sizeof(float));
+	Water.fineNormals = xmalloc(f * f * sizeof(uint32_t));
+	memset(Water.fineU, 0, f * f * sizeof(float));
+	memset(Water.fineUPrev, 0, f * f * sizeof(float));
+	memset(Water.fineNormals, 0, f * f * sizeof(uint32_t));
+	for (int b = 0; b < 2; b++) {
+		Water.fineScratch[b] = xmalloc(f * f * sizeof(float));
+		Water.fineEdges[b] = xmalloc(4 * f * sizeof(float));
+	}
+}
+
+// Sets up the simulation state only, so it can also run without a GL context.
+void Water_init_sim(int sim_size) {
+	Water.sim_size = sim_size;
+	Water.c = 4;
+	Water.size = 100;
+	Water.cpuNormals = !Settings.waterHeightTexture;
+	Water.kernel = Water_select_kernel(Settings.waterKernel);
+	Water.workers = WorkerPool_new(Settings.waterThreads > 0 ? Settings.waterThreads : cpu_count());
+
+	int cells = Water.sim_size * Water.sim_size;
+	Water.periodic = Settings.waterPeriodic;
+	Water.half = Settings.waterHalf;
+	Water.cellBytes = Water.half ? sizeof(uint16_t) : sizeof(float);
+	Water.u = xmalloc(cells * Water.cellBytes);
+	Water.uPrev = xmalloc(cells * Water.cellBytes);
+	Water.normals = xmalloc(cells * sizeof(uint32_t));
+	memset(Water.u, 0, cells * Water.cellBytes);
+	memset(Water.uPrev, 0, cells * Water.cellBytes);
+	memset(Water.normals, 0, cells * sizeof(uint32_t));
+
+	Water.impulses = Vector_new(sizeof(WaterImpulse));
+	Water.tilesX = (Water.sim_size + WATER_TILE_SIZE - 1) / WATER_TILE_SIZE;
+	Water.tileStart = xmalloc((Water.tilesX * Water.tilesX + 1) * sizeof(int));
+	Water.tileImpulses = NULL;
+	Water.tileImpulsesCapacity = 0;
+	Water.tileScratch = xmalloc(2 * Water.tilesX * sizeof(int));
+
+	// Everything starts awake and dirty so the first step fills in the
+	// normals and the first upload fills the GPU buffers.
+	int tileCount = Water.tilesX * Water.tilesX;
+	Water.tileActive = xmalloc(tileCount);
+	Water.tileNext = xmalloc(tileCount);
+	Water.tileChanged = xmalloc(tileCount);
+	Water.tileDirty = xmalloc(tileCount);
+	Water.tileEnergy = xmalloc(tileCount * sizeof(float));
+	Water.tileMin = xmalloc(tileCount * sizeof(float));
+	Water.tileMax = xmalloc(tileCount * sizeof(float));
+	memset(Water.tileActive, 1, tileCount);
+	memset(Water.tileDirty, 1, tileCount);
+	memset(Water.tileEnergy, 0, tileCount * sizeof(float));
+	Water.activeTiles = tileCount;
+
+	if (Settings.waterNested > 0) {
+		Water_init_fine(Settings.waterNested);
+	}
+	else {
+		Water.fineSize = 0;
+	}
+}
+
+void Water_delete_sim() {
+	WorkerPool_delete(Water.workers);
+
+	xfree(Water.u);
+	xfree(Water.uPrev);
+	xfree(Water.normals);
+	xfree(Water.blockScratch);
+	Water.blockScratch = NULL;
+	Water.blockScratchCapacity = 0;
+
+	for (int i = 0; i < WATER_STAMP_CACHE_SIZE; i++) {
+		xfree(Water.stamps[i].weights);
+	}
+	memset(Water.stamps, 0, sizeof(Water.stamps));
+
+	Vector_delete(Water.impulses);
+	xfree(Water.tileStart);
+	xfree(Water.tileImpulses);
+	xfree(Water.tileScratch);
+	xfree(Water.tileActive);
+	xfree(Water.tileNext);
+	xfree(Water.tileChanged);
+	xfree(Water.tileDirty);
+	xfree(Water.tileEnergy);
+	xfree(Water.tileMin);
+	xfree(Water.tileMax);
+
+	if (Water.fineSize > 0) {
+		xfree(Water.fineU);
+		xfree(Water.fineUPrev);
+		xfree(Water.fineNormals);
+		for (int b = 0; b < 2; b++) {
+			xfree(Water.fineScratch[b]);
+			xfree(Water.fineEdges[b]);
+		}
+		Water.fineSize = 0;
+	}
+}
+
+// The grid is drawn as WATER_PATCH_SIZE x WATER_PATCH_SIZE cell patches.
+// Every patch uses the same indices, relative to its corner vertex, so only
+// the full patch and the narrower patches along the last row and column
+// need index ranges. Each row of cells is one strip ended by a restart.
+void Water_init_grid() {
+	int n = Water.sim_size;
+	int cells = n - 1;
+	int p = WATER_PATCH_SIZE;
+
+	if (p * n + p >= WATER_PATCH_RESTART) {
+		panic("Water grid of %d is too wide for 16-bit patch indices\n", n);
+	}
+
+	Water.patchesX = (cells + p - 1) / p;
+	int last = cells - (Water.patchesX - 1) * p;
+
+	int total = 0;
+	for (int variant = 0; variant < 4; variant++) {
+		int w = variant & 1 ? last : p;
+		int h = variant & 2 ? last : p;
+		Water.patchIndexOffset[variant] = total;
+		Water.patchIndexCount[variant] = h * (2 * (w + 1) + 1);
+		total += Water.patchIndexCount[variant];
+	}
+	Water.indexCount = total;
+
+	uint16_t* indices = xmalloc(total * sizeof(uint16_t));
+	int indicesI = 0;
+	for (int variant = 0; variant < 4; variant++) {
+		int w = variant & 1 ? last : p;
+		int h = variant & 2 ? last : p;
+		for (int i = 0; i < h; i++) {
+			for (int j = 0; j <= w; j++) {
+				indices[indicesI++] = i * n + j;
+				indices[indicesI++] = (i + 1) * n + j;
+			}
+			indices[indicesI++] = WATER_PATCH_RESTART;
 		}
+	}
+
+	glGenBuffers(1, &Water.ebo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, Water.ebo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, total * sizeof(uint16_t), indices, GL_STATIC_DRAW);
+	xfree(indices);
+
+	int patches = Water.patchesX * Water.patchesX;
+	Water.patchCounts = xmalloc(patches * sizeof(GLsizei));
+	Water.patchOffsets = xmalloc(patches * sizeof(void*));
+	Water.patchBaseVertex = xmalloc(patches * sizeof(GLint));
+
+	glGenBuffers(1, &Water.vbo_xy);
+	glBindBuffer(GL_ARRAY_BUFFER, Water.vbo_xy);
 	
-		mat4 modelMat;
-		glm_mat4_identity(modelMat);
-		glm_translate(modelMat, fish->pos);
-		glm_rotate_y(modelMat, PI-fish->yaw, modelMat);
-		glm_rotate_x(modelMat, fish->roll, modelMat);
-		glm_scale_uni(modelMat, fish->scale);
+	float* xy = xmalloc(Water.sim_size * Water.sim_size * 2 * sizeof(float));
+	for (int i = 0; i < Water.sim_size; i++) {
+		for (int j = 0; j < Water.sim_size; j++) {
+			float x = mapf(j, 0, Water.sim_size - 1, -Water.size / 2, Water.size / 2);
+			float y = mapf(i, 0, Water.sim_size - 1, -Water.size / 2, Water.size / 2);
 
-		mat4 mvp;
-		glm_mat4_mul(projMat, viewMat, mvp);
-		glm_mat4_mul(mvp, modelMat, mvp);
+			xy[2 * (i * Water.sim_size + j) + 0] = x;
+			xy[2 * (i * Water.sim_size + j) + 1] = y;
+		}
+	}
+	glBufferData(GL_ARRAY_BUFFER, Water.sim_size * Water.sim_size * 2 * sizeof(float), xy, GL_STATIC_DRAW);
 
-		glUniformMatrix4fv(mat_loc, 1, GL_FALSE, (float*)mvp);
-		glUniformMatrix4fv(view_loc, 1, GL_FALSE, (float*)viewMat);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+}
 
-		glBindTexture(GL_TEXTURE_2D, fishModel->texture);
+void Water_clipmap_quad(uint16_t* indices, int* count, int m, int x, int z) {
+	int a = z * (m + 1) + x;
+	int b = (z + 1) * (m + 1) + x;
+
+	indices[(*count)++] = a;
+	indices[(*count)++] = b;
+	indices[(*count)++] = a + 1;
+
+	indices[(*count)++] = a + 1;
+	indices[(*count)++] = b;
+	indices[(*count)++] = b + 1;
+}
+
+// Every level of the clipmap is drawn from the same (m+1)x(m+1) grid of
+// vertices, placed and scaled by uniforms. Level 0 uses all of its cells.
+// The coarser levels leave a hole of m/2 cells for the level inside them.
+// Each level snaps to the grid of the next coarser one, so the hole is either
+// m/4 or m/4+1 cells from the edge on each axis. The index buffer holds the
+// full grid and then the ring for each of those four hole positions.
+void Water_init_clipmap() {
+	int m = Settings.waterClipmap;
 
-		glDrawArrays(GL_TRIANGLES, 0, fishModel->vertexCount);
+	glGenBuffers(1, &Water.vbo_xy);
+	glBindBuffer(GL_ARRAY_BUFFER, Water.vbo_xy);
+
+	float* grid = xmalloc((m + 1) * (m + 1) * 2 * sizeof(float));
+	for (int z = 0; z <= m; z++) {
+		for (int x = 0; x <= m; x++) {
+			grid[2 * (z * (m + 1) + x) + 0] = x;
+			grid[2 * (z * (m + 1) + x) + 1] = z;
+		}
 	}
+	glBufferData(GL_ARRAY_BUFFER, (m + 1) * (m + 1) * 2 * sizeof(float), grid, GL_STATIC_DRAW);
+	xfree(grid);
 
-	for (int i = 0; i < fishes->count; i++) {
-		Fish* fish = &((Fish*)fishes->data)[i];
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
 
-		if (fish->dead) {
-			((Fish*)fishes->data)[i] = ((Fish*)fishes->data)[--fishes->count];
+	Water.clipmapRingCells = m * m - (m / 2) * (m / 2);
+	Water.indexCount = (m * m + 4 * Water.clipmapRingCells) * 6;
+
+	uint16_t* indices = xmalloc(Water.indexCount * sizeof(uint16_t));
+	int count = 0;
+	for (int z = 0; z < m; z++) {
+		for (int x = 0; x < m; x++) {
+			Water_clipmap_quad(indices, &count, m, x, z);
+		}
+	}
+	for (int variant = 0; variant < 4; variant++) {
+		int hx = m / 4 + (variant & 1);
+		int hz = m / 4 + (variant >> 1);
+		for (int z = 0; z < m; z++) {
+			for (int x = 0; x < m; x++) {
+				if (x >= hx && x < hx + m / 2 && z >= hz && z < hz + m / 2) {
+					continue;
+				}
+				Water_clipmap_quad(indices, &count, m, x, z);
+			}
+		}
+	}
+
+	glGenBuffers(1, &Water.ebo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, Water.ebo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, Water.indexCount * sizeof(uint16_t), indices, GL_STATIC_DRAW);
+	xfree(indices);
+
+	// The finest level matches the simulation grid, unless the outermost
+	// level would then not reach across the whole pool from the camera.
+	float cell = Water.size / (Water.sim_size - 1);
+	Water.clipmapSpacing = cell;
+	Water.clipmapLod = 0;
+	while (m * Water.clipmapSpacing * (1 << (Settings.waterClipmapLevels - 1)) < 2 * Water.size) {
+		Water.clipmapSpacing *= 2;
+		Water.clipmapLod++;
+	}
+
+	Water.clipmapTriangles = 2 * (m * m + (Settings.waterClipmapLevels - 1) * Water.clipmapRingCells);
+}
+
+// The fine grid of a nested simulation is drawn whole, as one strip per row
+// like a patch, from its own vertex array. Its heights and normals are sent
+// in full every frame.
+void Water_init_fine_mesh() {
+	int f = Water.fineSize;
+	float spacing = Water.size / (Water.sim_size - 1) / Water.fineRatio;
+
+	if (f * f >= WATER_PATCH_RESTART) {
+		panic("Fine water grid of %d is too wide for 16-bit indices\n", f);
+	}
+
+	glGenVertexArrays(1, &Water.fineVao);
+	glBindVertexArray(Water.fineVao);
+
+	Water.fineIndexCount = (f - 1) * (2 * f + 1);
+	uint16_t* indices = xmalloc(Water.fineIndexCount * sizeof(uint16_t));
+	int count = 0;
+	for (int i = 0; i < f - 1; i++) {
+		for (int j = 0; j < f; j++) {
+			indices[count++] = i * f + j;
+			indices[count++] = (i + 1) * f + j;
+		}
+		indices[count++] = WATER_PATCH_RESTART;
+	}
+
+	glGenBuffers(1, &Water.fineEbo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, Water.fineEbo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, Water.fineIndexCount * sizeof(uint16_t), indices, GL_STATIC_DRAW);
+	xfree(indices);
+
+	// Positions are relative to the grid's corner, which u_offset moves.
+	float* xy = xmalloc(f * f * 2 * sizeof(float));
+	for (int i = 0; i < f; i++) {
+		for (int j = 0; j < f; j++) {
+			xy[2 * (i * f + j) + 0] = j * spacing;
+			xy[2 * (i * f + j) + 1] = i * spacing;
+		}
+	}
+	glGenBuffers(1, &Water.fineVboXy);
+	glBindBuffer(GL_ARRAY_BUFFER, Water.fineVboXy);
+	glBufferData(GL_ARRAY_BUFFER, f * f * 2 * sizeof(float), xy, GL_STATIC_DRAW);
+	xfree(xy);
+
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+
+	glGenBuffers(1, &Water.fineVboU);
+	glBindBuffer(GL_ARRAY_BUFFER, Water.fineVboU);
+	glBufferData(GL_ARRAY_BUFFER, f * f * sizeof(float), NULL, GL_STREAM_DRAW);
+
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 0, 0);
+
+	glGenBuffers(1, &Water.fineVboNormal);
+	glBindBuffer(GL_ARRAY_BUFFER, Water.fineVboNormal);
+	glBufferData(GL_ARRAY_BUFFER, f * f * sizeof(uint32_t), NULL, GL_STREAM_DRAW);
+
+	glEnableVertexAttribArray(2);
+	glVertexAttribPointer(2, 4, GL_INT_2_10_10_10_REV, GL_TRUE, 0, 0);
+
+	glBindVertexArray(Water.vao);
+}
+
+void Water_init() {
+	bool gpu = Settings.waterGpu && GLAD_GL_VERSION_4_3;
+	if (Settings.waterGpu && !gpu) {
+		printf("No GL 4.3 compute shaders, stepping the water on the CPU\n");
+	}
+
+	int nested = Settings.waterNested;
+	Water_init_sim(nested > 0 ? (Settings.waterCells - 1) / nested + 1 : Settings.waterCells);
+
+	glGenVertexArrays(1, &Water.vao);
+	glBindVertexArray(Water.vao);
+
+	if (Settings.waterClipmap > 0) {
+		Water_init_clipmap();
+	}
+	else {
+		Water_init_grid();
+	}
+
+	if (Settings.waterHeightTexture) {
+		glGenTextures(1, &Water.heightTexture);
+		glBindTexture(GL_TEXTURE_2D, Water.heightTexture);
+
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+		glPixelStorei(GL_UNPACK_ALIGNMENT, Water.cellBytes);
+		glTexImage2D(GL_TEXTURE_2D, 0, Water.half ? GL_R16F : GL_R32F, Water.sim_size, Water.sim_size, 0, GL_RED, Water.half ? GL_HALF_FLOAT : GL_FLOAT, Water.u);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+		glGenBuffers(1, &Water.pbo);
+
+		if (Settings.waterClipmap > 0) {
+			// The coarser levels sample the mip that matches their spacing.
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glGenerateMipmap(GL_TEXTURE_2D);
+
+			Water.shader = Assets_shader("data/shaders/water_clipmap.vs", "data/shaders/ocean.glsl", "data/shaders/water.fs");
+			glUseProgram(Water.shader);
+			glUniform1i(glGetUniformLocation(Water.shader, "u_height"), 1);
+			glUniform1f(glGetUniformLocation(Water.shader, "u_cells"), Settings.waterClipmap);
+			glUniform1f(glGetUniformLocation(Water.shader, "u_half_size"), Water.size / 2);
+			glUniform1f(glGetUniformLocation(Water.shader, "u_cell_size"), Water.size / (Water.sim_size - 1));
+
+			Water.originLoc = glGetUniformLocation(Water.shader, "u_origin");
+			Water.spacingLoc = glGetUniformLocation(Water.shader, "u_spacing");
+			Water.lodLoc = glGetUniformLocation(Water.shader, "u_lod");
+			Water.cameraLoc = glGetUniformLocation(Water.shader, "u_camera");
+		}
+		else {
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+			Water.shader = Assets_shader("data/shaders/water_height.vs", "data/shaders/ocean.glsl", "data/shaders/water.fs");
+			glUseProgram(Water.shader);
+			glUniform1i(glGetUniformLocation(Water.shader, "u_height"), 1);
+		}
+	}
+	else if (gpu) {
+		Water_init_gpu();
+
+		// Attribute 1 follows the current heights, see Water_update.
+		glEnableVertexAttribArray(1);
+
+		glBindBuffer(GL_ARRAY_BUFFER, Water.vbo_normal);
+		glEnableVertexAttribArray(2);
+		glVertexAttribPointer(2, 4, GL_INT_2_10_10_10_REV, GL_TRUE, 0, 0);
+
+		Water.shader = Assets_shader("data/shaders/water.vs", "data/shaders/ocean.glsl", "data/shaders/water.fs");
+	}
+	else {
+		glGenBuffers(1, &Water.vbo_u);
+		glBindBuffer(GL_ARRAY_BUFFER, Water.vbo_u);
+		glBufferData(GL_ARRAY_BUFFER, Water.sim_size * Water.sim_size * Water.cellBytes, NULL, GL_STREAM_DRAW);
+
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(1, 1, Water.half ? GL_HALF_FLOAT : GL_FLOAT, GL_FALSE, 0, 0);
+
+		glGenBuffers(1, &Water.vbo_normal);
+		glBindBuffer(GL_ARRAY_BUFFER, Water.vbo_normal);
+		glBufferData(GL_ARRAY_BUFFER, Water.sim_size * Water.sim_size * sizeof(uint32_t), NULL, GL_STREAM_DRAW);
+
+		glEnableVertexAttribArray(2);
+		glVertexAttribPointer(2, 4, GL_INT_2_10_10_10_REV, GL_TRUE, 0, 0);
+
+		Water.shader = Assets_shader("data/shaders/water.vs", "data/shaders/ocean.glsl", "data/shaders/water.fs");
+
+		if (Water.fineSize > 0) {
+			Water_init_fine_mesh();
+		}
+	}
+
+	mat_loc2 = glGetUniformLocation(Water.shader, "u_mat");
+	view_loc2 = glGetUniformLocation(Water.shader, "u_view");
+	Water.offsetLoc = glGetUniformLocation(Water.shader, "u_offset");
+	Water.holeLoc = glGetUniformLocation(Water.shader, "u_hole");
+	Water.slopeScaleLoc = glGetUniformLocation(Water.shader, "u_slope_scale");
+
+	// When the ocean draws the far field, the clipmap stays within the pool.
+	glUseProgram(Water.shader);
+	glUniform1f(Water.slopeScaleLoc, 1);
+	glUniform1i(glGetUniformLocation(Water.shader, "u_periodic"), Water.periodic && (Settings.waterClipmap == 0 || Settings.oceanSize == 0));
+
+	if (Settings.waterAsync && !Water.gpu) {
+		Water_start_async();
+	}
+}
+
+// The cells from a stamp's middle to its edge on a grid of the given spacing,
+// n cells across.
+static inline int Water_stamp_radius(float size, float spacing, int n) {
+	float cutoff = sqrtf(-size * logf(WATER_STAMP_EPSILON));
+	int radius = ceilf(cutoff / spacing) + 1;
+	return 2 * radius + 1 > n ? (n - 1) / 2 : radius;
+}
+
+// Gets the stamp for a grid of the given spacing, n cells across. Returns
+// NULL if every slot the stamp could go in is pinned by the queue.
+const WaterStamp* Water_get_stamp(float size, float spacing, int n, int qx, int qy) {
+	uint32_t sizeBits, spacingBits;
+	memcpy(&sizeBits, &size, sizeof(sizeBits));
+	memcpy(&spacingBits, &spacing, sizeof(spacingBits));
+	uint32_t hash = (sizeBits * 2654435761u) ^ (spacingBits * 2246822519u) ^ (qx * WATER_STAMP_SUBCELLS + qy) * 40503u;
+
+	WaterStamp* stamp = NULL;
+	for (int p = 0; p < WATER_STAMP_PROBES; p++) {
+		WaterStamp* slot = &Water.stamps[(hash + p) % WATER_STAMP_CACHE_SIZE];
+		if (slot->width != 0 && slot->size == size && slot->spacing == spacing && slot->qx == qx && slot->qy == qy) {
+			slot->generation = Water.stampGeneration;
+			return slot;
+		}
+		// Prefer an empty slot, then one that no queued impulse uses.
+		if (slot->width == 0) {
+			if (stamp == NULL || stamp->width != 0) {
+				stamp = slot;
+			}
+		}
+		else if (slot->generation != Water.stampGeneration && stamp == NULL) {
+			stamp = slot;
+		}
+	}
+	if (stamp == NULL) {
+		return NULL;
+	}
+
+	int radius = Water_stamp_radius(size, spacing, n);
+	int width = 2 * radius + 1;
+
+	if (stamp->capacity < width * width) {
+		stamp->capacity = width * width;
+		stamp->weights = xrealloc(stamp->weights, stamp->capacity * sizeof(float));
+	}
+
+	stamp->size = size;
+	stamp->spacing = spacing;
+	stamp->qx = qx;
+	stamp->qy = qy;
+	stamp->generation = Water.stampGeneration;
+	stamp->radius = radius;
+	stamp->width = width;
+
+	float ox = qx / (float)WATER_STAMP_SUBCELLS;
+	float oy = qy / (float)WATER_STAMP_SUBCELLS;
+	for (int a = 0; a < width; a++) {
+		for (int b = 0; b < width; b++) {
+			float x = (b - radius - ox) * spacing;
+			float y = (a - radius - oy) * spacing;
+			stamp->weights[a * width + b] = expf(-(x * x + y * y) / size);
+		}
+	}
+
+	return stamp;
+}
+
+// Intersects the run of w cells starting at start, which wraps around at n,
+// with the cells [lo, hi). Writes each overlap's first cell and its offset
+// into the run, and returns how many overlaps there are (at most two).
+int wrap_overlap(int start, int w, int n, int lo, int hi, int* cells, int* offsets) {
+	int count = 0;
+
+	int a0 = start > lo ? start : lo;
+	int a1 = start + w < hi ? start + w : hi;
+	if (a0 < a1) {
+		cells[count] = a0;
+		offsets[count] = a0 - start;
+		count++;
+	}
+
+	// The part of the run past the end of the grid continues at cell 0.
+	int b0 = lo;
+	int b1 = start + w - n < hi ? start + w - n : hi;
+	if (b0 < b1) {
+		cells[count] = b0;
+		offsets[count] = b0 + n - start;
+		count++;
+	}
+
+	return count;
+}
+
+// Lists the tiles along one axis that a wrapped run of w cells touches.
+int Water_run_tiles(int start, int w, int* tiles) {
+	int n = Water_period();
+	int count = 0;
+
+	int end = start + w < n ? start + w : n;
+	for (int t = start / WATER_TILE_SIZE; t <= (end - 1) / WATER_TILE_SIZE; t++) {
+		tiles[count++] = t;
+	}
+
+	if (start + w > n) {
+		int wrapEnd = start + w - n;
+		for (int t = 0; t <= (wrapEnd - 1) / WATER_TILE_SIZE && t < start / WATER_TILE_SIZE; t++) {
+			tiles[count++] = t;
+		}
+	}
+
+	return count;
+}
+
+// Sorts the queued impulses into per-tile lists with a counting sort, so each
+// band can find the impulses that touch its rows without scanning the queue.
+void Water_bin_impulses() {
+	int tileCount = Water.tilesX * Water.tilesX;
+	int* rows = Water.tileScratch;
+	int* cols = Water.tileScratch + Water.tilesX;
+	WaterImpulse* impulses = Water.impulses->data;
+
+	memset(Water.tileStart, 0, (tileCount + 1) * sizeof(int));
+
+	int total = 0;
+	for (int p = 0; p < Water.impulses->count; p++) {
+		int nr = Water_run_tiles(impulses[p].y, impulses[p].stamp->width, rows);
+		int nc = Water_run_tiles(impulses[p].x, impulses[p].stamp->width, cols);
+		for (int r = 0; r < nr; r++) {
+			for (int c = 0; c < nc; c++) {
+				Water.tileStart[rows[r] * Water.tilesX + cols[c] + 1]++;
+			}
+		}
+		total += nr * nc;
+	}
+
+	for (int t = 0; t < tileCount; t++) {
+		Water.tileStart[t + 1] += Water.tileStart[t];
+	}
+
+	if (Water.tileImpulsesCapacity < total) {
+		Water.tileImpulsesCapacity = total;
+		Water.tileImpulses = xrealloc(Water.tileImpulses, total * sizeof(int));
+	}
+
+	// Fill each tile's list, using tileStart[t] as its write cursor. This
+	// shifts every start back by one tile, which the loop below undoes.
+	for (int p = 0; p < Water.impulses->count; p++) {
+		int nr = Water_run_tiles(impulses[p].y, impulses[p].stamp->width, rows);
+		int nc = Water_run_tiles(impulses[p].x, impulses[p].stamp->width, cols);
+		for (int r = 0; r < nr; r++) {
+			for (int c = 0; c < nc; c++) {
+				Water.tileImpulses[Water.tileStart[rows[r] * Water.tilesX + cols[c]]++] = p;
+			}
+		}
+	}
+
+	for (int t = tileCount; t > 0; t--) {
+		Water.tileStart[t] = Water.tileStart[t - 1];
+	}
+	Water.tileStart[0] = 0;
+}
+
+// Adds the binned impulses to the rows [i0, i1). Each cell belongs to exactly
+// one tile, so bands covering different rows never write the same cell.
+// An impulse raises both the current and the previous heights, so it moves
+// the surface without giving it any velocity.
+void Water_apply_impulses(int i0, int i1) {
+	int n = Water.sim_size;
+	int period = Water_period();
+	WaterImpulse* impulses = Water.impulses->data;
+
+	i1 = i1 < period ? i1 : period;
+	if (Water.impulses->count == 0 || i0 >= i1) {
+		return;
+	}
+
+	for (int ty = i0 / WATER_TILE_SIZE; ty <= (i1 - 1) / WATER_TILE_SIZE; ty++) {
+		int y0 = ty * WATER_TILE_SIZE > i0 ? ty * WATER_TILE_SIZE : i0;
+		int y1 = (ty + 1) * WATER_TILE_SIZE < i1 ? (ty + 1) * WATER_TILE_SIZE : i1;
+
+		for (int tx = 0; tx < Water.tilesX; tx++) {
+			int tile = ty * Water.tilesX + tx;
+			int x0 = tx * WATER_TILE_SIZE;
+			int x1 = (tx + 1) * WATER_TILE_SIZE < period ? (tx + 1) * WATER_TILE_SIZE : period;
+
+			for (int e = Water.tileStart[tile]; e < Water.tileStart[tile + 1]; e++) {
+				const WaterImpulse* impulse = &impulses[Water.tileImpulses[e]];
+				const WaterStamp* stamp = impulse->stamp;
+				int w = stamp->width;
+
+				int rowCells[2], rowOffsets[2], colCells[2], colOffsets[2];
+				int nr = wrap_overlap(impulse->y, w, period, y0, y1, rowCells, rowOffsets);
+				int nc = wrap_overlap(impulse->x, w, period, x0, x1, colCells, colOffsets);
+
+				for (int r = 0; r < nr; r++) {
+					int rows = (rowCells[r] + w - rowOffsets[r] < y1 ? rowCells[r] + w - rowOffsets[r] : y1) - rowCells[r];
+					for (int c = 0; c < nc; c++) {
+						int cols = (colCells[c] + w - colOffsets[c] < x1 ? colCells[c] + w - colOffsets[c] : x1) - colCells[c];
+
+						for (int a = 0; a < rows; a++) {
+							size_t row = (rowCells[r] + a) * n + colCells[c];
+							const float* weights = &stamp->weights[(rowOffsets[r] + a) * w + colOffsets[c]];
+							if (Water.half) {
+								for (int b = 0; b < cols; b++) {
+									Water_add_height(Water.u, row + b, impulse->strength * weights[b]);
+									Water_add_height(Water.uPrev, row + b, impulse->strength * weights[b]);
+								}
+								continue;
+							}
+
+							float* cur = Water_cells(Water.u, row);
+							float* prev = Water_cells(Water.uPrev, row);
+							for (int b = 0; b < cols; b++) {
+								cur[b] += impulse->strength * weights[b];
+								prev[b] += impulse->strength * weights[b];
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+
+	if (Water.periodic) {
+		for (int i = i0; i < i1; i++) {
+			memcpy(Water_cells(Water.u, i * n + n - 1), Water_cells(Water.u, i * n), Water.cellBytes);
+			memcpy(Water_cells(Water.uPrev, i * n + n - 1), Water_cells(Water.uPrev, i * n), Water.cellBytes);
+		}
+	}
+}
+
+void Water_clear_impulses() {
+	Water.impulses->count = 0;
+	Water.stampGeneration++;
+}
+
+// Applies the queue straight away, for when it pins every slot of the
+// stamp cache that a new impulse could use.
+void Water_flush_impulses() {
+	Water_bin_impulses();
+	Water_apply_impulses(0, Water.sim_size);
+	Water_clear_impulses();
+}
+
+// Splits a position in cells into a whole cell and a quantised sub-cell offset.
+static inline void Water_split_cell(float g, int* cell, int* sub) {
+	*cell = floorf(g);
+	*sub = roundf((g - *cell) * WATER_STAMP_SUBCELLS);
+	if (*sub == WATER_STAMP_SUBCELLS) {
+		(*cell)++;
+		*sub = 0;
+	}
+}
+
+// Adds a pulse to the fine grid straight away, clipped to the cells inside
+// its edges. The fine grid steps after the coarse one has applied its queue,
+// so both take the pulse in the same step.
+void Water_stamp_fine(float strength, float size, float cx, float cy) {
+	int f = Water.fineSize;
+	float spacing = Water.size / (Water.sim_size - 1) / Water.fineRatio;
+
+	int bx, by, qx, qy;
+	Water_split_cell((cx + Water.size / 2) / spacing - Water.fineX * Water.fineRatio, &bx, &qx);
+	Water_split_cell((cy + Water.size / 2) / spacing - Water.fineY * Water.fineRatio, &by, &qy);
+
+	const WaterStamp* stamp = Water_get_stamp(size, spacing, f, qx, qy);
+	if (stamp == NULL) {
+		Water_flush_impulses();
+		stamp = Water_get_stamp(size, spacing, f, qx, qy);
+	}
+
+	int x0 = bx - stamp->radius;
+	int y0 = by - stamp->radius;
+	int a0 = 1 - y0 > 0 ? 1 - y0 : 0;
+	int a1 = f - 1 - y0 < stamp->width ? f - 1 - y0 : stamp->width;
+	int b0 = 1 - x0 > 0 ? 1 - x0 : 0;
+	int b1 = f - 1 - x0 < stamp->width ? f - 1 - x0 : stamp->width;
+
+	for (int a = a0; a < a1; a++) {
+		float* cur = &Water.fineU[(y0 + a) * f + x0];
+		float* prev = &Water.fineUPrev[(y0 + a) * f + x0];
+		const float* weights = &stamp->weights[a * stamp->width];
+		for (int b = b0; b < b1; b++) {
+			cur[b] += strength * weights[b];
+			prev[b] += strength * weights[b];
 		}
 	}
 }
 
-void sigsegv_func(int signo) {
-	panic("Segmentation fault\n");
+// Queues a Gaussian bump in the water height, centred on (cx, cy) in world
+// space, for the next step. Only the thread that steps the water may call it.
+void Water_stamp_pulse(float strength, float size, float cx, float cy) {
+	float spacing = Water.size / (Water.sim_size - 1);
+
+	int bx, by, qx, qy;
+	Water_split_cell((cx + Water.size / 2) / spacing, &bx, &qx);
+	Water_split_cell((cy + Water.size / 2) / spacing, &by, &qy);
+
+	const WaterStamp* stamp = Water_get_stamp(size, spacing, Water.sim_size, qx, qy);
+	if (stamp == NULL) {
+		Water_flush_impulses();
+		stamp = Water_get_stamp(size, spacing, Water.sim_size, qx, qy);
+	}
+
+	WaterImpulse impulse;
+	impulse.stamp = stamp;
+	impulse.strength = strength;
+	impulse.x = wrapi(bx - stamp->radius, Water_period());
+	impulse.y = wrapi(by - stamp->radius, Water_period());
+	Vector_add(Water.impulses, &impulse);
+
+	if (Water.fineSize > 0) {
+		Water_stamp_fine(strength, size, cx, cy);
+	}
+}
+
+// Adds a Gaussian bump to the water with the next step. With the simulation
+// on its own thread, the pulse is posted to it and stamped there, and on the
+// GPU it is dispatched with the step.
+void Water_add_pulse(float strength, float size, float cx, float cy) {
+	if (Water.gpu) {
+		WaterPulse pulse = {strength, size, cx, cy};
+		Vector_add(Water.gpuPulses, &pulse);
+		return;
+	}
+	if (!Water.async) {
+		Water_stamp_pulse(strength, size, cx, cy);
+		return;
+	}
+
+	WaterPulse pulse = {strength, size, cx, cy};
+	pthread_mutex_lock(&Water.simLock);
+	Vector_add(Water.pulses, &pulse);
+	pthread_mutex_unlock(&Water.simLock);
+}
+
+void Water_normals_row(const void* u, int i, int j0, int j1) {
+	int n = Water.sim_size;
+	if (Water.half) {
+		Water.kernel->normalsHalf(&Water.normals[i * n], Water_cells(u, i * n), Water_cells(u, (i + 1) * n), j0, j1);
+	}
+	else {
+		Water.kernel->normals(&Water.normals[i * n], Water_cells(u, i * n), Water_cells(u, (i + 1) * n), j0, j1);
+	}
+}
+
+typedef struct WaterStep {
+	float k;
+	float keep;
+	int substeps;
+	int blockSteps;
+} WaterStep;
+
+// The rows of both height buffers that a band reads or advances outside its
+// own rows [i0, i1): `above` rows before i0 and `below` rows from i1, copied
+// from the neighbouring bands. Level s of a pass lives in buffers[s & 1], so
+// level -1 (the previous heights) is in buffers[1]. On a periodic grid rows
+// before 0 and from the period on wrap around to the other edge.
+typedef struct WaterBlock {
+	void* buffers[2];
+	int i0;
+	int i1;
+	int above;
+	int below;
+	void* aboveRows[2];
+	void* belowRows[2];
+} WaterBlock;
+
+static inline void* Water_block_row(const WaterBlock* block, int level, int i) {
+	int n = Water.sim_size;
+	int b = level & 1;
+
+	if (i < block->i0 && i >= block->i0 - block->above) {
+		return Water_cells(block->aboveRows[b], (i - (block->i0 - block->above)) * n);
+	}
+	if (i >= block->i1 && i < block->i1 + block->below) {
+		return Water_cells(block->belowRows[b], (i - block->i1) * n);
+	}
+	return Water_cells(block->buffers[b], (size_t)wrapi(i, Water_period()) * n);
+}
+
+// Steps column 0 of a periodic row, whose left neighbour is column n - 2.
+void Water_step_seam(void* next, const void* up, const void* mid, const void* down, const WaterStep* step) {
+	int n = Water.sim_size;
+	float m = Water_height(mid, 0);
+	float lap = Water_height(mid, n - 2) + Water_height(mid, 1) + Water_height(up, 0) + Water_height(down, 0) - 4 * m;
+	Water_set_height(next, 0, m + step->keep * (m - Water_height(next, 0)) + step->k * lap);
+}
+
+// Finds the runs of consecutive flagged tiles in tile row ty and writes
+// their column ranges [j0, j1) to runs as pairs. Returns the number of runs.
+int Water_tile_runs(const uint8_t* flags, int ty, int* runs) {
+	int n = Water.sim_size;
+	const uint8_t* row = &flags[ty * Water.tilesX];
+	int count = 0;
+
+	for (int tx = 0; tx < Water.tilesX; tx++) {
+		if (!row[tx]) {
+			continue;
+		}
+		int start = tx;
+		while (tx + 1 < Water.tilesX && row[tx + 1]) {
+			tx++;
+		}
+		runs[2 * count] = start * WATER_TILE_SIZE;
+		runs[2 * count + 1] = (tx + 1) * WATER_TILE_SIZE < n ? (tx + 1) * WATER_TILE_SIZE : n;
+		count++;
+	}
+
+	return count;
+}
+
+// Writes the next heights of the active cells of row i, whose current
+// heights are mid, over their previous heights in next. When asked, it also
+// measures each tile's energy: its largest height change in this substep,
+// scaled up to a whole frame.
+void Water_step_row(int i, const void* up, const void* mid, const void* down, void* next, const WaterStep* step, bool energy) {
+	int n = Water.sim_size;
+	int ty = wrapi(i, Water_period()) / WATER_TILE_SIZE;
+	int runs[2 * Water.tilesX];
+	int count = Water_tile_runs(Water.tileActive, ty, runs);
+	int first = Water.periodic ? 0 : 1;
+
+	for (int r = 0; r < count; r++) {
+		int j0 = runs[2 * r] < first ? first : runs[2 * r];
+		int j1 = runs[2 * r + 1] < n - 1 ? runs[2 * r + 1] : n - 1;
+		int k0 = j0;
+		if (k0 == 0) {
+			Water_step_seam(next, up, mid, down, step);
+			k0 = 1;
+		}
+		if (Water.half) {
+			Water.kernel->stepHalf(next, up, mid, down, k0, j1, step->k, step->keep);
+		}
+		else {
+			Water.kernel->step(next, up, mid, down, k0, j1, step->k, step->keep);
+		}
+
+		if (!energy) {
+			continue;
+		}
+		for (int j = j0; j < j1; j = (j / WATER_TILE_SIZE + 1) * WATER_TILE_SIZE) {
+			float* tileEnergy = &Water.tileEnergy[ty * Water.tilesX + j / WATER_TILE_SIZE];
+			int end = (j / WATER_TILE_SIZE + 1) * WATER_TILE_SIZE < j1 ? (j / WATER_TILE_SIZE + 1) * WATER_TILE_SIZE : j1;
+			float e = Water.half ? Water.kernel->maxDiffHalf(Water_cells(next, j), Water_cells(mid, j), end - j) : Water.kernel->maxDiff(Water_cells(next, j), Water_cells(mid, j), end - j);
+			e *= step->substeps;
+			*tileEnergy = e > *tileEnergy ? e : *tileEnergy;
+		}
+	}
+
+	// Column 0 may not have been stepped, but then it has not moved either.
+	if (Water.periodic && count > 0) {
+		memcpy(Water_cells(next, n - 1), next, Water.cellBytes);
+	}
+}
+
+void Water_normals_changed_row(const void* u, int i) {
+	if (!Water.cpuNormals) {
+		return;
+	}
+
+	int n = Water.sim_size;
+	int runs[2 * Water.tilesX];
+	int count = Water_tile_runs(Water.tileChanged, i / WATER_TILE_SIZE, runs);
+	int first = Water.periodic ? 0 : 1;
+
+	for (int r = 0; r < count; r++) {
+		int j0 = runs[2 * r] < first ? first : runs[2 * r];
+		int j1 = runs[2 * r + 1] < n - 1 ? runs[2 * r + 1] : n - 1;
+		Water_normals_row(u, i, j0, j1);
+	}
+
+	if (Water.periodic && count > 0) {
+		Water.normals[i * n + n - 1] = Water.normals[i * n];
+	}
+}
+
+// Advances a band by `levels` substeps in a single sweep down its rows. Wave
+// r steps row r to level 1, row r - 1 to level 2 and so on, so a row has
+// every neighbour it needs from the level below, and the heights it writes
+// over are two levels old and already read by all three rows around it.
+// Only a window of levels + 2 rows is live at once, which stays in cache
+// while the sweep reads and writes each height once for all the levels.
+// Rows outside the band are advanced too, one fewer at each level, so the
+// band never has to wait for its neighbours inside a pass. In the frame's
+// last pass the band's own rows measure their energy at the last level, and
+// the normals of each row follow one wave behind.
+void Water_step_block(const WaterBlock* block, int levels, bool last, const WaterStep* step) {
+	int n = Water.sim_size;
+	int i0 = block->i0;
+	int i1 = block->i1;
+
+	// A periodic grid has no fixed rows to stop at.
+	int first = Water.periodic ? i0 - levels : 1;
+	int end = Water.periodic ? i1 + levels : n - 1;
+	int top = i0 - (levels - 1) > first ? i0 - (levels - 1) : first;
+	int bottom = i1 + (levels - 1) < end ? i1 + (levels - 1) : end;
+
+	for (int r = top; r < bottom + levels - 1; r++) {
+		for (int s = 1; s <= levels; s++) {
+			int i = r - (s - 1);
+			int lo = i0 - (levels - s) > first ? i0 - (levels - s) : first;
+			int hi = i1 + (levels - s) < end ? i1 + (levels - s) : end;
+			if (i < lo || i >= hi) {
+				continue;
+			}
+
+			const void* up = Water_block_row(block, s - 1, i - 1);
+			const void* mid = Water_block_row(block, s - 1, i);
+			const void* down = Water_block_row(block, s - 1, i + 1);
+			bool final = last && s == levels;
+			Water_step_row(i, up, mid, down, Water_block_row(block, s, i), step, final && i >= i0 && i < i1);
+
+			if (final && i - 1 >= i0 && i - 1 >= (Water.periodic ? 0 : 1)) {
+				Water_normals_changed_row(block->buffers[levels & 1], i - 1);
+			}
+		}
+	}
+
+	// The last row is never stepped, so the one above it is left over.
+	if (last && i1 == n && n - 2 >= i0 && n - 2 >= 1) {
+		Water_normals_changed_row(block->buffers[levels & 1], n - 2);
+	}
+}
+
+// Each worker owns a band of whole tile rows. Queued impulses are added to
+// the band first, then the substeps are run in passes of up to blockSteps
+// levels each. Before a pass of more than one level the band copies the
+// neighbouring rows it will advance itself. The band's last row of normals
+// waits for the band below. Within a band only the active tiles are
+// simulated, and only the changed tiles get new normals.
+void Water_step_band(void* arg, int band, int bands) {
+	WaterStep* step = arg;
+	int n = Water.sim_size;
+	int period = Water_period();
+	int ty0 = Water.tilesX * band / bands;
+	int ty1 = Water.tilesX * (band + 1) / bands;
+	int i0 = ty0 * WATER_TILE_SIZE;
+	int i1 = ty1 * WATER_TILE_SIZE < period ? ty1 * WATER_TILE_SIZE : period;
+
+#ifdef WATER_X86
+	// Ripples decay towards zero and would otherwise spend most of their
+	// life as denormals, which are many times slower to compute with.
+	_mm_setcsr(_mm_getcsr() | _MM_FLUSH_ZERO_ON | _MM_DENORMALS_ZERO_ON);
+#endif
+
+	Water_apply_impulses(i0, i1);
+
+	WaterBlock block;
+	block.buffers[0] = Water.u;
+	block.buffers[1] = Water.uPrev;
+	block.i0 = i0;
+	block.i1 = i1;
+
+	void* scratch = Water_cells(Water.blockScratch, band * 4 * step->blockSteps * n);
+	for (int b = 0; b < 2; b++) {
+		block.aboveRows[b] = Water_cells(scratch, b * step->blockSteps * n);
+		block.belowRows[b] = Water_cells(scratch, (2 + b) * step->blockSteps * n);
+	}
+
+	for (int done = 0; done < step->substeps && i0 < i1; ) {
+		int levels = step->substeps - done < step->blockSteps ? step->substeps - done : step->blockSteps;
+
+		WorkerPool_barrier(Water.workers);
+
+		// A single level only reads the neighbours' current heights, which
+		// they leave alone while they write the next ones.
+		block.above = levels > 1 ? (levels < i0 || Water.periodic ? levels : i0) : 0;
+		block.below = levels > 1 ? (levels < n - i1 || Water.periodic ? levels : n - i1) : 0;
+		if (levels > 1) {
+			for (int b = 0; b < 2; b++) {
+				for (int k = 0; k < block.above; k++) {
+					memcpy(Water_cells(block.aboveRows[b], k * n), Water_cells(block.buffers[b], (size_t)wrapi(i0 - block.above + k, period) * n), n * Water.cellBytes);
+				}
+				for (int k = 0; k < block.below; k++) {
+					memcpy(Water_cells(block.belowRows[b], k * n), Water_cells(block.buffers[b], (size_t)wrapi(i1 + k, period) * n), n * Water.cellBytes);
+				}
+			}
+			WorkerPool_barrier(Water.workers);
+		}
+
+		done += levels;
+		Water_step_block(&block, levels, done == step->substeps, step);
+
+		if (levels % 2 == 1) {
+			void* swap = block.buffers[0];
+			block.buffers[0] = block.buffers[1];
+			block.buffers[1] = swap;
+		}
+	}
+
+	WorkerPool_barrier(Water.workers);
+
+	// The last row's normals read the copy of row 0 below it.
+	if (Water.periodic && i1 == period) {
+		memcpy(Water_cells(block.buffers[0], (size_t)(n - 1) * n), block.buffers[0], n * Water.cellBytes);
+	}
+
+	if (i1 - 1 >= i0 && i1 - 1 >= (Water.periodic ? 0 : 1) && i1 - 1 < n - 1) {
+		Water_normals_changed_row(block.buffers[0], i1 - 1);
+	}
+
+	if (Water.periodic && i1 == period && Water.cpuNormals) {
+		memcpy(&Water.normals[(n - 1) * n], Water.normals, n * sizeof(uint32_t));
+	}
+}
+
+// Wakes the tiles that impulses land on, and finds the tiles whose heights
+// or normals the coming step can change. A normal reads the cells to its
+// right and below, so tiles left of and above an active tile change too.
+// Changed tiles stay dirty until Water_upload sends them to the GPU.
+// The tiles holding distinct cells. In a periodic grid a tile past them only
+// holds the copy of column or row 0, so its neighbours wrap around to tile 0.
+static inline int Water_period_tiles() {
+	return (Water_period() + WATER_TILE_SIZE - 1) / WATER_TILE_SIZE;
+}
+
+void Water_wake_tiles() {
+	int t = Water.tilesX;
+	int tp = Water_period_tiles();
+
+	for (int tile = 0; tile < t * t; tile++) {
+		if (Water.tileStart[tile + 1] > Water.tileStart[tile]) {
+			Water.tileActive[tile] = 1;
+		}
+		Water.tileEnergy[tile] = 0;
+	}
+
+	Water.activeTiles = 0;
+	for (int ty = 0; ty < t; ty++) {
+		for (int tx = 0; tx < t; tx++) {
+			int tile = ty * t + tx;
+			Water.activeTiles += Water.tileActive[tile];
+
+			// A tile's patch ends on the first column and row of the next one.
+			bool right, below;
+			if (Water.periodic) {
+				right = Water.tileActive[ty * t + (tx + 1 < tp ? tx + 1 : 0)];
+				below = Water.tileActive[(ty + 1 < tp ? ty + 1 : 0) * t + tx];
+			}
+			else {
+				right = tx + 1 < t && Water.tileActive[tile + 1];
+				below = ty + 1 < t && Water.tileActive[tile + t];
+			}
+			Water.tileChanged[tile] = Water.tileActive[tile] || right || below;
+			Water.tileDirty[tile] |= Water.tileChanged[tile];
+		}
+	}
+}
+
+void Water_settle_tile(int tx, int ty) {
+	int n = Water.sim_size;
+	int i1 = (ty + 1) * WATER_TILE_SIZE < n ? (ty + 1) * WATER_TILE_SIZE : n;
+	int j0 = tx * WATER_TILE_SIZE;
+	int j1 = (tx + 1) * WATER_TILE_SIZE < n ? (tx + 1) * WATER_TILE_SIZE : n;
+
+	for (int i = ty * WATER_TILE_SIZE; i < i1; i++) {
+		memcpy(Water_cells(Water.uPrev, i * n + j0), Water_cells(Water.u, i * n + j0), (j1 - j0) * Water.cellBytes);
+	}
+}
+
+// Decides which tiles to simulate in the next step from this step's energies.
+void Water_sleep_tiles() {
+	int t = Water.tilesX;
+	int tp = Water_period_tiles();
+
+	for (int ty = 0; ty < t; ty++) {
+		for (int tx = 0; tx < t; tx++) {
+			bool calm = true;
+			bool wake = false;
+
+			for (int y = ty - 1; y <= ty + 1; y++) {
+				for (int x = tx - 1; x <= tx + 1; x++) {
+					// Waves leave a periodic grid through one edge and come
+					// back in through the other.
+					int wx = Water.periodic ? wrapi(x, tp) : x;
+					int wy = Water.periodic ? wrapi(y, tp) : y;
+					if (wx < 0 || wy < 0 || wx >= t || wy >= t) {
+						continue;
+					}
+					float energy = Water.tileEnergy[wy * t + wx];
+					if (energy >= Settings.waterSleepThreshold) {
+						calm = false;
+					}
+					if (energy > Settings.waterWakeThreshold) {
+						wake = true;
+					}
+				}
+			}
+
+			// An impulse only moves u, so its tile shows no energy until
+			// the next step turns the bump into velocity.
+			int tile = ty * t + tx;
+			bool impulse = Water.tileStart[tile + 1] > Water.tileStart[tile];
+			Water.tileNext[tile] = (Water.tileActive[tile] && !calm) || wake || impulse;
+
+			// A sleeping tile is skipped by the step, so its previous heights
+			// must equal its current ones for the swap to leave it alone.
+			if (Water.tileActive[tile] && !Water.tileNext[tile]) {
+				Water_settle_tile(tx, ty);
+			}
+		}
+	}
+
+	memcpy(Water.tileActive, Water.tileNext, t * t);
+}
+
+// The update is only stable while c * h / dx stays below 1 / sqrt(2), so a
+// frame is split into the fewest substeps h that keep under WATER_CFL_LIMIT.
+int Water_substeps(float frameDt) {
+	float dx = Water.size / Water.sim_size;
+	int substeps = ceilf(Water.c * frameDt / dx / WATER_CFL_LIMIT);
+	return substeps > 1 ? substeps : 1;
+}
+
+// The coarse heights in buffer at the fine cell (a, b), interpolated.
+static inline float Water_coarse_at(const void* buffer, int a, int b) {
+	int n = Water.sim_size;
+	int r = Water.fineRatio;
+	int i = Water.fineY + a / r;
+	int j = Water.fineX + b / r;
+	float fz = (float)(a % r) / r;
+	float fx = (float)(b % r) / r;
+
+	// The last fine row and column fall on a coarse one.
+	int down = fz > 0 ? n : 0;
+	int right = fx > 0 ? 1 : 0;
+	size_t c = (size_t)i * n + j;
+	float top = lerpf(Water_height(buffer, c), Water_height(buffer, c + right), fx);
+	float bottom = lerpf(Water_height(buffer, c + down), Water_height(buffer, c + down + right), fx);
+	return lerpf(top, bottom, fz);
+}
+
+// Moves the fine grid by whole coarse cells to centre it on fineFocus,
+// within the pool. The cells it still covers keep their heights, and the
+// rest are interpolated from the coarse grid, with the velocity scaled to
+// the fine grid's shorter step.
+void Water_move_fine() {
+	int n = Water.sim_size;
+	int r = Water.fineRatio;
+	int f = Water.fineSize;
+	int m = Water.fineCells;
+	float cell = Water.size / (n - 1);
+
+	int x = roundf((Water.fineFocus[0] + Water.size / 2) / cell - m / 2.0f);
+	int y = roundf((Water.fineFocus[1] + Water.size / 2) / cell - m / 2.0f);
+	x = x < 0 ? 0 : x > n - 1 - m ? n - 1 - m : x;
+	y = y < 0 ? 0 : y > n - 1 - m ? n - 1 - m : y;
+	if (x == Water.fineX && y == Water.fineY) {
+		return;
+	}
+
+	int dx = (x - Water.fineX) * r;
+	int dy = (y - Water.fineY) * r;
+	Water.fineX = x;
+	Water.fineY = y;
+
+	float* u = Water.fineScratch[0];
+	float* prev = Water.fineScratch[1];
+	for (int a = 0; a < f; a++) {
+		for (int b = 0; b < f; b++) {
+			int oa = a + dy;
+			int ob = b + dx;
+			if (oa >= 0 && oa < f && ob >= 0 && ob < f) {
+				u[a * f + b] = Water.fineU[oa * f + ob];
+				prev[a * f + b] = Water.fineUPrev[oa * f + ob];
+				continue;
+			}
+
+			float h = Water_coarse_at(Water.u, a, b);
+			u[a * f + b] = h;
+			prev[a * f + b] = h - (h - Water_coarse_at(Water.uPrev, a, b)) / Water.fineStepRatio;
+		}
+	}
+
+	Water.fineScratch[0] = Water.fineU;
+	Water.fineScratch[1] = Water.fineUPrev;
+	Water.fineU = u;
+	Water.fineUPrev = prev;
+}
+
+// Keeps the coarse tiles under the fine grid awake, as the fine grid writes
+// its heights into them every frame.
+void Water_wake_fine() {
+	int t = Water.tilesX;
+	int m = Water.fineCells;
+
+	for (int ty = Water.fineY / WATER_TILE_SIZE; ty <= (Water.fineY + m) / WATER_TILE_SIZE && ty < t; ty++) {
+		for (int tx = Water.fineX / WATER_TILE_SIZE; tx <= (Water.fineX + m) / WATER_TILE_SIZE && tx < t; tx++) {
+			Water.tileActive[ty * t + tx] = 1;
+		}
+	}
+}
+
+// Writes the fine heights along the edges of the rows [i0, i1) into u, a
+// fraction t of the way from the start of the frame to its end. The band with
+// the first or last inner row also writes the edge row next to it.
+void Water_set_fine_edges(float* u, int i0, int i1, float t) {
+	int f = Water.fineSize;
+	const float* start = Water.fineEdges[0];
+	const float* end = Water.fineEdges[1];
+
+	for (int i = i0; i < i1; i++) {
+		u[i * f] = lerpf(start[2 * f + i], end[2 * f + i], t);
+		u[i * f + f - 1] = lerpf(start[3 * f + i], end[3 * f + i], t);
+	}
+	if (i0 == 1) {
+		for (int j = 0; j < f; j++) {
+			u[j] = lerpf(start[j], end[j], t);
+		}
+	}
+	if (i1 == f - 1) {
+		for (int j = 0; j < f; j++) {
+			u[(f - 1) * f + j] = lerpf(start[f + j], end[f + j], t);
+		}
+	}
+}
+
+// Each worker steps a band of the fine grid's inner rows. The edges move
+// with the coarse grid over the frame, and every substep only reads the
+// neighbours' current heights, so one barrier per substep is enough. The
+// normals wait for the last edges.
+void Water_step_fine_band(void* arg, int band, int bands) {
+	const WaterStep* step = arg;
+	int f = Water.fineSize;
+	int i0 = 1 + (f - 2) * band / bands;
+	int i1 = 1 + (f - 2) * (band + 1) / bands;
+
+#ifdef WATER_X86
+	_mm_setcsr(_mm_getcsr() | _MM_FLUSH_ZERO_ON | _MM_DENORMALS_ZERO_ON);
+#endif
+
+	float* cur = Water.fineU;
+	float* next = Water.fineUPrev;
+	for (int s = 0; s < step->substeps; s++) {
+		Water_set_fine_edges(cur, i0, i1, (float)s / step->substeps);
+		for (int i = i0; i < i1; i++) {
+			Water.kernel->step(&next[i * f], &cur[(i - 1) * f], &cur[i * f], &cur[(i + 1) * f], 1, f - 1, step->k, step->keep);
+		}
+
+		float* swap = cur;
+		cur = next;
+		next = swap;
+		WorkerPool_barrier(Water.workers);
+	}
+
+	Water_set_fine_edges(cur, i0, i1, 1);
+	WorkerPool_barrier(Water.workers);
+
+	int r0 = i0 == 1 ? 0 : i0;
+	for (int i = r0; i < i1; i++) {
+		Water.kernel->normals(&Water.fineNormals[i * f], &cur[i * f], &cur[(i + 1) * f], 0, f - 1);
+		Water.fineNormals[i * f + f - 1] = Water.fineNormals[i * f + f - 2];
+	}
+	if (i1 == f - 1) {
+		memcpy(&Water.fineNormals[(f - 1) * f], &Water.fineNormals[(f - 2) * f], f * sizeof(uint32_t));
+	}
+}
+
+// Hands the fine heights back to the coarse cells inside the fine grid, each
+// the average of the fine cells around it, which keeps detail the coarse
+// grid cannot carry from aliasing into it. The previous heights are set so
+// the coarse cells keep the fine grid's velocity over their longer step.
+void Water_restrict_fine() {
+	int n = Water.sim_size;
+	int r = Water.fineRatio;
+	int f = Water.fineSize;
+	int m = Water.fineCells;
+	int h = r / 2;
+	float inv = 1.0f / ((2 * h + 1) * (2 * h + 1));
+
+	for (int ci = 1; ci < m; ci++) {
+		for (int cj = 1; cj < m; cj++) {
+			float u = 0;
+			float v = 0;
+			for (int a = ci * r - h; a <= ci * r + h; a++) {
+				for (int b = cj * r - h; b <= cj * r + h; b++) {
+					u += Water.fineU[a * f + b];
+					v += Water.fineU[a * f + b] - Water.fineUPrev[a * f + b];
+				}
+			}
+			size_t c = (size_t)(Water.fineY + ci) * n + Water.fineX + cj;
+			Water_set_height(Water.u, c, u * inv);
+			Water_set_height(Water.uPrev, c, (u - Water.fineStepRatio * v) * inv);
+		}
+	}
+
+	int t = Water.tilesX;
+	for (int i = Water.fineY; i < Water.fineY + m; i++) {
+		if (Water.cpuNormals) {
+			Water_normals_row(Water.u, i, Water.fineX, Water.fineX + m);
+		}
+	}
+	for (int ty = Water.fineY / WATER_TILE_SIZE; ty <= (Water.fineY + m) / WATER_TILE_SIZE && ty < t; ty++) {
+		for (int tx = Water.fineX / WATER_TILE_SIZE; tx <= (Water.fineX + m) / WATER_TILE_SIZE && tx < t; tx++) {
+			Water.tileDirty[ty * t + tx] = 1;
+		}
+	}
+}
+
+// Steps the fine grid over the frame the coarse grid has just stepped, in
+// at least as many substeps as the coarse grid took, then restricts it into
+// the coarse grid.
+void Water_step_fine(float frameDt, int substeps) {
+	int f = Water.fineSize;
+	float dx = Water.size / Water.sim_size / Water.fineRatio;
+	int fineSubsteps = ceilf(Water.c * frameDt / dx / WATER_CFL_LIMIT);
+	fineSubsteps = fineSubsteps > substeps ? fineSubsteps : substeps;
+	float h = frameDt / fineSubsteps;
+	Water.fineStepRatio = (float)fineSubsteps / substeps;
+
+	WaterStep step;
+	step.k = Water.c * Water.c * h * h / (dx * dx);
+	step.keep = clampf(1 - Settings.waterDamping * h, 0, 1);
+	step.substeps = fineSubsteps;
+	step.blockSteps = 1;
+
+	// Top, bottom, left and right, from the fine edges as they are and the
+	// coarse grid as it is now.
+	float* start = Water.fineEdges[0];
+	float* end = Water.fineEdges[1];
+	for (int k = 0; k < f; k++) {
+		start[k] = Water.fineU[k];
+		start[f + k] = Water.fineU[(f - 1) * f + k];
+		start[2 * f + k] = Water.fineU[k * f];
+		start[3 * f + k] = Water.fineU[k * f + f - 1];
+		end[k] = Water_coarse_at(Water.u, 0, k);
+		end[f + k] = Water_coarse_at(Water.u, f - 1, k);
+		end[2 * f + k] = Water_coarse_at(Water.u, k, 0);
+		end[3 * f + k] = Water_coarse_at(Water.u, k, f - 1);
+	}
+
+	WorkerPool_run(Water.workers, Water_step_fine_band, &step);
+	if (step.substeps % 2 == 1) {
+		float* swap = Water.fineU;
+		Water.fineU = Water.fineUPrev;
+		Water.fineUPrev = swap;
+	}
+
+	Water_restrict_fine();
+}
+
+// Advances the water by frameDt seconds split into the given number of substeps.
+void Water_step_frame(float frameDt, int substeps) {
+	int n = Water.sim_size;
+	float dx = Water.size / n;
+	float h = frameDt / substeps;
+	Water.substeps = substeps;
+
+	WaterStep step;
+	step.k = Water.c * Water.c * h * h / (dx * dx);
+	step.keep = clampf(1 - Settings.waterDamping * h, 0, 1);
+	step.substeps = substeps;
+	step.blockSteps = Settings.waterBlockSteps < substeps ? Settings.waterBlockSteps : substeps;
+
+	size_t scratch = (size_t)Water.workers->count * 4 * step.blockSteps * n * Water.cellBytes;
+	if (scratch > Water.blockScratchCapacity) {
+		Water.blockScratch = xrealloc(Water.blockScratch, scratch);
+		Water.blockScratchCapacity = scratch;
+	}
+
+	if (Water.fineSize > 0) {
+		Water_move_fine();
+		Water_wake_fine();
+	}
+
+	Water_bin_impulses();
+	Water_wake_tiles();
+	WorkerPool_run(Water.workers, Water_step_band, &step);
+	if (Water.substeps % 2 == 1) {
+		void* swap = Water.u;
+		Water.u = Water.uPrev;
+		Water.uPrev = swap;
+	}
+	Water_sleep_tiles();
+	Water_clear_impulses();
+
+	if (Water.fineSize > 0) {
+		Water_step_fine(frameDt, substeps);
+	}
+}
+
+void Water_step_sim() {
+	Water_step_frame(dt, Water_substeps(dt));
+}
+
+// Copies the tiles that changed since this frame was last written into it,
+// then swaps it with the one in frameLatest and marks that as fresh.
+void Water_publish_frame() {
+	int n = Water.sim_size;
+	int t = Water.tilesX;
+	WaterFrame* frame = &Water.frames[Water.frameBack];
+
+	for (int ty = 0; ty < t; ty++) {
+		for (int tx = 0; tx < t; tx++) {
+			int tile = ty * t + tx;
+			if (Water.tileDirty[tile]) {
+				Water.tileVersion[tile]++;
+				Water.tileDirty[tile] = 0;
+			}
+			if (frame->tileVersion[tile] == Water.tileVersion[tile]) {
+				continue;
+			}
+
+			int i1 = (ty + 1) * WATER_TILE_SIZE < n ? (ty + 1) * WATER_TILE_SIZE : n;
+			int j0 = tx * WATER_TILE_SIZE;
+			int j1 = (tx + 1) * WATER_TILE_SIZE < n ? (tx + 1) * WATER_TILE_SIZE : n;
+			for (int i = ty * WATER_TILE_SIZE; i < i1; i++) {
+				memcpy(Water_cells(frame->heights, i * n + j0), Water_cells(Water.u, i * n + j0), (j1 - j0) * Water.cellBytes);
+				if (Water.cpuNormals) {
+					memcpy(&frame->normals[i * n + j0], &Water.normals[i * n + j0], (j1 - j0) * sizeof(uint32_t));
+				}
+			}
+			frame->tileVersion[tile] = Water.tileVersion[tile];
+		}
+	}
+	frame->activeTiles = Water.activeTiles;
+
+	// The fine grid changes all over every frame.
+	if (Water.fineSize > 0) {
+		int f = Water.fineSize;
+		memcpy(frame->fine, Water.fineU, f * f * sizeof(float));
+		memcpy(frame->fineNormals, Water.fineNormals, f * f * sizeof(uint32_t));
+		frame->fineX = Water.fineX;
+		frame->fineY = Water.fineY;
+	}
+
+	Water.frameBack = atomic_exchange(&Water.frameLatest, Water.frameBack | WATER_FRAME_FRESH) & ~WATER_FRAME_FRESH;
+}
+
+// Steps once for every frame the renderer asked for since the last step, in
+// a single longer step. Past WATER_ASYNC_MAX_FRAMES the rest are dropped and
+// the water runs slower than the game rather than falling further behind.
+void* Water_sim_thread(void* data) {
+	pthread_mutex_lock(&Water.simLock);
+
+	while (true) {
+		while (!Water.simQuit && Water.framesRequested == 0) {
+			pthread_cond_wait(&Water.simWake, &Water.simLock);
+		}
+		if (Water.simQuit) {
+			break;
+		}
+
+		int frames = Water.framesRequested < WATER_ASYNC_MAX_FRAMES ? Water.framesRequested : WATER_ASYNC_MAX_FRAMES;
+		Water.framesRequested = 0;
+		Vector* pulses = Water.pulses;
+		Water.pulses = Water.pulsesTaken;
+		Water.pulsesTaken = pulses;
+		glm_vec2_copy(Water.focus, Water.fineFocus);
+		pthread_mutex_unlock(&Water.simLock);
+
+		WaterPulse* taken = pulses->data;
+		for (int p = 0; p < pulses->count; p++) {
+			Water_stamp_pulse(taken[p].strength, taken[p].size, taken[p].cx, taken[p].cy);
+		}
+		pulses->count = 0;
+
+		Water_step_frame(frames * dt, Water_substeps(frames * dt));
+		Water_publish_frame();
+
+		pthread_mutex_lock(&Water.simLock);
+		pthread_cond_broadcast(&Water.frameReady);
+	}
+
+	pthread_mutex_unlock(&Water.simLock);
+	return NULL;
+}
+
+// Moves the simulation to its own thread. From here on the renderer only
+// posts pulses and frame requests, and reads the frames it publishes.
+void Water_start_async() {
+	int n = Water.sim_size;
+	int tileCount = Water.tilesX * Water.tilesX;
+
+	for (int f = 0; f < 3; f++) {
+		WaterFrame* frame = &Water.frames[f];
+		frame->heights = xmalloc(n * n * Water.cellBytes);
+		frame->normals = Water.cpuNormals ? xmalloc(n * n * sizeof(uint32_t)) : NULL;
+		frame->tileVersion = xmalloc(tileCount * sizeof(uint32_t));
+		memcpy(frame->heights, Water.u, n * n * Water.cellBytes);
+		if (Water.cpuNormals) {
+			memcpy(frame->normals, Water.normals, n * n * sizeof(uint32_t));
+		}
+		memset(frame->tileVersion, 0, tileCount * sizeof(uint32_t));
+		frame->activeTiles = Water.activeTiles;
+
+		int f = Water.fineSize;
+		frame->fine = f > 0 ? xmalloc(f * f * sizeof(float)) : NULL;
+		frame->fineNormals = f > 0 ? xmalloc(f * f * sizeof(uint32_t)) : NULL;
+		if (f > 0) {
+			memcpy(frame->fine, Water.fineU, f * f * sizeof(float));
+			memcpy(frame->fineNormals, Water.fineNormals, f * f * sizeof(uint32_t));
+		}
+		frame->fineX = Water.fineX;
+		frame->fineY = Water.fineY;
+	}
+	Water.frameBack = 0;
+	atomic_store(&Water.frameLatest, 1);
+	Water.frameFront = 2;
+	Water.frameReceived = false;
+
+	Water.tileVersion = xmalloc(tileCount * sizeof(uint32_t));
+	Water.uploadedVersion = xmalloc(tileCount * sizeof(uint32_t));
+	Water.frameDirty = xmalloc(tileCount);
+	memset(Water.tileVersion, 0, tileCount * sizeof(uint32_t));
+	memset(Water.uploadedVersion, 0, tileCount * sizeof(uint32_t));
+
+	Water.pulses = Vector_new(sizeof(WaterPulse));
+	Water.pulsesTaken = Vector_new(sizeof(WaterPulse));
+	Water.framesRequested = 0;
+	Water.simQuit = false;
+	glm_vec2_copy(Water.fineFocus, Water.focus);
+	pthread_mutex_init(&Water.simLock, NULL);
+	pthread_cond_init(&Water.simWake, NULL);
+	pthread_cond_init(&Water.frameReady, NULL);
+
+	Water.async = true;
+	if (pthread_create(&Water.simThread, NULL, Water_sim_thread, NULL) != 0) {
+		panic("Failed to create the water simulation thread\n");
+	}
+}
+
+// Joins the simulation thread. Pulses it had not taken yet go to the queue
+// for the next Water_step_sim.
+void Water_stop_async() {
+	pthread_mutex_lock(&Water.simLock);
+	Water.simQuit = true;
+	pthread_cond_signal(&Water.simWake);
+	pthread_mutex_unlock(&Water.simLock);
+	pthread_join(Water.simThread, NULL);
+	Water.async = false;
+	glm_vec2_copy(Water.focus, Water.fineFocus);
+
+	WaterPulse* pending = Water.pulses->data;
+	for (int p = 0; p < Water.pulses->count; p++) {
+		Water_stamp_pulse(pending[p].strength, pending[p].size, pending[p].cx, pending[p].cy);
+	}
+
+	for (int f = 0; f < 3; f++) {
+		xfree(Water.frames[f].heights);
+		xfree(Water.frames[f].normals);
+		xfree(Water.frames[f].tileVersion);
+		xfree(Water.frames[f].fine);
+		xfree(Water.frames[f].fineNormals);
+	}
+	xfree(Water.tileVersion);
+	xfree(Water.uploadedVersion);
+	xfree(Water.frameDirty);
+	Vector_delete(Water.pulses);
+	Vector_delete(Water.pulsesTaken);
+
+	pthread_mutex_destroy(&Water.simLock);
+	pthread_cond_destroy(&Water.simWake);
+	pthread_cond_destroy(&Water.frameReady);
+}
+
+// Centres the fine grid of a nested simulation on (x, z) from the next step.
+void Water_set_focus(float x, float z) {
+	if (!Water.async) {
+		glm_vec2_copy((vec2){x, z}, Water.fineFocus);
+		return;
+	}
+
+	pthread_mutex_lock(&Water.simLock);
+	glm_vec2_copy((vec2){x, z}, Water.focus);
+	pthread_mutex_unlock(&Water.simLock);
+}
+
+// Asks the simulation thread for one more frame's worth of steps.
+void Water_request_frame() {
+	pthread_mutex_lock(&Water.simLock);
+	Water.framesRequested++;
+	pthread_cond_signal(&Water.simWake);
+	pthread_mutex_unlock(&Water.simLock);
+}
+
+// Takes the newest published frame if there is one, and keeps the current
+// one otherwise. frameDirty gets the tiles that differ from the frame taken
+// last time. Only the very first call waits for the simulation.
+const WaterFrame* Water_acquire_frame() {
+	if (!Water.frameReceived) {
+		pthread_mutex_lock(&Water.simLock);
+		while (!(atomic_load(&Water.frameLatest) & WATER_FRAME_FRESH)) {
+			pthread_cond_wait(&Water.frameReady, &Water.simLock);
+		}
+		pthread_mutex_unlock(&Water.simLock);
+		Water.frameReceived = true;
+	}
+
+	if (atomic_load(&Water.frameLatest) & WATER_FRAME_FRESH) {
+		Water.frameFront = atomic_exchange(&Water.frameLatest, Water.frameFront) & ~WATER_FRAME_FRESH;
+	}
+
+	const WaterFrame* frame = &Water.frames[Water.frameFront];
+	for (int tile = 0; tile < Water.tilesX * Water.tilesX; tile++) {
+		Water.frameDirty[tile] = frame->tileVersion[tile] != Water.uploadedVersion[tile];
+		Water.uploadedVersion[tile] = frame->tileVersion[tile];
+	}
+
+	return frame;
+}
+
+// The frame the renderer shows. It stays as it is until the next
+// Water_update, so other threads can sample it until then even while the
+// simulation thread steps the next frame.
+const WaterFrame* Water_snapshot() {
+	if (Water.async) {
+		return &Water.frames[Water.frameFront];
+	}
+
+	Water.live.heights = Water.u;
+	Water.live.normals = Water.normals;
+	Water.live.activeTiles = Water.activeTiles;
+	Water.live.fine = Water.fineU;
+	Water.live.fineNormals = Water.fineNormals;
+	Water.live.fineX = Water.fineX;
+	Water.live.fineY = Water.fineY;
+	return &Water.live;
+}
+
+#define WATER_FINE_SAMPLE_BATCH 64
+
+// Interpolates the heights in snapshot at count world space positions
+// (x[i], z[i]), clamped to the pool. If normals is not NULL it also gets the
+// normals of the interpolated surface. Positions over the fine grid of a
+// nested simulation are sampled again from it, in batches.
+void Water_sample(const WaterFrame* snapshot, const float* x, const float* z, int count, float* heights, vec3* normals) {
+	if (Water.gpu) {
+		Water_sample_gpu(x, z, count, heights, normals);
+		return;
+	}
+
+	int n = Water.sim_size;
+	float spacing = Water.size / (n - 1);
+	if (Water.half) {
+		Water.kernel->sampleHalf(snapshot->heights, n, spacing, x, z, count, heights, normals);
+	}
+	else {
+		Water.kernel->sample(snapshot->heights, n, spacing, x, z, count, heights, normals);
+	}
+
+	if (Water.fineSize == 0) {
+		return;
+	}
+
+	int f = Water.fineSize;
+	float half = Water.fineCells * spacing / 2;
+	float cx = -Water.size / 2 + snapshot->fineX * spacing + half;
+	float cz = -Water.size / 2 + snapshot->fineY * spacing + half;
+
+	float fx[WATER_FINE_SAMPLE_BATCH];
+	float fz[WATER_FINE_SAMPLE_BATCH];
+	float fineHeights[WATER_FINE_SAMPLE_BATCH];
+	vec3 fineNormals[WATER_FINE_SAMPLE_BATCH];
+	int index[WATER_FINE_SAMPLE_BATCH];
+	int batch = 0;
+	for (int p = 0; p < count; p++) {
+		if (fabsf(x[p] - cx) < half && fabsf(z[p] - cz) < half) {
+			fx[batch] = x[p] - cx;
+			fz[batch] = z[p] - cz;
+			index[batch++] = p;
+		}
+		if (batch == WATER_FINE_SAMPLE_BATCH || (p == count - 1 && batch > 0)) {
+			Water.kernel->sample(snapshot->fine, f, spacing / Water.fineRatio, fx, fz, batch, fineHeights, normals != NULL ? fineNormals : NULL);
+			for (int b = 0; b < batch; b++) {
+				heights[index[b]] = fineHeights[b];
+				if (normals != NULL) {
+					glm_vec3_copy(fineNormals[b], normals[index[b]]);
+				}
+			}
+			batch = 0;
+		}
+	}
+}
+
+// Uploads the dirty tiles of one per-cell array. A tile row that is dirty
+// all the way across is contiguous and goes up in one call.
+void Water_upload_tiles(GLuint vbo, const void* data, size_t cellSize, const uint8_t* dirty) {
+	int n = Water.sim_size;
+	int t = Water.tilesX;
+
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+
+	for (int ty = 0; ty < t; ty++) {
+		int first = t;
+		int last = -1;
+		for (int tx = 0; tx < t; tx++) {
+			if (dirty[ty * t + tx]) {
+				first = tx < first ? tx : first;
+				last = tx;
+			}
+		}
+		if (last < 0) {
+			continue;
+		}
+
+		int i0 = ty * WATER_TILE_SIZE;
+		int i1 = (ty + 1) * WATER_TILE_SIZE < n ? (ty + 1) * WATER_TILE_SIZE : n;
+		int j0 = first * WATER_TILE_SIZE;
+		int j1 = (last + 1) * WATER_TILE_SIZE < n ? (last + 1) * WATER_TILE_SIZE : n;
+
+		if (j0 == 0 && j1 == n) {
+			glBufferSubData(GL_ARRAY_BUFFER, i0 * n * cellSize, (i1 - i0) * n * cellSize, (const uint8_t*)data + i0 * n * cellSize);
+			continue;
+		}
+
+		for (int i = i0; i < i1; i++) {
+			size_t offset = (i * n + j0) * cellSize;
+			glBufferSubData(GL_ARRAY_BUFFER, offset, (j1 - j0) * cellSize, (const uint8_t*)data + offset);
+		}
+	}
+}
+
+// Streams the dirty tiles of the height texture through the pixel buffer.
+// Each dirty tile row is copied to the same offset in the buffer that it has
+// in heights, so one glTexSubImage2D can read it with a row length of n.
+void Water_upload_texture(const void* heights, const uint8_t* dirty) {
+	int n = Water.sim_size;
+	int t = Water.tilesX;
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, Water.pbo);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, n * n * Water.cellBytes, NULL, GL_STREAM_DRAW);
+	void* mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, n * n * Water.cellBytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (mapped == NULL) {
+		panic("Failed to map the water pixel buffer\n");
+	}
+
+	int spans[4 * t];
+	int count = 0;
+	for (int ty = 0; ty < t; ty++) {
+		int first = t;
+		int last = -1;
+		for (int tx = 0; tx < t; tx++) {
+			if (dirty[ty * t + tx]) {
+				first = tx < first ? tx : first;
+				last = tx;
+			}
+		}
+		if (last < 0) {
+			continue;
+		}
+
+		int i0 = ty * WATER_TILE_SIZE;
+		int i1 = (ty + 1) * WATER_TILE_SIZE < n ? (ty + 1) * WATER_TILE_SIZE : n;
+		int j0 = first * WATER_TILE_SIZE;
+		int j1 = (last + 1) * WATER_TILE_SIZE < n ? (last + 1) * WATER_TILE_SIZE : n;
+
+		for (int i = i0; i < i1; i++) {
+			memcpy(Water_cells(mapped, i * n + j0), Water_cells(heights, i * n + j0), (j1 - j0) * Water.cellBytes);
+		}
+
+		spans[4 * count + 0] = i0;
+		spans[4 * count + 1] = i1;
+		spans[4 * count + 2] = j0;
+		spans[4 * count + 3] = j1;
+		count++;
+	}
+
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, Water.heightTexture);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, n);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, Water.cellBytes);
+
+	for (int s = 0; s < count; s++) {
+		int i0 = spans[4 * s + 0];
+		int i1 = spans[4 * s + 1];
+		int j0 = spans[4 * s + 2];
+		int j1 = spans[4 * s + 3];
+		glTexSubImage2D(GL_TEXTURE_2D, 0, j0, i0, j1 - j0, i1 - i0, GL_RED, Water.half ? GL_HALF_FLOAT : GL_FLOAT, Water_cells(NULL, i0 * n + j0));
+	}
+
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	if (Settings.waterClipmap > 0 && count > 0) {
+		glGenerateMipmap(GL_TEXTURE_2D);
+	}
+
+	glActiveTexture(GL_TEXTURE0);
+}
+
+void Water_update_bounds(const void* heights, const uint8_t* dirty) {
+	int n = Water.sim_size;
+	int t = Water.tilesX;
+
+	for (int ty = 0; ty < t; ty++) {
+		for (int tx = 0; tx < t; tx++) {
+			if (!dirty[ty * t + tx]) {
+				continue;
+			}
+
+			int i1 = (ty + 1) * WATER_TILE_SIZE < n ? (ty + 1) * WATER_TILE_SIZE : n;
+			int j1 = (tx + 1) * WATER_TILE_SIZE < n ? (tx + 1) * WATER_TILE_SIZE : n;
+
+			float lo = INFINITY;
+			float hi = -INFINITY;
+			for (int i = ty * WATER_TILE_SIZE; i < i1; i++) {
+				for (int j = tx * WATER_TILE_SIZE; j < j1; j++) {
+					float u = Water_height(heights, i * n + j);
+					lo = u < lo ? u : lo;
+					hi = u > hi ? u : hi;
+				}
+			}
+
+			Water.tileMin[ty * t + tx] = lo;
+			Water.tileMax[ty * t + tx] = hi;
+		}
+	}
+}
+
+// Sends the dirty tiles of heights and normals to the GPU and clears dirty.
+void Water_upload(const void* heights, const uint32_t* normals, uint8_t* dirty) {
+	if (Settings.waterClipmap == 0) {
+		Water_update_bounds(heights, dirty);
+	}
+
+	if (Settings.waterHeightTexture) {
+		Water_upload_texture(heights, dirty);
+	}
+	else {
+		Water_upload_tiles(Water.vbo_u, heights, Water.cellBytes, dirty);
+		Water_upload_tiles(Water.vbo_normal, normals, sizeof(uint32_t), dirty);
+	}
+
+	memset(dirty, 0, Water.tilesX * Water.tilesX);
+}
+
+// The GPU simulation steps the water in compute shaders, on buffers that
+// water.vs reads as vertex attributes, so the heights never leave the GPU to
+// be drawn. Each pulse is a small dispatch over its stamp. The heights never
+// come back to the CPU at all: it gets the patch bounds and the samples it
+// asked for, reduced on the GPU, a frame or so late, and never waits for
+// them.
+#define WATER_GPU_GROUP 16
+#define WATER_GPU_PULSE_GROUP 8
+
+// Makes room in the position and result buffers for count samples.
+void Water_reserve_gpu_samples(int count) {
+	if (count <= Water.gpuSampleCapacity) {
+		return;
+	}
+	int capacity = Water.gpuSampleCapacity * 2 > count ? Water.gpuSampleCapacity * 2 : count;
+	size_t results = (size_t)2 * Water.tilesX * Water.tilesX + 4 * capacity;
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, Water.gpuPositions);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, 2 * capacity * sizeof(float), NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, Water.gpuResults);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, results * sizeof(float), NULL, GL_STREAM_READ);
+	Water.gpuResultData = xrealloc(Water.gpuResultData, results * sizeof(float));
+	Water.gpuSampleCapacity = capacity;
+}
+
+void Water_init_gpu() {
+	int n = Water.sim_size;
+	size_t bytes = (size_t)n * n * sizeof(float);
+
+	Water.stepProg = loadComputeProg("data/shaders/water_step.comp");
+	Water.normalsProg = loadComputeProg("data/shaders/water_normals.comp");
+	Water.pulseProg = loadComputeProg("data/shaders/water_pulse.comp");
+	Water.boundsProg = loadComputeProg("data/shaders/water_bounds.comp");
+	Water.sampleProg = loadComputeProg("data/shaders/water_sample.comp");
+
+	GLuint progs[5] = {Water.stepProg, Water.normalsProg, Water.pulseProg, Water.boundsProg, Water.sampleProg};
+	for (int p = 0; p < 5; p++) {
+		glUseProgram(progs[p]);
+		glUniform1i(glGetUniformLocation(progs[p], "u_n"), n);
+		glUniform1i(glGetUniformLocation(progs[p], "u_periodic"), Water.periodic);
+	}
+	glUseProgram(Water.pulseProg);
+	glUniform1f(glGetUniformLocation(Water.pulseProg, "u_spacing"), Water.size / (n - 1));
+	glUseProgram(Water.sampleProg);
+	glUniform1f(glGetUniformLocation(Water.sampleProg, "u_spacing"), Water.size / (n - 1));
+
+	Water.stepKLoc = glGetUniformLocation(Water.stepProg, "u_k");
+	Water.stepKeepLoc = glGetUniformLocation(Water.stepProg, "u_keep");
+	Water.pulseCornerLoc = glGetUniformLocation(Water.pulseProg, "u_corner");
+	Water.pulseRadiusLoc = glGetUniformLocation(Water.pulseProg, "u_radius");
+	Water.pulseOffsetLoc = glGetUniformLocation(Water.pulseProg, "u_offset");
+	Water.pulseSizeLoc = glGetUniformLocation(Water.pulseProg, "u_size");
+	Water.pulseStrengthLoc = glGetUniformLocation(Water.pulseProg, "u_strength");
+	Water.sampleCountLoc = glGetUniformLocation(Water.sampleProg, "u_count");
+	Water.sampleOffsetLoc = glGetUniformLocation(Water.sampleProg, "u_offset");
+
+	glGenBuffers(2, Water.gpuU);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, Water.gpuU[0]);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, bytes, Water.u, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, Water.gpuU[1]);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, bytes, Water.uPrev, GL_DYNAMIC_COPY);
+	Water.gpuCurrent = 0;
+
+	glGenBuffers(1, &Water.vbo_normal);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, Water.vbo_normal);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, (size_t)n * n * sizeof(uint32_t), Water.normals, GL_DYNAMIC_COPY);
+
+	glGenBuffers(1, &Water.gpuPositions);
+	glGenBuffers(1, &Water.gpuResults);
+	Water.gpuSampleCapacity = 0;
+	Water.gpuResultData = NULL;
+	Water_reserve_gpu_samples(64);
+	Water.gpuFence = NULL;
+
+	Water.gpuPulses = Vector_new(sizeof(WaterPulse));
+	Water.gpuSampleX = Vector_new(sizeof(float));
+	Water.gpuSampleZ = Vector_new(sizeof(float));
+	Water.gpuSampleCalls = Vector_new(sizeof(int));
+	Water.gpuFlightCalls = Vector_new(sizeof(int));
+	Water.gpuResultCalls = Vector_new(sizeof(int));
+	Water.gpuFlightSamples = 0;
+	Water.gpuResultSamples = 0;
+	Water.gpu = true;
+}
+
+void Water_delete_gpu() {
+	glDeleteProgram(Water.stepProg);
+	glDeleteProgram(Water.normalsProg);
+	glDeleteProgram(Water.pulseProg);
+	glDeleteProgram(Water.boundsProg);
+	glDeleteProgram(Water.sampleProg);
+	glDeleteBuffers(2, Water.gpuU);
+	glDeleteBuffers(1, &Water.vbo_normal);
+	glDeleteBuffers(1, &Water.gpuPositions);
+	glDeleteBuffers(1, &Water.gpuResults);
+	if (Water.gpuFence != NULL) {
+		glDeleteSync(Water.gpuFence);
+		Water.gpuFence = NULL;
+	}
+	Vector_delete(Water.gpuPulses);
+	Vector_delete(Water.gpuSampleX);
+	Vector_delete(Water.gpuSampleZ);
+	Vector_delete(Water.gpuSampleCalls);
+	Vector_delete(Water.gpuFlightCalls);
+	Vector_delete(Water.gpuResultCalls);
+	xfree(Water.gpuResultData);
+	Water.gpu = false;
+}
+
+// Advances the water on the GPU like Water_step_frame, with every cell
+// awake. The pulses are centred on the same sub-cells as Water_stamp_pulse.
+void Water_step_gpu(float frameDt, int substeps) {
+	int n = Water.sim_size;
+	float dx = Water.size / n;
+	float h = frameDt / substeps;
+	float spacing = Water.size / (n - 1);
+	int groups = (n + WATER_GPU_GROUP - 1) / WATER_GPU_GROUP;
+	Water.substeps = substeps;
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, Water.gpuU[Water.gpuCurrent]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, Water.gpuU[1 - Water.gpuCurrent]);
+
+	glUseProgram(Water.pulseProg);
+	WaterPulse* pulses = Water.gpuPulses->data;
+	for (int p = 0; p < Water.gpuPulses->count; p++) {
+		int bx, by, qx, qy;
+		Water_split_cell((pulses[p].cx + Water.size / 2) / spacing, &bx, &qx);
+		Water_split_cell((pulses[p].cy + Water.size / 2) / spacing, &by, &qy);
+		int radius = Water_stamp_radius(pulses[p].size, spacing, n);
+
+		glUniform2i(Water.pulseCornerLoc, wrapi(bx - radius, Water_period()), wrapi(by - radius, Water_period()));
+		glUniform1i(Water.pulseRadiusLoc, radius);
+		glUniform2f(Water.pulseOffsetLoc, qx / (float)WATER_STAMP_SUBCELLS, qy / (float)WATER_STAMP_SUBCELLS);
+		glUniform1f(Water.pulseSizeLoc, pulses[p].size);
+		glUniform1f(Water.pulseStrengthLoc, pulses[p].strength);
+
+		int pulseGroups = (2 * radius + WATER_GPU_PULSE_GROUP) / WATER_GPU_PULSE_GROUP;
+		glDispatchCompute(pulseGroups, pulseGroups, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	}
+	Water.gpuPulses->count = 0;
+
+	glUseProgram(Water.stepProg);
+	glUniform1f(Water.stepKLoc, Water.c * Water.c * h * h / (dx * dx));
+	glUniform1f(Water.stepKeepLoc, clampf(1 - Settings.waterDamping * h, 0, 1));
+	for (int s = 0; s < substeps; s++) {
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, Water.gpuU[Water.gpuCurrent]);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, Water.gpuU[1 - Water.gpuCurrent]);
+		glDispatchCompute(groups, groups, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+		Water.gpuCurrent = 1 - Water.gpuCurrent;
+	}
+
+	glUseProgram(Water.normalsProg);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, Water.gpuU[Water.gpuCurrent]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, Water.vbo_normal);
+	glDispatchCompute(groups, groups, 1);
+	glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+// Takes the tile bounds and samples of the last dispatch if they have
+// arrived, and dispatches the next ones for the current heights and the
+// positions queued since. Never waits for the GPU: while a dispatch is still
+// in flight the frame's positions are dropped and the last results stand.
+void Water_read_gpu() {
+	int t = Water.tilesX;
+
+	if (Water.gpuFence != NULL) {
+		if (glClientWaitSync(Water.gpuFence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+			Water.gpuSampleX->count = 0;
+			Water.gpuSampleZ->count = 0;
+			Water.gpuSampleCalls->count = 0;
+			return;
+		}
+		glDeleteSync(Water.gpuFence);
+		Water.gpuFence = NULL;
+
+		size_t count = (size_t)2 * t * t + 4 * Water.gpuFlightSamples;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, Water.gpuResults);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, count * sizeof(float), Water.gpuResultData);
+		memcpy(Water.tileMin, Water.gpuResultData, t * t * sizeof(float));
+		memcpy(Water.tileMax, Water.gpuResultData + t * t, t * t * sizeof(float));
+
+		Vector* swap = Water.gpuResultCalls;
+		Water.gpuResultCalls = Water.gpuFlightCalls;
+		Water.gpuFlightCalls = swap;
+		Water.gpuResultSamples = Water.gpuFlightSamples;
+	}
+
+	int samples = Water.gpuSampleX->count;
+	Water_reserve_gpu_samples(samples);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, Water.gpuU[Water.gpuCurrent]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, Water.gpuResults);
+	glUseProgram(Water.boundsProg);
+	glDispatchCompute(t, t, 1);
+
+	if (samples > 0) {
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, Water.gpuPositions);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, samples * sizeof(float), Water.gpuSampleX->data);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, samples * sizeof(float), samples * sizeof(float), Water.gpuSampleZ->data);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, Water.gpuPositions);
+
+		glUseProgram(Water.sampleProg);
+		glUniform1i(Water.sampleCountLoc, samples);
+		glUniform1i(Water.sampleOffsetLoc, 2 * t * t);
+		glDispatchCompute((samples + 63) / 64, 1, 1);
+	}
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	Water.gpuFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glFlush();
+
+	Vector* swap = Water.gpuFlightCalls;
+	Water.gpuFlightCalls = Water.gpuSampleCalls;
+	Water.gpuSampleCalls = swap;
+	Water.gpuSampleCalls->count = 0;
+	Water.gpuFlightSamples = samples;
+	Water.gpuSampleX->count = 0;
+	Water.gpuSampleZ->count = 0;
+}
+
+// Water_sample on the GPU, where the heights can't be read straight away.
+// The positions are queued for the next dispatch in Water_read_gpu, and the
+// call gets what the call with the same place in its frame got from the last
+// dispatch to arrive: the water of a frame or two ago, under the positions
+// of then. Until there is one, or if that call sampled a different number of
+// positions, the water is flat.
+void Water_sample_gpu(const float* x, const float* z, int count, float* heights, vec3* normals) {
+	int call = Water.gpuSampleCalls->count;
+	Vector_add(Water.gpuSampleCalls, &count);
+	for (int p = 0; p < count; p++) {
+		float position[2] = {x[p], z[p]};
+		Vector_add(Water.gpuSampleX, &position[0]);
+		Vector_add(Water.gpuSampleZ, &position[1]);
+	}
+
+	const int* calls = Water.gpuResultCalls->data;
+	int offset = 0;
+	for (int c = 0; c < call && c < Water.gpuResultCalls->count; c++) {
+		offset += calls[c];
+	}
+
+	if (call >= Water.gpuResultCalls->count || calls[call] != count) {
+		for (int p = 0; p < count; p++) {
+			heights[p] = 0;
+			if (normals != NULL) {
+				glm_vec3_copy((vec3){0, 1, 0}, normals[p]);
+			}
+		}
+		return;
+	}
+
+	int t = Water.tilesX;
+	const float* results = Water.gpuResultData + 2 * t * t;
+	memcpy(heights, results + offset, count * sizeof(float));
+	if (normals != NULL) {
+		memcpy(normals, results + Water.gpuResultSamples + 3 * offset, count * sizeof(vec3));
+	}
+}
+
+struct {
+	GLuint shader;
+	GLuint vao;
+	GLuint vbo;
+	GLuint texture;
+} Sky;
+
+// Draws the patches of the copy of the grid moved by (ox, oz) that are in the
+// frustum, and returns how many there were.
+int Water_draw_patch_copy(vec4 planes[6], float ox, float oz) {
+	int n = Water.sim_size;
+	int t = Water.tilesX;
+	int p = WATER_PATCH_SIZE;
+	float cell = Water.size / (n - 1);
+
+	int count = 0;
+	for (int py = 0; py < Water.patchesX; py++) {
+		for (int px = 0; px < Water.patchesX; px++) {
+			int i0 = py * p;
+			int j0 = px * p;
+			int i1 = i0 + p < n - 1 ? i0 + p : n - 1;
+			int j1 = j0 + p < n - 1 ? j0 + p : n - 1;
+
+			// The last vertex of a patch can be in the next tile.
+			float lo = INFINITY;
+			float hi = -INFINITY;
+			for (int ty = i0 / WATER_TILE_SIZE; ty <= i1 / WATER_TILE_SIZE && ty < t; ty++) {
+				for (int tx = j0 / WATER_TILE_SIZE; tx <= j1 / WATER_TILE_SIZE && tx < t; tx++) {
+					lo = fminf(lo, Water.tileMin[ty * t + tx]);
+					hi = fmaxf(hi, Water.tileMax[ty * t + tx]);
+				}
+			}
+
+			vec3 box[2] = {
+				{ox - Water.size / 2 + j0 * cell, lo - Ocean.peak, oz - Water.size / 2 + i0 * cell},
+				{ox - Water.size / 2 + j1 * cell, hi + Ocean.peak, oz - Water.size / 2 + i1 * cell},
+			};
+			if (!glm_aabb_frustum(box, planes)) {
+				continue;
+			}
+
+			int variant = (px == Water.patchesX - 1) + 2 * (py == Water.patchesX - 1);
+			Water.patchCounts[count] = Water.patchIndexCount[variant];
+			Water.patchOffsets[count] = (void*)(Water.patchIndexOffset[variant] * sizeof(uint16_t));
+			Water.patchBaseVertex[count] = i0 * n + j0;
+			count++;
+		}
+	}
+
+	glUniform2f(Water.offsetLoc, ox, oz);
+	glMultiDrawElementsBaseVertex(GL_TRIANGLE_STRIP, Water.patchCounts, GL_UNSIGNED_SHORT, (const void* const*)Water.patchOffsets, count, Water.patchBaseVertex);
+	return count;
+}
+
+void Water_draw_patches(mat4 mvp) {
+	vec4 planes[6];
+	glm_frustum_planes(mvp, planes);
+
+	glEnable(GL_PRIMITIVE_RESTART);
+	glPrimitiveRestartIndex(WATER_PATCH_RESTART);
+
+	if (Water.periodic && Ocean.size == 0) {
+		// A periodic grid tiles the plane, so copies of it are drawn around
+		// the camera out to the far plane, unless the ocean is drawn there.
+		// GL 3.3 has no instanced multi-draw, so each copy gets its own
+		// offset and culled multi-draw.
+		int r = ceilf(farPlane / Water.size);
+		int cx = floorf(Blahaj.camPos[0] / Water.size + 0.5f);
+		int cz = floorf(Blahaj.camPos[2] / Water.size + 0.5f);
+
+		Water.copies = (2 * r + 1) * (2 * r + 1);
+		Water.visiblePatches = 0;
+		for (int z = cz - r; z <= cz + r; z++) {
+			for (int x = cx - r; x <= cx + r; x++) {
+				Water.visiblePatches += Water_draw_patch_copy(planes, x * Water.size, z * Water.size);
+			}
+		}
+	}
+	else {
+		Water.copies = 1;
+		Water.visiblePatches = Water_draw_patch_copy(planes, 0, 0);
+	}
+
+	glDisable(GL_PRIMITIVE_RESTART);
+}
+
+void Water_draw_clipmap() {
+	int m = Settings.waterClipmap;
+	float half = Water.size / 2;
+	float cell = Water.size / (Water.sim_size - 1);
+
+	// Positions are counted in finest-level cells from the corner of the pool.
+	int cx = floorf((Blahaj.camPos[0] + half) / Water.clipmapSpacing);
+	int cz = floorf((Blahaj.camPos[2] + half) / Water.clipmapSpacing);
+
+	glUniform2f(Water.cameraLoc, Blahaj.camPos[0], Blahaj.camPos[2]);
+
+	int innerX = 0;
+	int innerZ = 0;
+	for (int level = 0; level < Settings.waterClipmapLevels; level++) {
+		int unit = 1 << level;
+		int ox = (cx - wrapi(cx, 2 * unit)) - m / 2 * unit;
+		int oz = (cz - wrapi(cz, 2 * unit)) - m / 2 * unit;
+
+		glUniform2f(Water.originLoc, -half + ox * Water.clipmapSpacing, -half + oz * Water.clipmapSpacing);
+		glUniform1f(Water.spacingLoc, unit * Water.clipmapSpacing);
+		glUniform1f(Water.lodLoc, log2f(unit * Water.clipmapSpacing / cell));
+
+		if (level == 0) {
+			glDrawElements(GL_TRIANGLES, m * m * 6, GL_UNSIGNED_SHORT, NULL);
+		}
+		else {
+			int variant = ((innerX - ox) / unit - m / 4) + 2 * ((innerZ - oz) / unit - m / 4);
+			size_t offset = (m * m + variant * Water.clipmapRingCells) * 6 * sizeof(uint16_t);
+			glDrawElements(GL_TRIANGLES, Water.clipmapRingCells * 6, GL_UNSIGNED_SHORT, (void*)offset);
+		}
+
+		innerX = ox;
+		innerZ = oz;
+	}
+}
+
+// Draws the fine grid of a nested simulation, which the coarse grid leaves a
+// hole for.
+void Water_draw_fine(const WaterFrame* frame) {
+	int f = Water.fineSize;
+	float cell = Water.size / (Water.sim_size - 1);
+
+	glBindVertexArray(Water.fineVao);
+	glBindBuffer(GL_ARRAY_BUFFER, Water.fineVboU);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, f * f * sizeof(float), frame->fine);
+	glBindBuffer(GL_ARRAY_BUFFER, Water.fineVboNormal);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, f * f * sizeof(uint32_t), frame->fineNormals);
+
+	glEnable(GL_PRIMITIVE_RESTART);
+	glPrimitiveRestartIndex(WATER_PATCH_RESTART);
+	glUniform4f(Water.holeLoc, 0, 0, 0, 0);
+	glUniform2f(Water.offsetLoc, -Water.size / 2 + frame->fineX * cell, -Water.size / 2 + frame->fineY * cell);
+	// The fine normals hold slopes per fine cell, and the shader wants them
+	// per coarse cell like the rest of the water and the ocean.
+	glUniform1f(Water.slopeScaleLoc, Water.fineRatio);
+	glDrawElements(GL_TRIANGLE_STRIP, Water.fineIndexCount, GL_UNSIGNED_SHORT, NULL);
+	glUniform1f(Water.slopeScaleLoc, 1);
+	glDisable(GL_PRIMITIVE_RESTART);
+}
+
+void Water_update() {
+	glBindVertexArray(Water.vao);
+
+	// The simulation thread steps this frame while the newest frame it has
+	// finished is drawn.
+	const WaterFrame* frame;
+	if (Water.fineSize > 0) {
+		Water_set_focus(Blahaj.pos[0], Blahaj.pos[2]);
+	}
+	if (Water.gpu) {
+		Water_step_gpu(dt, Water_substeps(dt));
+		Water_read_gpu();
+		frame = Water_snapshot();
+
+		glBindBuffer(GL_ARRAY_BUFFER, Water.gpuU[Water.gpuCurrent]);
+		glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 0, 0);
+	}
+	else if (Water.async) {
+		Water_request_frame();
+		frame = Water_acquire_frame();
+		Water_upload(frame->heights, frame->normals, Water.frameDirty);
+	}
+	else {
+		Water_step_sim();
+		frame = Water_snapshot();
+		Water_upload(frame->heights, frame->normals, Water.tileDirty);
+	}
+
+	glUseProgram(Water.shader);
+
+	if (Settings.waterHeightTexture) {
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, Water.heightTexture);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	mat4 modelMat;
+	glm_mat4_identity(modelMat);
+
+	mat4 mvp;
+	glm_mat4_mul(projMat, viewMat, mvp);
+	glm_mat4_mul(mvp, modelMat, mvp);
+
+	glUniformMatrix4fv(mat_loc2, 1, GL_FALSE, (float*)mvp);
+	glUniformMatrix4fv(view_loc2, 1, GL_FALSE, (float*)viewMat);
+
+	if (Water.fineSize > 0) {
+		float cell = Water.size / (Water.sim_size - 1);
+		float half = Water.fineCells * cell / 2;
+		glUniform4f(Water.holeLoc, -Water.size / 2 + frame->fineX * cell + half, -Water.size / 2 + frame->fineY * cell + half, half, half);
+	}
+
+	if (Settings.waterClipmap > 0) {
+		Water_draw_clipmap();
+	}
+	else {
+		Water_draw_patches(mvp);
+	}
+
+	if (Water.fineSize > 0) {
+		Water_draw_fine(frame);
+	}
+
+	glBindVertexArray(0);
+}
+
+// A sample of the standard normal distribution, by Box-Muller.
+float Ocean_gaussian() {
+	float u = fmaxf(float_rand(0, 1), 1e-7f);
+	return sqrtf(-2 * logf(u)) * cosf(2 * PI * float_rand(0, 1));
+}
+
+// The wave number along one axis of frequency space index a.
+static inline float Ocean_wave_number(int a, int n) {
+	return 2 * PI * (a < n / 2 ? a : a - n) / OCEAN_LENGTH;
+}
+
+// Sets up the ocean without a GL context. The amplitudes h0(k) are drawn from
+// the Phillips spectrum for a wind blowing along (1, 0.3), with waves much
+// shorter than a cell suppressed, then scaled to OCEAN_RMS_HEIGHT. Each wave
+// travels as h(k, t) = h0(k) e^(i w t) + conj(h0(-k)) e^(-i w t), with the
+// deep water dispersion w = sqrt(g |k|), which keeps the heights real.
+void Ocean_init_sim(int size) {
+	int n = size;
+	size_t cells = (size_t)n * n;
+	Ocean.size = n;
+	Ocean.kernel = Water_select_kernel(Settings.waterKernel);
+	Ocean.workers = WorkerPool_new(Settings.waterThreads > 0 ? Settings.waterThreads : cpu_count());
+
+	for (int i = 0; i < 4; i++) {
+		Ocean.coeffs[i] = xmalloc(cells * sizeof(float));
+	}
+	Ocean.phaseRe = xmalloc(cells * sizeof(float));
+	Ocean.phaseIm = xmalloc(cells * sizeof(float));
+	Ocean.stepRe = xmalloc(cells * sizeof(float));
+	Ocean.stepIm = xmalloc(cells * sizeof(float));
+	for (int b = 0; b < 2; b++) {
+		Ocean.re[b] = xmalloc(cells * sizeof(float));
+		Ocean.im[b] = xmalloc(cells * sizeof(float));
+	}
+	Ocean.peaks = xmalloc(Ocean.workers->count * sizeof(float));
+	Ocean.zeros = xmalloc(n * sizeof(float));
+	memset(Ocean.zeros, 0, n * sizeof(float));
+
+	Ocean.twiddles = xmalloc(2 * n * sizeof(float));
+	for (int k = 0; k < n; k++) {
+		Ocean.twiddles[2 * k + 0] = cos(2 * M_PI * k / n);
+		Ocean.twiddles[2 * k + 1] = sin(2 * M_PI * k / n);
+	}
+
+	float windX = 1 / sqrtf(1.09f);
+	float windZ = 0.3f / sqrtf(1.09f);
+	float largest = OCEAN_WIND_SPEED * OCEAN_WIND_SPEED / OCEAN_GRAVITY;
+	float smallest = 0.5f * OCEAN_LENGTH / n;
+
+	float* h0Re = xmalloc(cells * sizeof(float));
+	float* h0Im = xmalloc(cells * sizeof(float));
+	double power = 0;
+	for (int a = 0; a < n; a++) {
+		for (int b = 0; b < n; b++) {
+			float kx = Ocean_wave_number(a, n);
+			float kz = Ocean_wave_number(b, n);
+			float k2 = kx * kx + kz * kz;
+			float amplitude = 0;
+			if (k2 > 0) {
+				float along = (kx * windX + kz * windZ) / sqrtf(k2);
+				float phillips = expf(-1 / (k2 * largest * largest)) / (k2 * k2) * along * along * expf(-k2 * smallest * smallest);
+				amplitude = sqrtf(phillips / 2);
+			}
+
+			size_t c = (size_t)a * n + b;
+			h0Re[c] = amplitude * Ocean_gaussian();
+			h0Im[c] = amplitude * Ocean_gaussian();
+			power += 2.0 * (h0Re[c] * h0Re[c] + h0Im[c] * h0Im[c]);
+
+			float w = sqrtf(OCEAN_GRAVITY * sqrtf(k2));
+			Ocean.stepRe[c] = cosf(w * dt);
+			Ocean.stepIm[c] = sinf(w * dt);
+			Ocean.phaseRe[c] = 1;
+			Ocean.phaseIm[c] = 0;
+		}
+	}
+
+	// By Parseval, the mean square height is the sum of |h(k, t)|^2, which
+	// averages to |h0(k)|^2 + |h0(-k)|^2.
+	float scale = power > 0 ? OCEAN_RMS_HEIGHT / sqrt(power) : 0;
+	for (int a = 0; a < n; a++) {
+		for (int b = 0; b < n; b++) {
+			size_t c = (size_t)a * n + b;
+			size_t m = (size_t)((n - a) % n) * n + (n - b) % n;
+			float hr = h0Re[c] * scale;
+			float hi = h0Im[c] * scale;
+			float mr = h0Re[m] * scale;
+			float mi = -h0Im[m] * scale;
+
+			Ocean.coeffs[0][c] = hr + mr;
+			Ocean.coeffs[1][c] = mi - hi;
+			Ocean.coeffs[2][c] = hr - mr;
+			Ocean.coeffs[3][c] = hi + mi;
+		}
+	}
+	xfree(h0Re);
+	xfree(h0Im);
+
+	Ocean.result = 0;
+	Ocean.heights = NULL;
+	Ocean.peak = 0;
+}
+
+void Ocean_delete_sim() {
+	WorkerPool_delete(Ocean.workers);
+
+	for (int i = 0; i < 4; i++) {
+		xfree(Ocean.coeffs[i]);
+	}
+	xfree(Ocean.phaseRe);
+	xfree(Ocean.phaseIm);
+	xfree(Ocean.stepRe);
+	xfree(Ocean.stepIm);
+	for (int b = 0; b < 2; b++) {
+		xfree(Ocean.re[b]);
+		xfree(Ocean.im[b]);
+	}
+	xfree(Ocean.peaks);
+	xfree(Ocean.zeros);
+	xfree(Ocean.twiddles);
+	Ocean.size = 0;
+}
+
+// Runs the inverse FFT down the columns [j0, j1) of buffer src, and returns
+// the buffer the result ends up in. This is Stockham's autosort FFT, which
+// needs no bit reversal: radix-4 passes while they fit, then one radix-2
+// pass when the size is an odd power of two. Every butterfly works on whole
+// rows of columns, which is what the kernels vectorise over.
+int Ocean_fft_columns(int src, int j0, int j1) {
+	int n = Ocean.size;
+
+	for (int len = n, s = 1; len > 1; ) {
+		int radix = len % 4 == 0 ? 4 : 2;
+		int m = len / radix;
+		int dst = 1 - src;
+
+		for (int p = 0; p < m; p++) {
+			int t = p * (n / len);
+			float w[6];
+			for (int r = 1; r < radix; r++) {
+				w[2 * (r - 1) + 0] = Ocean.twiddles[2 * (r * t) + 0];
+				w[2 * (r - 1) + 1] = Ocean.twiddles[2 * (r * t) + 1];
+			}
+
+			for (int q = 0; q < s && j0 < j1; q++) {
+				const float* x[8];
+				float* y[8];
+				for (int r = 0; r < radix; r++) {
+					size_t in = (size_t)(q + s * (p + r * m)) * n;
+					size_t out = (size_t)(q + s * (radix * p + r)) * n;
+					x[2 * r + 0] = Ocean.re[src] + in;
+					x[2 * r + 1] = Ocean.im[src] + in;
+					y[2 * r + 0] = Ocean.re[dst] + out;
+					y[2 * r + 1] = Ocean.im[dst] + out;
+				}
+
+				if (radix == 4) {
+					Ocean.kernel->fft4(y, x, w, j0, j1);
+				}
+				else {
+					Ocean.kernel->fft2(y, x, w, j0, j1);
+				}
+			}
+		}
+
+		src = dst;
+		len = m;
+		s *= radix;
+	}
+
+	return src;
+}
+
+// Transposes the rows [r0, r1) of buffer dst from buffer src, 16 x 16 cells
+// at a time so the columns read stay in cache.
+void Ocean_transpose(int src, int dst, int r0, int r1) {
+	int n = Ocean.size;
+
+	for (int rb = r0; rb < r1; rb += 16) {
+		int re = rb + 16 < r1 ? rb + 16 : r1;
+		for (int cb = 0; cb < n; cb += 16) {
+			for (int r = rb; r < re; r++) {
+				for (int c = cb; c < cb + 16; c++) {
+					Ocean.re[dst][(size_t)r * n + c] = Ocean.re[src][(size_t)c * n + r];
+					Ocean.im[dst][(size_t)r * n + c] = Ocean.im[src][(size_t)c * n + r];
+				}
+			}
+		}
+	}
+}
+
+// The 2D inverse FFT is a column pass, a transpose and another column pass.
+// That leaves the result transposed, so the spectrum is kept transposed to
+// begin with. Each worker turns its rows of the spectrum, then transforms
+// its strip of columns, transposes its rows and so on.
+void Ocean_step_band(void* arg, int index, int count) {
+	int n = Ocean.size;
+	int r0 = n * index / count;
+	int r1 = n * (index + 1) / count;
+	int j0 = n / 8 * index / count * 8;
+	int j1 = n / 8 * (index + 1) / count * 8;
+
+	for (int r = r0; r < r1; r++) {
+		size_t row = (size_t)r * n;
+		const float* c[4] = {Ocean.coeffs[0] + row, Ocean.coeffs[1] + row, Ocean.coeffs[2] + row, Ocean.coeffs[3] + row};
+		Ocean.kernel->spectrum(Ocean.re[0] + row, Ocean.im[0] + row, Ocean.phaseRe + row, Ocean.phaseIm + row, Ocean.stepRe + row, Ocean.stepIm + row, c, 0, n);
+	}
+	WorkerPool_barrier(Ocean.workers);
+
+	int first = Ocean_fft_columns(0, j0, j1);
+	WorkerPool_barrier(Ocean.workers);
+
+	Ocean_transpose(first, 1 - first, r0, r1);
+	WorkerPool_barrier(Ocean.workers);
+
+	int result = Ocean_fft_columns(1 - first, j0, j1);
+	WorkerPool_barrier(Ocean.workers);
+
+	// The imaginary part is only rounding, the spectrum being Hermitian.
+	float peak = 0;
+	for (int r = r0; r < r1; r++) {
+		peak = fmaxf(peak, Ocean.kernel->maxDiff(Ocean.re[result] + (size_t)r * n, Ocean.zeros, n));
+	}
+	Ocean.peaks[index] = peak;
+	if (index == 0) {
+		Ocean.result = result;
+	}
+}
+
+// Advances the ocean by dt.
+void Ocean_step() {
+	WorkerPool_run(Ocean.workers, Ocean_step_band, NULL);
+
+	Ocean.heights = Ocean.re[Ocean.result];
+	Ocean.peak = 0;
+	for (int i = 0; i < Ocean.workers->count; i++) {
+		Ocean.peak = fmaxf(Ocean.peak, Ocean.peaks[i]);
+	}
+}
+
+// Adds the ocean's heights at count world space positions to heights,
+// interpolated the way the GPU does it.
+void Ocean_add_heights(const float* x, const float* z, int count, float* heights) {
+	if (Ocean.heights == NULL) {
+		return;
+	}
+
+	int n = Ocean.size;
+	float inv = n / OCEAN_LENGTH;
+	for (int p = 0; p < count; p++) {
+		float gx = x[p] * inv;
+		float gz = z[p] * inv;
+		float fx = gx - floorf(gx);
+		float fz = gz - floorf(gz);
+		int i0 = wrapi(floorf(gz), n);
+		int j0 = wrapi(floorf(gx), n);
+		int i1 = (i0 + 1) % n;
+		int j1 = (j0 + 1) % n;
+
+		const float* h = Ocean.heights;
+		float top = lerpf(h[i0 * n + j0], h[i0 * n + j1], fx);
+		float bottom = lerpf(h[i1 * n + j0], h[i1 * n + j1], fx);
+		heights[p] += lerpf(top, bottom, fz);
+	}
+}
+
+// Gives a water shader, which links in ocean.glsl, the ocean's texture and
+// scale, and turns it on if there is an ocean.
+void Ocean_set_uniforms(GLuint shader) {
+	glUseProgram(shader);
+	glUniform1i(glGetUniformLocation(shader, "u_ocean_on"), Ocean.size > 0);
+	glUniform1i(glGetUniformLocation(shader, "u_ocean"), 2);
+	glUniform1f(glGetUniformLocation(shader, "u_ocean_length"), OCEAN_LENGTH);
+	glUniform1f(glGetUniformLocation(shader, "u_ocean_cell"), Water.size / (Water.sim_size - 1));
+}
+
+// The heights go to a repeating texture, which the water shaders add to the
+// ripples. Beyond the water grid, the far ocean is a grid of its own that
+// follows the camera in whole cells, so its vertices stay put on the waves.
+void Ocean_init() {
+	Ocean_init_sim(Settings.oceanSize);
+	int n = Ocean.size;
+
+	glActiveTexture(GL_TEXTURE2);
+	glGenTextures(1, &Ocean.texture);
+	glBindTexture(GL_TEXTURE_2D, Ocean.texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, n, n, 0, GL_RED, GL_FLOAT, NULL);
+	glActiveTexture(GL_TEXTURE0);
+
+	int m = OCEAN_MESH_CELLS;
+	glGenVertexArrays(1, &Ocean.vao);
+	glBindVertexArray(Ocean.vao);
+
+	glGenBuffers(1, &Ocean.vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, Ocean.vbo);
+	float* grid = xmalloc((m + 1) * (m + 1) * 2 * sizeof(float));
+	for (int z = 0; z <= m; z++) {
+		for (int x = 0; x <= m; x++) {
+			grid[2 * (z * (m + 1) + x) + 0] = x;
+			grid[2 * (z * (m + 1) + x) + 1] = z;
+		}
+	}
+	glBufferData(GL_ARRAY_BUFFER, (m + 1) * (m + 1) * 2 * sizeof(float), grid, GL_STATIC_DRAW);
+	xfree(grid);
+
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+
+	uint16_t* indices = xmalloc(m * m * 6 * sizeof(uint16_t));
+	int count = 0;
+	for (int z = 0; z < m; z++) {
+		for (int x = 0; x < m; x++) {
+			Water_clipmap_quad(indices, &count, m, x, z);
+		}
+	}
+	glGenBuffers(1, &Ocean.ebo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, Ocean.ebo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, count * sizeof(uint16_t), indices, GL_STATIC_DRAW);
+	xfree(indices);
+
+	glBindVertexArray(0);
+
+	Ocean.shader = Assets_shader("data/shaders/ocean.vs", "data/shaders/ocean.glsl", "data/shaders/water.fs");
+	Ocean_set_uniforms(Ocean.shader);
+	Ocean.matLoc = glGetUniformLocation(Ocean.shader, "u_mat");
+	Ocean.viewLoc = glGetUniformLocation(Ocean.shader, "u_view");
+	Ocean.originLoc = glGetUniformLocation(Ocean.shader, "u_origin");
+	Ocean.spacingLoc = glGetUniformLocation(Ocean.shader, "u_spacing");
+	Ocean.holeLoc = glGetUniformLocation(Ocean.shader, "u_hole");
+
+	Ocean_set_uniforms(Water.shader);
+}
+
+// Steps the ocean and uploads it, before anything samples it this frame.
+void Ocean_update() {
+	if (Ocean.size == 0) {
+		return;
+	}
+
+	Ocean_step();
+
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, Ocean.texture);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, Ocean.size, Ocean.size, GL_RED, GL_FLOAT, Ocean.heights);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+// Draws the far ocean, leaving a hole where the water grid is.
+void Ocean_draw() {
+	if (Ocean.size == 0) {
+		return;
+	}
+
+	glUseProgram(Ocean.shader);
+	glBindVertexArray(Ocean.vao);
+
+	mat4 mvp;
+	glm_mat4_mul(projMat, viewMat, mvp);
+	glUniformMatrix4fv(Ocean.matLoc, 1, GL_FALSE, (float*)mvp);
+	glUniformMatrix4fv(Ocean.viewLoc, 1, GL_FALSE, (float*)viewMat);
+
+	float spacing = 2 * farPlane / OCEAN_MESH_CELLS;
+	glUniform2f(Ocean.originLoc, floorf(Blahaj.camPos[0] / spacing) * spacing - farPlane, floorf(Blahaj.camPos[2] / spacing) * spacing - farPlane);
+	glUniform1f(Ocean.spacingLoc, spacing);
+	glUniform4f(Ocean.holeLoc, 0, 0, Water.size / 2, Water.size / 2);
+
+	glDrawElements(GL_TRIANGLES, OCEAN_MESH_CELLS * OCEAN_MESH_CELLS * 6, GL_UNSIGNED_SHORT, NULL);
+	glBindVertexArray(0);
+}
+
+GLuint projLoc3;
+GLuint viewLoc3;
+
+const char* skyFaces[6] = {
+	"data/sky/right.jpg",
+	"data/sky/left.jpg",
+	"data/sky/bottom.jpg",
+	"data/sky/top.jpg",
+	"data/sky/front.jpg",
+	"data/sky/back.jpg",
+};
+
+
+void Sky_init() {
+	Sky.shader = Assets_shader("data/shaders/sky.vs", NULL, "data/shaders/sky.fs");
+	projLoc3 = glGetUniformLocation(Sky.shader, "projection");
+	viewLoc3 = glGetUniformLocation(Sky.shader, "view");
+
+	GLuint texture = Assets_cubemap(skyFaces);
+	if (Sky.texture != 0) {
+		Assets_release_texture(Sky.texture);
+	}
+	Sky.texture = texture;
+
+	glGenVertexArrays(1, &Sky.vao);
+	glBindVertexArray(Sky.vao);
+
+	glGenBuffers(1, &Sky.vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, Sky.vbo);
+
+	float skyboxVertices[] = {
+		// positions          
+		-1.0f,  1.0f, -1.0f,
+		-1.0f, -1.0f, -1.0f,
+		1.0f, -1.0f, -1.0f,
+		1.0f, -1.0f, -1.0f,
+		1.0f,  1.0f, -1.0f,
+		-1.0f,  1.0f, -1.0f,
+
+		-1.0f, -1.0f,  1.0f,
+		-1.0f, -1.0f, -1.0f,
+		-1.0f,  1.0f, -1.0f,
+		-1.0f,  1.0f, -1.0f,
+		-1.0f,  1.0f,  1.0f,
+		-1.0f, -1.0f,  1.0f,
+
+		1.0f, -1.0f, -1.0f,
+		1.0f, -1.0f,  1.0f,
+		1.0f,  1.0f,  1.0f,
+		1.0f,  1.0f,  1.0f,
+		1.0f,  1.0f, -1.0f,
+		1.0f, -1.0f, -1.0f,
+
+		-1.0f, -1.0f,  1.0f,
+		-1.0f,  1.0f,  1.0f,
+		1.0f,  1.0f,  1.0f,
+		1.0f,  1.0f,  1.0f,
+		1.0f, -1.0f,  1.0f,
+		-1.0f, -1.0f,  1.0f,
+
+		-1.0f,  1.0f, -1.0f,
+		1.0f,  1.0f, -1.0f,
+		1.0f,  1.0f,  1.0f,
+		1.0f,  1.0f,  1.0f,
+		-1.0f,  1.0f,  1.0f,
+		-1.0f,  1.0f, -1.0f,
+
+		-1.0f, -1.0f, -1.0f,
+		-1.0f, -1.0f,  1.0f,
+		1.0f, -1.0f, -1.0f,
+		1.0f, -1.0f, -1.0f,
+		-1.0f, -1.0f,  1.0f,
+		1.0f, -1.0f,  1.0f
+	};
+	glBufferData(GL_ARRAY_BUFFER, sizeof(skyboxVertices), skyboxVertices, GL_STATIC_DRAW);
+
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+}
+
+void Sky_update() {
+	glBindVertexArray(Sky.vao);
+	glUseProgram(Sky.shader);
+
+	glDepthMask(GL_FALSE);
+
+	glUniformMatrix4fv(projLoc3, 1, GL_FALSE, (float*)projMat);
+
+	mat4 matmat;
+	glm_mat4_copy(viewMat, matmat);
+	matmat[3][0] = 0;
+	matmat[3][1] = 0;
+	matmat[3][2] = 0;
+	glUniformMatrix4fv(viewLoc3, 1, GL_FALSE, (float*)matmat);
+
+	glDrawArrays(GL_TRIANGLES, 0, 36);
+
+	glDepthMask(GL_TRUE);
+}
+
+typedef struct Fish {
+	vec3 pos;
+	float scale;
+	float yaw;
+	float targetYaw;
+
+	float roll;
+
+	int turnTimer;
+
+	bool dead;
+} Fish;
+
+Vector* fishes;
+Model* fishModel;
+
+void Fishs_init() {
+	Model* model = Assets_model("data/models/blahaj.obj");
+	if (fishModel != NULL) {
+		Assets_release_model(fishModel);
+	}
+	fishModel = model;
+
+	if (fishes != NULL) {
+		Vector_delete(fishes);
+	}
+	fishes = Vector_new(sizeof(Fish));
+
+	int n = 100;
+	for (int i = 0; i < n; i++) {
+		Fish fish;
+		fish.pos[0] = float_rand(-Water.size / 2, Water.size / 2);
+		fish.pos[1] = 0;
+		fish.pos[2] = float_rand(-Water.size / 2, Water.size / 2);
+		fish.yaw = float_rand(0, 2 * PI);
+		fish.roll = float_rand(0, 2 * PI);
+		fish.scale = 1;
+		fish.targetYaw = fish.yaw;
+		fish.turnTimer = 0;
+		fish.dead = false;
+		Vector_add(fishes, &fish);
+	}
+}
+
+void Fishs_update() {
+	const float fishSpeed = 15;
+	const float turnMax = deg2rad(90);
+
+	if (fishes->count == 0) {
+		return;
+	}
+
+	glUseProgram(texturedShader);
+	glBindVertexArray(fishModel->vao);
+
+	float xs[fishes->count];
+	float zs[fishes->count];
+	float heights[fishes->count];
+
+	for (int i = 0; i < fishes->count; i++) {
+		Fish* fish = &((Fish*)fishes->data)[i];
+
+		fish->pos[0] += fishSpeed * cosf(fish->yaw) * dt;
+		fish->pos[2] += fishSpeed * sinf(fish->yaw) * dt;
+
+		if (fish->pos[0] < -Water.size / 2) {
+			fish->pos[0] = Water.size / 2;
+			// fish->pos[1] = 10;
+		}
+		if (fish->pos[0] > Water.size / 2) {
+			fish->pos[0] = -Water.size / 2;
+			// fish->pos[1] = 10;
+		}
+		if (fish->pos[2] < -Water.size / 2) {
+			fish->pos[2] = Water.size / 2;
+			// fish->pos[1] = 10;
+		}
+		if (fish->pos[2] > Water.size / 2) {
+			fish->pos[2] = -Water.size / 2;
+			// fish->pos[1] = 10;
+		}
+
+		xs[i] = fish->pos[0];
+		zs[i] = fish->pos[2];
+	}
+
+	// All the fish ride on the water, sampled in one pass.
+	Water_sample(Water_snapshot(), xs, zs, fishes->count, heights, NULL);
+	Ocean_add_heights(xs, zs, fishes->count, heights);
+
+	for (int i = 0; i < fishes->count; i++) {
+		Fish* fish = &((Fish*)fishes->data)[i];
+
+		fish->pos[1] = heights[i];
+
+		Water_add_pulse(0.02f * fish->scale, 0.05f * fish->scale, fish->pos[0], fish->pos[2]);
+
+		if (fish->turnTimer++ > 60) {
+			fish->turnTimer = 0;
+
+			fish->targetYaw = fish->yaw + float_rand(-turnMax, turnMax);
+		}
+		fish->yaw = lerpf(fish->yaw, fish->targetYaw, 0.05f);
+
+		fish->roll += deg2rad(90) * dt;
+
+		float d2 = glm_vec3_distance2(Blahaj.pos, fish->pos);
+		if (d2 < Blahaj.scale * 4) {
+			Blahaj.scaleTarget += 0.1f;
+			fish->dead = true;
+
+			Water_add_pulse(1, 0.5f, fish->pos[0], fish->pos[2]);
+		}
+	
+		mat4 modelMat;
+		glm_mat4_identity(modelMat);
+		glm_translate(modelMat, fish->pos);
+		glm_rotate_y(modelMat, PI-fish->yaw, modelMat);
+		glm_rotate_x(modelMat, fish->roll, modelMat);
+		glm_scale_uni(modelMat, fish->scale);
+
+		mat4 mvp;
+		glm_mat4_mul(projMat, viewMat, mvp);
+		glm_mat4_mul(mvp, modelMat, mvp);
+
+		glUniformMatrix4fv(mat_loc, 1, GL_FALSE, (float*)mvp);
+		glUniformMatrix4fv(view_loc, 1, GL_FALSE, (float*)viewMat);
+
+		glBindTexture(GL_TEXTURE_2D, fishModel->texture);
+
+		glDrawElements(GL_TRIANGLES, fishModel->indexCount, fishModel->indexType, 0);
+	}
+
+	for (int i = 0; i < fishes->count; i++) {
+		Fish* fish = &((Fish*)fishes->data)[i];
+
+		if (fish->dead) {
+			((Fish*)fishes->data)[i] = ((Fish*)fishes->data)[--fishes->count];
+		}
+	}
+}
+
+void sigsegv_func(int signo) {
+	panic("Segmentation fault\n");
+}
+
+// The longest the GL thread spends uploading loaded assets in one frame.
+#define LOADER_FRAME_BUDGET 0.004
+
+double launchTime;
+int startupStep;
+bool startupDone;
+
+// Runs the game's init functions on the GL thread from the second frame on,
+// one step per frame so the menu keeps drawing. The water and ocean need no
+// files and are set up while the loader works. The rest wait until the
+// loader has made their assets resident and then find them in the registry.
+void Startup_update() {
+	bool resident = Loader_update(LOADER_FRAME_BUDGET);
+
+	switch (startupStep) {
+	case 0:
+		Water_init();
+		startupStep++;
+		break;
+	case 1:
+		if (Settings.oceanSize > 0) {
+			Ocean_init();
+		}
+		startupStep++;
+		break;
+	default:
+		if (resident) {
+			Blahaj_init();
+			Sky_init();
+			Fishs_init();
+			Loader_finish();
+
+			startupDone = true;
+			printf("Game ready after %.0f ms\n", (time_seconds() - launchTime) * 1000);
+		}
+		break;
+	}
+}
+
+typedef enum GameState {
+	STATE_MENU,
+	STATE_GAME,
+	STATE_OVER,
+} GameState;
+
+GameState state;
+
+int logoImg;
+NVGpaint logoPaint;
+
+void MENU_init() {
+	state = STATE_MENU;
+
+	int image = Assets_image("data/logo.png", 0);
+	if (logoImg != 0) {
+		Assets_release_image(logoImg);
+	}
+	logoImg = image;
+	logoPaint = nvgImagePattern(vg, 0, 0, width, height, 0, logoImg, 1);
+}
+
+void GAME_init();
+
+void MENU_update() {
+	glEnable(GL_CULL_FACE);
+	glEnable(GL_DEPTH_TEST);
+	glDisable(GL_STENCIL_TEST);
+
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	glClearColor(0, 0, 0, 0);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+
+	nvgBeginFrame(vg, width, height, 1);
+
+	nvgBeginPath(vg);
+	nvgFillPaint(vg, logoPaint);
+	nvgRect(vg, 0, 0, width, height);
+	nvgFill(vg);
+
+	if (!startupDone) {
+		nvgFillColor(vg, nvgRGBA(255,192,0,255));
+		nvgFontSize(vg, 36.0f);
+		nvgFontFace(vg, "font");
+		nvgTextAlign(vg, NVG_ALIGN_BOTTOM | NVG_ALIGN_LEFT);
+		nvgText(vg, 0, height, "Loading...", NULL);
+	}
+
+	nvgEndFrame(vg);
+
+	if (keyboardState[SDL_SCANCODE_RETURN] && startupDone) {
+		GAME_init();
+	}
+}
+
+int timeLeft;
+void GAME_init() {
+	state = STATE_GAME;
+
+	timeLeft = 30 * 60;
+}
+
+int logoImg2;
+NVGpaint logoPaint2;
+
+void OVER_init() {
+	state = STATE_OVER;
+
+	int image = Assets_image("data/bg.png", 0);
+	if (logoImg2 != 0) {
+		Assets_release_image(logoImg2);
+	}
+	logoImg2 = image;
+	logoPaint2 = nvgImagePattern(vg, 0, 0, width, height, 0, logoImg2, 1);
+
+	if (Settings.assetStats) {
+		Assets_print_stats();
+	}
+}
+
+void OVER_update() {
+	glEnable(GL_CULL_FACE);
+	glEnable(GL_DEPTH_TEST);
+	glDisable(GL_STENCIL_TEST);
+
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	glClearColor(0, 0, 0, 0);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+
+	nvgBeginFrame(vg, width, height, 1);
+
+	nvgBeginPath(vg);
+	nvgFillPaint(vg, logoPaint2);
+	nvgRect(vg, 0, 0, width, height);
+	nvgFill(vg);
+
+	nvgFillColor(vg, nvgRGBA(255,192,0,255));
+	nvgFontSize(vg, 72.0f);
+	nvgFontFace(vg, "font");
+	nvgTextAlign(vg, NVG_ALIGN_TOP);
+
+	char text[256];
+	sprintf(text, "Thanks for playing! Your score is %d", 100 - fishes->count);
+	nvgText(vg, 0, 0, text, NULL);
+
+	nvgEndFrame(vg);
+
+	if (keyboardState[SDL_SCANCODE_RETURN]) {
+		Blahaj_init();
+		// Water_init();
+		// Sky_init();
+		Fishs_init();
+		
+		GAME_init();
+	}
+}
+
+void GAME_update() {
+	glEnable(GL_CULL_FACE);
+	glEnable(GL_DEPTH_TEST);
+	glDisable(GL_STENCIL_TEST);
+
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	glClearColor(0, 0, 0, 0);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+
+	glm_perspective(deg2rad(90), width / (float)height, 0.1f, farPlane, projMat);
+	
+	vec3 up = {0, 1, 0};
+	glm_lookat(Blahaj.camPos, Blahaj.pos, up, viewMat);
+
+	Sky_update();
+	Ocean_update();
+	Blahaj_update();
+	Fishs_update();
+	Water_update();
+	Ocean_draw();
+
+	nvgBeginFrame(vg, width, height, 1);
+
+	nvgFillColor(vg, nvgRGBA(255,192,0,255));
+	nvgFontSize(vg, 72.0f);
+	nvgFontFace(vg, "font");
+	nvgTextAlign(vg, NVG_ALIGN_TOP);
+
+	char text[256];
+	sprintf(text, "%.2f seconds left!", timeLeft / 60.0f);
+	nvgText(vg, 0, 0, text, NULL);
+
+	sprintf(text, "Score: %d", 100 - fishes->count);
+	nvgTextAlign(vg, NVG_ALIGN_TOP | NVG_ALIGN_RIGHT);
+	nvgText(vg, width, 0, text, NULL);
+
+	if (Settings.waterStats) {
+		int activeTiles = Water.async ? Water.frames[Water.frameFront].activeTiles : Water.activeTiles;
+		if (Settings.waterClipmap > 0) {
+			sprintf(text, "Water: %d/%d tiles active, %d triangles", activeTiles, Water.tilesX * Water.tilesX, Water.clipmapTriangles);
+		}
+		else {
+			sprintf(text, "Water: %d/%d tiles active, %d/%d patches drawn", activeTiles, Water.tilesX * Water.tilesX, Water.visiblePatches, Water.patchesX * Water.patchesX * Water.copies);
+		}
+		nvgFontSize(vg, 24.0f);
+		nvgTextAlign(vg, NVG_ALIGN_BOTTOM | NVG_ALIGN_LEFT);
+		nvgText(vg, 0, height, text, NULL);
+	}
+
+	nvgEndFrame(vg);
+
+	timeLeft--;
+
+	if (timeLeft < 0) {
+		OVER_init();
+	}
+}
+
+// Headless benchmarks, run with --bench <name> instead of starting the game.
+
+// Times one frame's worth of pulses from many emitters plus the step that
+// applies them. For comparison it also times the old approach of evaluating
+// each pulse's Gaussian over the whole grid, once, and scales that up.
+void Bench_water_impulses() {
+	const int emitterCounts[] = {0, 1, 100, 10000};
+	const int warmup = 20;
+	const int frames = 200;
+
+	// Keep every tile awake so each row simulates the same cells and the
+	// difference to the baseline is the cost of the impulses alone.
+	Settings.waterSleepThreshold = -1;
+	Settings.waterWakeThreshold = -1;
+
+	Water_init_sim(500);
+	int n = Water.sim_size;
+
+	float* scratch = xmalloc(n * n * sizeof(float));
+	memset(scratch, 0, n * n * sizeof(float));
+	double start = time_seconds();
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < n; j++) {
+			float x = mapf(j, 0, n - 1, -Water.size / 2, Water.size / 2) - 3;
+			float y = mapf(i, 0, n - 1, -Water.size / 2, Water.size / 2) + 7;
+			scratch[i * n + j] += 0.001f * expf(-(x * x + y * y) / 0.05f);
+		}
+	}
+	double fullGridMs = (time_seconds() - start) * 1000;
+	xfree(scratch);
+
+	printf("Water impulses, %dx%d grid, %d threads, %s kernel\n", n, n, Water.workers->count, Water.kernel->name);
+	printf("%10s %12s %12s %12s %16s\n", "emitters", "ms/frame", "impulse ms", "ns/emitter", "full-grid ms");
+
+	double baseline = 0;
+	for (int c = 0; c < sizeof(emitterCounts) / sizeof(emitterCounts[0]); c++) {
+		int emitters = emitterCounts[c];
+
+		for (int f = 0; f < warmup + frames; f++) {
+			if (f == warmup) {
+				start = time_seconds();
+			}
+			for (int e = 0; e < emitters; e++) {
+				Water_add_pulse(0.001f, 0.05f, float_rand(-Water.size / 2, Water.size / 2), float_rand(-Water.size / 2, Water.size / 2));
+			}
+			Water_step_sim();
+		}
+		double ms = (time_seconds() - start) * 1000 / frames;
+
+		if (emitters == 0) {
+			baseline = ms;
+			printf("%10d %12.3f %12s %12s %16s\n", emitters, ms, "-", "-", "-");
+		}
+		else {
+			double impulseMs = ms - baseline > 0 ? ms - baseline : 0;
+			printf("%10d %12.3f %12.3f %12.1f %16.1f\n", emitters, ms, impulseMs, impulseMs * 1e6 / emitters, fullGridMs * emitters);
+		}
+	}
+}
+
+// Times K substeps per frame run as K separate sweeps over the grid against
+// one temporally blocked sweep, which must also give the same heights.
+void Bench_water_blocking() {
+	const int sizes[] = {500, 1000, 2000, 4000};
+	const int substeps[] = {1, 2, 4, 8};
+
+	Settings.waterSleepThreshold = -1;
+	Settings.waterWakeThreshold = -1;
+
+	for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		int n = sizes[s];
+
+		// Keep the work per row of the table roughly the same.
+		int frames = 40 * 500 * 500 / (n * n);
+		frames = frames > 2 ? frames : 2;
+
+		for (int k = 0; k < sizeof(substeps) / sizeof(substeps[0]); k++) {
+			int K = substeps[k];
+			double ms[2];
+			void* result[2];
+			size_t bytes = 0;
+
+			for (int blocked = 0; blocked < 2; blocked++) {
+				Settings.waterBlockSteps = blocked ? K : 1;
+				Water_init_sim(n);
+				if (s == 0 && k == 0 && blocked == 0) {
+					printf("Water substeps, %d threads, %s kernel\n", Water.workers->count, Water.kernel->name);
+					printf("%6s %4s %16s %16s %10s\n", "grid", "K", "sweeps ms", "blocked ms", "speedup");
+				}
+
+				Water_add_pulse(0.5f, 1, 0, 0);
+				Water_step_frame(dt, K);
+
+				double start = time_seconds();
+				for (int f = 0; f < frames; f++) {
+					Water_step_frame(dt, K);
+				}
+				ms[blocked] = (time_seconds() - start) * 1000 / frames;
+
+				// Cells are only 2 bytes under --water-half.
+				bytes = (size_t)n * n * Water.cellBytes;
+				result[blocked] = xmalloc(bytes);
+				memcpy(result[blocked], Water.u, bytes);
+				Water_delete_sim();
+			}
+
+			if (memcmp(result[0], result[1], bytes) != 0) {
+				panic("Blocked substeps differ from separate sweeps at %d, K = %d\n", n, K);
+			}
+			xfree(result[0]);
+			xfree(result[1]);
+
+			printf("%6d %4d %16.3f %16.3f %9.2fx\n", n, K, ms[0], ms[1], ms[0] / ms[1]);
+		}
+	}
+}
+
+// Runs the same 10,000 steps with float and with fp16 storage and compares
+// the heights every 1000 steps. Emitters circle the pool like fish, and a
+// big splash lands every 500 steps.
+void Bench_water_half() {
+	const int steps = 10000;
+	const int every = 1000;
+	const int emitters = 8;
+
+	float* reference = NULL;
+	double ms[2];
+	int n = 0;
+
+	for (int half = 0; half < 2; half++) {
+		Settings.waterHalf = half;
+		Water_init_sim(500);
+		n = Water.sim_size;
+		if (half == 0) {
+			reference = xmalloc((size_t)(steps / every) * n * n * sizeof(float));
+			printf("Water fp16 storage, %dx%d grid, %d steps, %s kernel\n", n, n, steps, Water.kernel->name);
+			printf("%8s %14s %14s %14s\n", "step", "rms height", "max error", "rms error");
+		}
+
+		double start = time_seconds();
+		for (int s = 1; s <= steps; s++) {
+			for (int e = 0; e < emitters; e++) {
+				float angle = s * 0.01f * (e + 1) + e;
+				float radius = 5 + 4 * e;
+				Water_add_pulse(0.02f, 0.05f, radius * cosf(angle), radius * sinf(angle));
+			}
+			if (s % 500 == 0) {
+				Water_add_pulse(1, 0.5f, 10 * cosf(s), 10 * sinf(s));
+			}
+			Water_step_sim();
+
+			if (s % every != 0) {
+				continue;
+			}
+
+			float* snapshot = &reference[(size_t)(s / every - 1) * n * n];
+			if (half == 0) {
+				for (int i = 0; i < n * n; i++) {
+					snapshot[i] = Water_height(Water.u, i);
+				}
+				continue;
+			}
+
+			double sum = 0;
+			double errorSum = 0;
+			float maxError = 0;
+			for (int i = 0; i < n * n; i++) {
+				float error = fabsf(Water_height(Water.u, i) - snapshot[i]);
+				maxError = error > maxError ? error : maxError;
+				errorSum += error * error;
+				sum += snapshot[i] * snapshot[i];
+			}
+			printf("%8d %14.3e %14.3e %14.3e\n", s, sqrt(sum / (n * n)), maxError, sqrt(errorSum / (n * n)));
+
+			if (errorSum > 0.01 * 0.01 * sum) {
+				panic("fp16 heights are more than 1%% (rms) off the float ones at step %d\n", s);
+			}
+		}
+		ms[half] = (time_seconds() - start) * 1000 / steps;
+
+		Water_delete_sim();
+	}
+
+	xfree(reference);
+	Settings.waterHalf = false;
+	printf("float %.3f ms/step, fp16 %.3f ms/step\n", ms[0], ms[1]);
+}
+
+// Times frames that step the water and then wait for a fixed time, like a
+// renderer blocked on the GPU. Stepped on the same thread a frame costs the
+// sum of the two; on the simulation thread it should cost the larger one.
+void Bench_water_async() {
+	const int n = 1000;
+	const int frames = 200;
+	const int emitters = 64;
+	const struct timespec render = {0, 6 * 1000 * 1000};
+
+	const char* modes[] = {"step only", "render only", "sync", "async"};
+	for (int mode = 0; mode < 4; mode++) {
+		Water_init_sim(n);
+		if (mode == 0) {
+			printf("Water on its own thread, %dx%d grid, %d threads, %s kernel\n", n, n, Water.workers->count, Water.kernel->name);
+			printf("%12s %12s %14s\n", "mode", "ms/frame", "fresh frames");
+		}
+		if (mode == 3) {
+			Water_start_async();
+		}
+
+		int fresh = 0;
+		double start = time_seconds();
+		for (int f = 0; f < frames; f++) {
+			for (int e = 0; e < emitters && mode != 1; e++) {
+				float angle = f * 0.01f * (e + 1) + e;
+				float radius = 1 + 0.7f * e;
+				Water_add_pulse(0.02f, 0.05f, radius * cosf(angle), radius * sinf(angle));
+			}
+
+			if (mode == 3) {
+				int front = Water.frameFront;
+				Water_request_frame();
+				Water_acquire_frame();
+				fresh += Water.frameFront != front;
+			}
+			else if (mode != 1) {
+				Water_step_sim();
+				fresh++;
+			}
+
+			if (mode != 0) {
+				nanosleep(&render, NULL);
+			}
+		}
+		double ms = (time_seconds() - start) * 1000 / frames;
+
+		if (mode == 3) {
+			Water_stop_async();
+		}
+		Water_delete_sim();
+
+		printf("%12s %12.3f %9d/%d\n", modes[mode], ms, fresh, frames);
+	}
+}
+
+// Samples a rippled pool at a million random positions, some outside it, and
+// checks the selected kernel against the scalar one.
+void Bench_water_sample() {
+	const int count = 1 << 20;
+	const int repeats = 10;
+
+	float* x = xmalloc(count * sizeof(float));
+	float* z = xmalloc(count * sizeof(float));
+	float* heights[2] = {xmalloc(count * sizeof(float)), xmalloc(count * sizeof(float))};
+	vec3* normals[2] = {xmalloc(count * sizeof(vec3)), xmalloc(count * sizeof(vec3))};
+
+	for (int half = 0; half < 2; half++) {
+		Settings.waterHalf = half;
+		Water_init_sim(500);
+		if (half == 0) {
+			printf("Water sampling, %d positions, %s kernel against scalar\n", count, Water.kernel->name);
+			printf("%8s %10s %14s %14s %14s %14s\n", "format", "kernel", "heights ns", "normals ns", "height error", "normal error");
+		}
+
+		for (int s = 0; s < 200; s++) {
+			Water_add_pulse(0.5f, 1, 20 * cosf(s * 0.1f), 20 * sinf(s * 0.1f));
+			Water_step_sim();
+		}
+		for (int p = 0; p < count; p++) {
+			x[p] = float_rand(-Water.size / 2 - 5, Water.size / 2 + 5);
+			z[p] = float_rand(-Water.size / 2 - 5, Water.size / 2 + 5);
+		}
+
+		const WaterKernel* kernels[2] = {&waterKernels[0], Water.kernel};
+		double ns[2][2];
+		for (int k = 0; k < 2; k++) {
+			Water.kernel = kernels[k];
+			for (int withNormals = 0; withNormals < 2; withNormals++) {
+				double start = time_seconds();
+				for (int r = 0; r < repeats; r++) {
+					Water_sample(Water_snapshot(), x, z, count, heights[k], withNormals ? normals[k] : NULL);
+				}
+				ns[k][withNormals] = (time_seconds() - start) * 1e9 / repeats / count;
+			}
+		}
+
+		float heightError = 0;
+		float normalError = 0;
+		for (int p = 0; p < count; p++) {
+			heightError = fmaxf(heightError, fabsf(heights[1][p] - heights[0][p]));
+			for (int c = 0; c < 3; c++) {
+				normalError = fmaxf(normalError, fabsf(normals[1][p][c] - normals[0][p][c]));
+			}
+		}
+
+		for (int k = 0; k < 2; k++) {
+			printf("%8s %10s %14.2f %14.2f", half ? "fp16" : "float", kernels[k]->name, ns[k][0], ns[k][1]);
+			if (k == 1) {
+				printf(" %14.3e %14.3e", heightError, normalError);
+			}
+			printf("\n");
+		}
+
+		if (heightError > 1e-5f || normalError > 1e-5f) {
+			panic("%s sampling differs from scalar by %g in height and %g in normals\n", Water.kernel->name, heightError, normalError);
+		}
+
+		Water_delete_sim();
+	}
+
+	Settings.waterHalf = false;
+	xfree(x);
+	xfree(z);
+	for (int k = 0; k < 2; k++) {
+		xfree(heights[k]);
+		xfree(normals[k]);
+	}
+}
+
+// Checks that a periodic grid has no seam. A splash across the corner of the
+// pool must come out the same as one in the middle moved by half a period,
+// and the blocked step must match separate sweeps. Also times the periodic
+// step against fixed edges.
+void Bench_water_periodic() {
+	const int sizes[] = {500, 513, 2000};
+	const int frames = 60;
+	const int K = 4;
+
+	Settings.waterSleepThreshold = -1;
+	Settings.waterWakeThreshold = -1;
+
+	for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		int n = sizes[s];
+		int period = n - 1;
+		int shift = period / 2;
+		float cell = 100.0f / period;
+
+		// Corner splash with separate sweeps, then blocked, then the middle
+		// splash blocked, then fixed edges.
+		float* result[4];
+		double ms[4];
+		for (int run = 0; run < 4; run++) {
+			Settings.waterPeriodic = run < 3;
+			Settings.waterBlockSteps = run == 0 ? 1 : K;
+			Water_init_sim(n);
+			if (s == 0 && run == 0) {
+				printf("Water periodic edges, %d substeps, %d frames, %d threads, %s kernel\n", K, frames, Water.workers->count, Water.kernel->name);
+				printf("%6s %12s %12s %14s %14s\n", "grid", "seam error", "blocked", "periodic ms", "fixed ms");
+			}
+
+			float x = Water.size / 2 - 0.3f * cell;
+			if (run == 2) {
+				x -= shift * cell;
+			}
+			Water_add_pulse(0.5f, 1, x, x);
+
+			double start = time_seconds();
+			for (int f = 0; f < frames; f++) {
+				Water_step_frame(dt, K);
+			}
+			ms[run] = (time_seconds() - start) * 1000 / frames;
+
+			result[run] = xmalloc((size_t)n * n * sizeof(float));
+			for (size_t c = 0; c < (size_t)n * n; c++) {
+				result[run][c] = Water_height(Water.u, c);
+			}
+			Water_delete_sim();
+		}
+
+		// The copies of row and column 0 are compared too.
+		float error = 0;
+		float peak = 0;
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < n; j++) {
+				float u = result[1][i * n + j];
+				float moved = result[2][wrapi(i - shift, period) * n + wrapi(j - shift, period)];
+				error = fmaxf(error, fabsf(u - moved));
+				peak = fmaxf(peak, fabsf(u));
+			}
+		}
+		if (error > 1e-3f * peak) {
+			panic("Periodic grid has a seam at %d: error %g of %g\n", n, error, peak);
+		}
+		if (memcmp(result[0], result[1], (size_t)n * n * sizeof(float)) != 0) {
+			panic("Blocked periodic substeps differ from separate sweeps at %d\n", n);
+		}
+
+		printf("%6d %12.2g %12s %14.3f %14.3f\n", n, error / peak, "same", ms[1], ms[3]);
+		for (int run = 0; run < 4; run++) {
+			xfree(result[run]);
+		}
+	}
+}
+
+// Checks each kernel's ocean FFT against a direct evaluation of the same
+// spectrum in double precision, then times a step at every size.
+void Bench_ocean() {
+	const int sizes[] = {64, 128, 256, 512};
+
+	for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		int n = sizes[s];
+		double* reference = NULL;
+
+		for (int k = 0; k < WATER_KERNEL_COUNT; k++) {
+			if (!waterKernels[k].supported()) {
+				continue;
+			}
+
+			// The same seed gives every kernel the same spectrum.
+			srand(1);
+			Settings.waterKernel = waterKernels[k].name;
+			Ocean_init_sim(n);
+			if (s == 0 && k == 0) {
+				printf("Ocean FFT, %d threads\n", Ocean.workers->count);
+				printf("%6s %8s %12s %12s\n", "size", "kernel", "max error", "ms/step");
+			}
+			Ocean_step();
+
+			// h(x, z) is the sum over (a, b) of the transposed spectrum
+			// times e^(2 pi i (a x + b z) / n), done one axis at a time.
+			if (reference == NULL) {
+				double* rowRe = xmalloc((size_t)n * n * sizeof(double));
+				double* rowIm = xmalloc((size_t)n * n * sizeof(double));
+				for (int x = 0; x < n; x++) {
+					for (int b = 0; b < n; b++) {
+						double sumRe = 0;
+						double sumIm = 0;
+						for (int a = 0; a < n; a++) {
+							size_t c = (size_t)a * n + b;
+							double re = Ocean.coeffs[0][c] * Ocean.phaseRe[c] + Ocean.coeffs[1][c] * Ocean.phaseIm[c];
+							double im = Ocean.coeffs[2][c] * Ocean.phaseIm[c] + Ocean.coeffs[3][c] * Ocean.phaseRe[c];
+							double wr = Ocean.twiddles[2 * (a * x % n) + 0];
+							double wi = Ocean.twiddles[2 * (a * x % n) + 1];
+							sumRe += re * wr - im * wi;
+							sumIm += re * wi + im * wr;
+						}
+						rowRe[x * n + b] = sumRe;
+						rowIm[x * n + b] = sumIm;
+					}
+				}
+
+				reference = xmalloc((size_t)n * n * sizeof(double));
+				for (int z = 0; z < n; z++) {
+					for (int x = 0; x < n; x++) {
+						double sum = 0;
+						for (int b = 0; b < n; b++) {
+							double wr = Ocean.twiddles[2 * (b * z % n) + 0];
+							double wi = Ocean.twiddles[2 * (b * z % n) + 1];
+							sum += rowRe[x * n + b] * wr - rowIm[x * n + b] * wi;
+						}
+						reference[z * n + x] = sum;
+					}
+				}
+				xfree(rowRe);
+				xfree(rowIm);
+			}
+
+			double error = 0;
+			double peak = 0;
+			for (size_t c = 0; c < (size_t)n * n; c++) {
+				error = fmax(error, fabs(Ocean.heights[c] - reference[c]));
+				peak = fmax(peak, fabs(reference[c]));
+			}
+			if (error > 1e-4 * peak || fabs(Ocean.peak - peak) > 1e-4 * peak) {
+				panic("Ocean FFT with the %s kernel is off by %g of %g at %d\n", waterKernels[k].name, error, peak, n);
+			}
+
+			int steps = 20 * 512 * 512 / (n * n);
+			double start = time_seconds();
+			for (int i = 0; i < steps; i++) {
+				Ocean_step();
+			}
+			double ms = (time_seconds() - start) * 1000 / steps;
+
+			printf("%6d %8s %12.2g %12.3f\n", n, waterKernels[k].name, error / peak, ms);
+			Ocean_delete_sim();
+		}
+
+		xfree(reference);
+	}
+}
+
+// Compares a nested simulation with the uniform grid it stands in for, and
+// with its coarse grid alone. A wake is drawn along a circle that the fine
+// grid has to follow, and the heights around its end are compared with the
+// uniform grid's. Each grid is timed with tiles sleeping as usual and again
+// with every tile awake, as in a pool full of waves.
+void Bench_water_nested() {
+	const int cells = 500;
+	const int ratio = 4;
+	const int frames = 300;
+	const int samples = 64;
+	const float radius = 8;
+
+	float* reference = xmalloc(samples * samples * sizeof(float));
+	float* heights = xmalloc(samples * samples * sizeof(float));
+	float* x = xmalloc(samples * samples * sizeof(float));
+	float* z = xmalloc(samples * samples * sizeof(float));
+
+	float sleep = Settings.waterSleepThreshold;
+	float wake = Settings.waterWakeThreshold;
+
+	printf("Water nested grids, %d frames, wake along a circle\n", frames);
+	printf("%10s %10s %12s %12s %14s\n", "grid", "cells", "ms/frame", "awake ms", "error near");
+
+	const char* names[3] = {"uniform", "coarse", "nested"};
+	for (int run = 0; run < 3; run++) {
+		double ms[2];
+		int simulated = 0;
+		for (int awake = 1; awake >= 0; awake--) {
+			Settings.waterSleepThreshold = awake ? -1 : sleep;
+			Settings.waterWakeThreshold = awake ? -1 : wake;
+			Settings.waterNested = run == 2 ? ratio : 0;
+			Water_init_sim(run == 0 ? cells : (cells - 1) / ratio + 1);
+
+			double start = time_seconds();
+			float px = 0;
+			float pz = 0;
+			for (int f = 0; f < frames; f++) {
+				float angle = f * 0.02f;
+				px = 15 * cosf(angle);
+				pz = 15 * sinf(angle);
+				Water_set_focus(px, pz);
+				Water_add_pulse(0.25f, 0.5f, px, pz);
+				Water_step_sim();
+			}
+			ms[awake] = (time_seconds() - start) * 1000 / frames;
+
+			for (int a = 0; a < samples; a++) {
+				for (int b = 0; b < samples; b++) {
+					x[a * samples + b] = px + mapf(b, 0, samples - 1, -radius, radius);
+					z[a * samples + b] = pz + mapf(a, 0, samples - 1, -radius, radius);
+				}
+			}
+			Water_sample(Water_snapshot(), x, z, samples * samples, run == 0 ? reference : heights, NULL);
+
+			simulated = Water.sim_size * Water.sim_size + Water.fineSize * Water.fineSize;
+			Water_delete_sim();
+		}
+
+		printf("%10s %10d %12.3f %12.3f", names[run], simulated, ms[0], ms[1]);
+		if (run > 0) {
+			float error = 0;
+			float signal = 0;
+			for (int p = 0; p < samples * samples; p++) {
+				error += (heights[p] - reference[p]) * (heights[p] - reference[p]);
+				signal += reference[p] * reference[p];
+			}
+			printf(" %14.3f", sqrtf(error / signal));
+		}
+		printf("\n");
+	}
+
+	Settings.waterNested = 0;
+	Settings.waterSleepThreshold = sleep;
+	Settings.waterWakeThreshold = wake;
+	xfree(reference);
+	xfree(heights);
+	xfree(x);
+	xfree(z);
+}
+
+// Checks the compute shader solver against the CPU one, which it has to
+// match cell for cell up to rounding, with and without periodic edges, and
+// times both. Without a GL 4.3 context there is nothing to check, which is
+// an error rather than a pass; --gl-software gets one from Mesa's llvmpipe.
+void Bench_water_gpu() {
+	const int sizes[] = {500, 1000};
+	const int frames = 60;
+	const int K = 4;
+
+	SDL_Init(SDL_INIT_EVERYTHING);
+	window = SDL_CreateWindow("RoyalHackaway", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 64, 64, SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+	gl = create_gl_context(true);
+	gladLoadGLLoader(SDL_GL_GetProcAddress);
+
+	if (!GLAD_GL_VERSION_4_3) {
+		panic("No GL 4.3 compute shaders on %s to check, try --gl-software\n", glGetString(GL_RENDERER));
+	}
+
+	Settings.waterSleepThreshold = -1;
+	Settings.waterWakeThreshold = -1;
+
+	printf("Water compute shader against CPU, %d substeps, %d frames, on %s\n", K, frames, glGetString(GL_RENDERER));
+	printf("%6s %10s %14s %14s %14s %12s %12s\n", "grid", "edges", "height error", "sample error", "bounds error", "cpu ms", "gpu ms");
+
+	// The sampler is checked on a grid of positions reaching past the edges.
+	const int side = 33;
+	float x[side * side];
+	float z[side * side];
+
+	for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		int n = sizes[s];
+		for (int periodic = 0; periodic < 2; periodic++) {
+			float* result[2];
+			float* bounds[2];
+			float heights[2][side * side];
+			vec3 normals[2][side * side];
+			double ms[2];
+			for (int gpu = 0; gpu < 2; gpu++) {
+				Settings.waterPeriodic = periodic;
+				Water_init_sim(n);
+				if (gpu) {
+					Water_init_gpu();
+				}
+				for (int i = 0; i < side * side; i++) {
+					x[i] = ((i % side) / (side - 1.0f) - 0.5f) * 1.1f * Water.size;
+					z[i] = ((i / side) / (side - 1.0f) - 0.5f) * 1.1f * Water.size;
+				}
+
+				double start = time_seconds();
+				for (int f = 0; f < frames; f++) {
+					if (f % 10 == 0) {
+						Water_add_pulse(0.5f, 1, 30 * cosf(f * 0.3f), 30 * sinf(f * 0.3f));
+						Water_add_pulse(0.3f, 0.5f, Water.size / 2 - 0.1f, -Water.size / 2 + 0.1f);
+					}
+					if (gpu) {
+						Water_step_gpu(dt, K);
+					}
+					else {
+						Water_step_frame(dt, K);
+					}
+				}
+
+				result[gpu] = xmalloc((size_t)n * n * sizeof(float));
+				if (gpu) {
+					glBindBuffer(GL_COPY_READ_BUFFER, Water.gpuU[Water.gpuCurrent]);
+					glGetBufferSubData(GL_COPY_READ_BUFFER, 0, (size_t)n * n * sizeof(float), result[gpu]);
+				}
+				else {
+					memcpy(result[gpu], Water.u, (size_t)n * n * sizeof(float));
+				}
+				ms[gpu] = (time_seconds() - start) * 1000 / frames;
+
+				// The GPU's samples and bounds come back from the dispatch
+				// after the one that queued them.
+				int t = Water.tilesX;
+				if (gpu) {
+					Water_sample(NULL, x, z, side * side, heights[gpu], normals[gpu]);
+					Water_read_gpu();
+					glFinish();
+					Water_read_gpu();
+					Water_sample(NULL, x, z, side * side, heights[gpu], normals[gpu]);
+				}
+				else {
+					memset(Water.tileDirty, 1, t * t);
+					Water_update_bounds(Water.u, Water.tileDirty);
+					Water_sample(Water_snapshot(), x, z, side * side, heights[gpu], normals[gpu]);
+				}
+				bounds[gpu] = xmalloc(2 * t * t * sizeof(float));
+				memcpy(bounds[gpu], Water.tileMin, t * t * sizeof(float));
+				memcpy(bounds[gpu] + t * t, Water.tileMax, t * t * sizeof(float));
+
+				if (gpu) {
+					Water_delete_gpu();
+				}
+				Water_delete_sim();
+			}
+
+			float error = 0;
+			float peak = 0;
+			for (size_t c = 0; c < (size_t)n * n; c++) {
+				error = fmaxf(error, fabsf(result[1][c] - result[0][c]));
+				peak = fmaxf(peak, fabsf(result[0][c]));
+			}
+			float sampleError = 0;
+			for (int i = 0; i < side * side; i++) {
+				sampleError = fmaxf(sampleError, fabsf(heights[1][i] - heights[0][i]));
+				for (int c = 0; c < 3; c++) {
+					sampleError = fmaxf(sampleError, fabsf(normals[1][i][c] - normals[0][i][c]) * peak);
+				}
+			}
+			float boundsError = 0;
+			int t = (n + WATER_TILE_SIZE - 1) / WATER_TILE_SIZE;
+			for (int i = 0; i < 2 * t * t; i++) {
+				boundsError = fmaxf(boundsError, fabsf(bounds[1][i] - bounds[0][i]));
+			}
+
+			printf("%6d %10s %14.3g %14.3g %14.3g %12.3f %12.3f\n", n, periodic ? "periodic" : "fixed", error / peak, sampleError / peak, boundsError / peak, ms[0], ms[1]);
+			if (!(error <= 1e-4f * peak)) {
+				panic("Compute shader heights differ from the CPU's by %g of %g at %d\n", error, peak, n);
+			}
+			if (!(sampleError <= 1e-3f * peak) || !(boundsError <= 1e-4f * peak)) {
+				panic("Compute shader samples or bounds differ from the CPU's by %g and %g of %g at %d\n", sampleError, boundsError, peak, n);
+			}
+
+			xfree(result[0]);
+			xfree(result[1]);
+			xfree(bounds[0]);
+			xfree(bounds[1]);
+		}
+	}
+}
+
+typedef struct BenchStats {
+	double mean;
+	double stddev;
+	double min;
+} BenchStats;
+
+BenchStats Bench_stats(const double* samples, int count) {
+	BenchStats stats = {0, 0, samples[0]};
+	for (int r = 0; r < count; r++) {
+		stats.mean += samples[r] / count;
+		stats.min = samples[r] < stats.min ? samples[r] : stats.min;
+	}
+	for (int r = 0; r < count; r++) {
+		stats.stddev += (samples[r] - stats.mean) * (samples[r] - stats.mean) / count;
+	}
+	stats.stddev = sqrt(stats.stddev);
+	return stats;
+}
+
+typedef struct BenchStream {
+	float* a;
+	float* b;
+	float* c;
+	size_t count;
+	bool init;
+} BenchStream;
+
+// Runs the triad, or fills the arrays, over one worker's share of them. Each
+// worker touches its share first, so it lands in that worker's memory.
+void Bench_stream_band(void* arg, int band, int bands) {
+	BenchStream* stream = arg;
+	size_t i0 = stream->count * band / bands;
+	size_t i1 = stream->count * (band + 1) / bands;
+	if (stream->init) {
+		for (size_t i = i0; i < i1; i++) {
+			stream->a[i] = 0;
+			stream->b[i] = i;
+			stream->c[i] = 2 * i;
+		}
+		return;
+	}
+	for (size_t i = i0; i < i1; i++) {
+		stream->a[i] = stream->b[i] + 3 * stream->c[i];
+	}
+}
+
+// The best of a few STREAM triads a = b + s c over arrays far larger than
+// the cache, split across threads workers, in GB/s counting two reads and a
+// write per element.
+double Bench_stream_bandwidth(int threads) {
+	const int repeats = 5;
+
+	BenchStream stream;
+	stream.count = 8 << 20;
+	stream.a = xmalloc(stream.count * sizeof(float));
+	stream.b = xmalloc(stream.count * sizeof(float));
+	stream.c = xmalloc(stream.count * sizeof(float));
+
+	WorkerPool* pool = WorkerPool_new(threads);
+	stream.init = true;
+	WorkerPool_run(pool, Bench_stream_band, &stream);
+	stream.init = false;
+
+	double best = 0;
+	for (int r = 0; r < repeats; r++) {
+		double start = time_seconds();
+		WorkerPool_run(pool, Bench_stream_band, &stream);
+		double gbs = 3 * stream.count * sizeof(float) / (time_seconds() - start) / 1e9;
+		best = gbs > best ? gbs : best;
+	}
+	WorkerPool_delete(pool);
+
+	// Keeps the triad from being optimised away.
+	if (stream.a[stream.count / 2] < 0) {
+		printf("%g\n", stream.a[stream.count / 2]);
+	}
+
+	xfree(stream.a);
+	xfree(stream.b);
+	xfree(stream.c);
+	return best;
 }
 
-typedef enum GameState {
-	STATE_MENU,
-	STATE_GAME,
-	STATE_OVER,
-} GameState;
-
-GameState state;
+// Times one operation over runs of the sweep and writes its line of the
+// table and its JSON object. bytes is the memory traffic of one repeat, or
+// 0 where that means nothing.
+void Bench_sweep_report(FILE* json, bool* first, const char* op, const char* unit, int n, int threads, const char* kernel, const double* samples, int runs, double bytes, double seconds, double stream) {
+	BenchStats stats = Bench_stats(samples, runs);
+	double gbs = bytes > 0 ? bytes / seconds / 1e9 : 0;
 
-int logoImg;
-NVGpaint logoPaint;
+	printf("%8s %6d %8d %8s %12.3f %12.3f %8.1f%%", op, n, threads, kernel, stats.mean, stats.min, 100 * stats.stddev / stats.mean);
+	if (bytes > 0) {
+		printf(" %8.2f %7.0f%%", gbs, 100 * gbs / stream);
+	}
+	printf("\n");
 
-void MENU_init() {
-	state = STATE_MENU;
+	fprintf(json, "%s\n\t\t{\"op\": \"%s\", \"grid\": %d, \"threads\": %d, \"kernel\": \"%s\", \"runs\": %d, ", *first ? "" : ",", op, n, threads, kernel, runs);
+	fprintf(json, "\"%s\": {\"mean\": %.4f, \"stddev\": %.4f, \"min\": %.4f}", unit, stats.mean, stats.stddev, stats.min);
+	if (bytes > 0) {
+		fprintf(json, ", \"gbs\": %.3f, \"stream_fraction\": %.4f", gbs, gbs / stream);
+	}
+	fprintf(json, "}");
+	*first = false;
+}
 
-	stbi_set_flip_vertically_on_load(0);
-	logoImg = nvgCreateImage(vg, "data/logo.png", 0);
-	logoPaint = nvgImagePattern(vg, 0, 0, width, height, 0, logoImg, 1);
+// Applies the queued impulses to a band of whole tile rows, split the way
+// Water_step_band splits them.
+void Bench_pulse_band(void* arg, int band, int bands) {
+	int ty0 = Water.tilesX * band / bands;
+	int ty1 = Water.tilesX * (band + 1) / bands;
+	Water_apply_impulses(ty0 * WATER_TILE_SIZE, ty1 * WATER_TILE_SIZE);
 }
 
-void GAME_init();
+// Computes the normals of a band of rows.
+void Bench_normals_band(void* arg, int band, int bands) {
+	int n = Water.sim_size;
+	int i0 = (n - 1) * band / bands;
+	int i1 = (n - 1) * (band + 1) / bands;
+	for (int i = i0; i < i1; i++) {
+		Water_normals_row(Water.u, i, 0, n - 1);
+	}
+}
 
-void MENU_update() {
-	glEnable(GL_CULL_FACE);
-	glEnable(GL_DEPTH_TEST);
-	glDisable(GL_STENCIL_TEST);
+// Sweeps grid size, thread count and kernel over the three parts of the
+// water's frame, with every tile awake and no GL: a step of Water_step_sim,
+// Water_add_pulse with the queue applied, and the normals of the whole grid.
+// Each is repeated over runs for its spread. The step's traffic is its
+// blocked passes, each reading both height buffers and writing one, plus the
+// normals; the normals read a row of heights and write a row of normals.
+// The table goes to stdout and the same results to Settings.benchJson.
+void Bench_water_sweep() {
+	const int sizes[] = {256, 500, 1000, 2000};
+	const int runs = 10;
+	const double cellsPerRun = 2e7;
+	const int pulses = 256;
+
+	int threadCounts[2] = {1, cpu_count()};
+	int threadVariants = threadCounts[1] > 1 ? 2 : 1;
+
+	// Each row is held against the bandwidth of as many threads as it ran.
+	double stream[2];
+	for (int t = 0; t < threadVariants; t++) {
+		stream[t] = Bench_stream_bandwidth(threadCounts[t]);
+	}
 
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	FILE* json = fopen(Settings.benchJson, "w");
+	if (json == NULL) {
+		panic("Failed to open %s\n", Settings.benchJson);
+	}
+	fprintf(json, "{\n\t\"cpus\": %d,\n\t\"stream_gbs\": {", cpu_count());
+	for (int t = 0; t < threadVariants; t++) {
+		fprintf(json, "%s\"%d\": %.3f", t > 0 ? ", " : "", threadCounts[t], stream[t]);
+	}
+	fprintf(json, "},\n\t\"results\": [");
+	bool first = true;
 
-	glClearColor(0, 0, 0, 0);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+	Settings.waterSleepThreshold = -1;
+	Settings.waterWakeThreshold = -1;
+	const char* kernelSetting = Settings.waterKernel;
+	int threadSetting = Settings.waterThreads;
 
-	nvgBeginFrame(vg, width, height, 1);
+	printf("Water sweep, %d runs each, on %d cpus, STREAM triad", runs, cpu_count());
+	for (int t = 0; t < threadVariants; t++) {
+		printf("%s %.2f GB/s on %d threads", t > 0 ? "," : "", stream[t], threadCounts[t]);
+	}
+	printf("\n");
+	printf("%8s %6s %8s %8s %12s %12s %9s %8s %8s\n", "op", "grid", "threads", "kernel", "mean", "min", "stddev", "GB/s", "stream");
 
-	nvgBeginPath(vg);
-	nvgFillPaint(vg, logoPaint);
-	nvgRect(vg, 0, 0, width, height);
-	nvgFill(vg);
+	for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		int n = sizes[s];
+		double cells = (double)n * n;
 
-	nvgEndFrame(vg);
+		for (int t = 0; t < threadVariants; t++) {
+			for (int k = 0; k < WATER_KERNEL_COUNT; k++) {
+				if (!waterKernels[k].supported()) {
+					continue;
+				}
+				Settings.waterKernel = waterKernels[k].name;
+				Settings.waterThreads = threadCounts[t];
+				Water_init_sim(n);
+
+				// Steps, in ns per cell and substep.
+				int substeps = Water_substeps(dt);
+				int frames = ceil(cellsPerRun / (cells * substeps));
+				int passes = (substeps + Settings.waterBlockSteps - 1) / Settings.waterBlockSteps;
+				double samples[runs];
+				double seconds = 0;
+				for (int r = 0; r < runs; r++) {
+					double start = time_seconds();
+					for (int f = 0; f < frames; f++) {
+						Water_step_sim();
+					}
+					double elapsed = time_seconds() - start;
+					samples[r] = elapsed * 1e9 / (frames * cells * substeps);
+					seconds += elapsed / frames;
+				}
+				double bytes = cells * (passes * 3 * Water.cellBytes + sizeof(uint32_t));
+				Bench_sweep_report(json, &first, "step", "ns_per_cell", n, Water.workers->count, Water.kernel->name, samples, runs, bytes, seconds / runs, stream[t]);
+
+				// Pulses, queued and applied, in ns per pulse.
+				for (int r = 0; r < runs; r++) {
+					double start = time_seconds();
+					for (int p = 0; p < pulses; p++) {
+						Water_add_pulse(0.01f, 1, float_rand(-Water.size / 2, Water.size / 2), float_rand(-Water.size / 2, Water.size / 2));
+					}
+					Water_bin_impulses();
+					WorkerPool_run(Water.workers, Bench_pulse_band, NULL);
+					Water_clear_impulses();
+					samples[r] = (time_seconds() - start) * 1e9 / pulses;
+				}
+				Bench_sweep_report(json, &first, "pulse", "ns_per_pulse", n, Water.workers->count, Water.kernel->name, samples, runs, 0, 0, stream[t]);
+
+				// Normals of every row, in ns per cell.
+				frames = ceil(cellsPerRun / cells);
+				seconds = 0;
+				for (int r = 0; r < runs; r++) {
+					double start = time_seconds();
+					for (int f = 0; f < frames; f++) {
+						WorkerPool_run(Water.workers, Bench_normals_band, NULL);
+					}
+					double elapsed = time_seconds() - start;
+					samples[r] = elapsed * 1e9 / (frames * cells);
+					seconds += elapsed / frames;
+				}
+				bytes = cells * (Water.cellBytes + sizeof(uint32_t));
+				Bench_sweep_report(json, &first, "normals", "ns_per_cell", n, Water.workers->count, Water.kernel->name, samples, runs, bytes, seconds / runs, stream[t]);
 
-	if (keyboardState[SDL_SCANCODE_RETURN]) {
-		GAME_init();
+				Water_delete_sim();
+			}
+		}
 	}
-}
 
-int timeLeft;
-void GAME_init() {
-	state = STATE_GAME;
+	fprintf(json, "\n\t]\n}\n");
+	fclose(json);
+	printf("Results written to %s\n", Settings.benchJson);
 
-	timeLeft = 30 * 60;
+	Settings.waterKernel = kernelSetting;
+	Settings.waterThreads = threadSetting;
 }
 
-int logoImg2;
-NVGpaint logoPaint2;
+// The OBJ parser Model_parse replaced, kept to benchmark against: fgets
+// into a 256 byte buffer and sscanf on every line, triangles only.
+Vector* Bench_obj_parse_stdio(const char* path) {
+	FILE* file = fopen(path, "r");
+	if (file == NULL) {
+		panic("Unable to open file %s\n", path);
+	}
 
-void OVER_init() {
-	state = STATE_OVER;
+	Vector* vertices = Vector_new(sizeof(vec3));
+	Vector* texcoords = Vector_new(sizeof(vec2));
+	Vector* normals = Vector_new(sizeof(vec3));
+	Vector* modelVertices = Vector_new(sizeof(ModelVertex));
 
-	stbi_set_flip_vertically_on_load(0);
-	logoImg2 = nvgCreateImage(vg, "data/bg.png", 0);
-	logoPaint2 = nvgImagePattern(vg, 0, 0, width, height, 0, logoImg2, 1);
-}
+	char line[256];
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (line[0] == 'v') {
+			if (line[1] == 't') {
+				vec2 texcoord;
+				sscanf(line, "vt %f %f", &texcoord[0], &texcoord[1]);
+				Vector_add(texcoords, texcoord);
+			}
+			else if (line[1] == 'n') {
+				vec3 normal;
+				sscanf(line, "vn %f %f %f", &normal[0], &normal[1], &normal[2]);
+				Vector_add(normals, normal);
+			}
+			else {
+				vec3 pos;
+				sscanf(line, "v %f %f %f", &pos[0], &pos[1], &pos[2]);
+				Vector_add(vertices, pos);
+			}
+		}
+		else if (line[0] == 'f') {
+			int v[3];
+			int t[3];
+			int n[3];
+			sscanf(line, "f %d/%d/%d %d/%d/%d %d/%d/%d",
+				&v[0], &t[0], &n[0],
+				&v[1], &t[1], &n[1],
+				&v[2], &t[2], &n[2]);
+
+			for (int i = 0; i < 3; i++) {
+				ModelVertex mv;
+				memcpy(mv.pos, ((vec3*)vertices->data)[v[i] - 1], sizeof(vec3));
+				memcpy(mv.uv, ((vec2*)texcoords->data)[t[i] - 1], sizeof(vec2));
+				memcpy(mv.normal, ((vec3*)normals->data)[n[i] - 1], sizeof(vec3));
+				Vector_add(modelVertices, &mv);
+			}
+		}
+	}
 
-void OVER_update() {
-	glEnable(GL_CULL_FACE);
-	glEnable(GL_DEPTH_TEST);
-	glDisable(GL_STENCIL_TEST);
+	fclose(file);
+	Vector_delete(vertices);
+	Vector_delete(texcoords);
+	Vector_delete(normals);
+	return modelVertices;
+}
 
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+// Writes an n by n grid of vertices with texcoords and normals. As quads
+// it uses negative indices and one face per cell, otherwise two triangles
+// per cell with positive indices, split the way Model_parse splits a quad.
+void Bench_obj_write_grid(const char* path, int n, bool quads) {
+	FILE* file = fopen(path, "w");
+	if (file == NULL) {
+		panic("Unable to open file %s\n", path);
+	}
 
-	glClearColor(0, 0, 0, 0);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+	srand(1);
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < n; j++) {
+			float x = mapf(j, 0, n - 1, -1, 1);
+			float z = mapf(i, 0, n - 1, -1, 1);
+			float y = 0.1f * sinf(7 * x) * cosf(5 * z) + float_rand(-1e-3f, 1e-3f);
+			fprintf(file, "v %f %f %f\n", x, y, z);
+			fprintf(file, "vt %f %f\n", (float)j / (n - 1), (float)i / (n - 1));
+			vec3 normal = {-0.7f * cosf(7 * x) * cosf(5 * z), 1, 0.5f * sinf(7 * x) * sinf(5 * z)};
+			glm_vec3_normalize(normal);
+			fprintf(file, "vn %f %f %f\n", normal[0], normal[1], normal[2]);
+		}
+	}
 
-	nvgBeginFrame(vg, width, height, 1);
+	int count = n * n;
+	for (int i = 0; i < n - 1; i++) {
+		for (int j = 0; j < n - 1; j++) {
+			int a = i * n + j + 1;
+			int b = a + n;
+			int c = b + 1;
+			int d = a + 1;
+			if (quads) {
+				a -= count + 1;
+				b -= count + 1;
+				c -= count + 1;
+				d -= count + 1;
+				fprintf(file, "f %d/%d/%d %d/%d/%d %d/%d/%d %d/%d/%d\n", a, a, a, b, b, b, c, c, c, d, d, d);
+			}
+			else {
+				fprintf(file, "f %d/%d/%d %d/%d/%d %d/%d/%d\n", a, a, a, b, b, b, c, c, c);
+				fprintf(file, "f %d/%d/%d %d/%d/%d %d/%d/%d\n", a, a, a, c, c, c, d, d, d);
+			}
+		}
+	}
 
-	nvgBeginPath(vg);
-	nvgFillPaint(vg, logoPaint2);
-	nvgRect(vg, 0, 0, width, height);
-	nvgFill(vg);
+	fclose(file);
+}
 
-	nvgFillColor(vg, nvgRGBA(255,192,0,255));
-	nvgFontSize(vg, 72.0f);
-	nvgFontFace(vg, "font");
-	nvgTextAlign(vg, NVG_ALIGN_TOP);
+// Parses a file with Model_parse and referencePath with the old parser, each
+// for at least minRuns runs and minSeconds, prints the best MB/s of each and
+// compares the vertices the two produce.
+void Bench_obj_file(const char* label, const char* path, const char* referencePath) {
+	const int minRuns = 3;
+	const double minSeconds = 0.3;
+
+	struct stat info;
+	struct stat referenceInfo;
+	if (stat(path, &info) != 0 || stat(referencePath, &referenceInfo) != 0) {
+		panic("Unable to stat file %s\n", path);
+	}
+	double mb = info.st_size / 1e6;
+	double referenceMb = referenceInfo.st_size / 1e6;
+
+	double oldBest = 0;
+	Vector* reference = NULL;
+	double start = time_seconds();
+	for (int r = 0; r < minRuns || time_seconds() - start < minSeconds; r++) {
+		double runStart = time_seconds();
+		Vector* vertices = Bench_obj_parse_stdio(referencePath);
+		double mbs = referenceMb / (time_seconds() - runStart);
+		oldBest = mbs > oldBest ? mbs : oldBest;
+		if (reference != NULL) {
+			Vector_delete(reference);
+		}
+		reference = vertices;
+	}
 
-	char text[256];
-	sprintf(text, "Thanks for playing! Your score is %d", 100 - fishes->count);
-	nvgText(vg, 0, 0, text, NULL);
+	double newBest = 0;
+	ModelData parsed = {NULL, NULL, NULL};
+	start = time_seconds();
+	for (int r = 0; r < minRuns || time_seconds() - start < minSeconds; r++) {
+		double runStart = time_seconds();
+		ModelData data = Model_parse(path);
+		double mbs = mb / (time_seconds() - runStart);
+		newBest = mbs > newBest ? mbs : newBest;
+		if (parsed.vertices != NULL) {
+			Vector_delete(parsed.vertices);
+			Vector_delete(parsed.indices);
+			xfree(parsed.mtllib);
+		}
+		parsed = data;
+	}
 
-	nvgEndFrame(vg);
+	// The reference only reads triangles, so a file of quads is compared
+	// with the same grid written as triangles. The reference is unindexed,
+	// so each index is looked up to compare corner by corner.
+	const int cornerFloats = sizeof(ModelVertex) / sizeof(float);
+	int floats = parsed.indices->count * cornerFloats;
+	int differing = 0;
+	float maxDiff = 0;
+	if (parsed.indices->count == reference->count) {
+		for (size_t i = 0; i < parsed.indices->count; i++) {
+			const float* a = (const float*)&((ModelVertex*)parsed.vertices->data)[((uint32_t*)parsed.indices->data)[i]];
+			const float* b = (const float*)&((ModelVertex*)reference->data)[i];
+			for (int k = 0; k < cornerFloats; k++) {
+				float diff = fabsf(a[k] - b[k]);
+				differing += a[k] != b[k];
+				maxDiff = diff > maxDiff ? diff : maxDiff;
+			}
+		}
+	}
 
-	if (keyboardState[SDL_SCANCODE_RETURN]) {
-		Blahaj_init();
-		// Water_init();
-		// Sky_init();
-		Fishs_init();
-		
-		GAME_init();
+	printf("%-24s %8.2f %10zu %12.1f %12.1f %8.1fx", label, mb, parsed.indices->count / 3, oldBest, newBest, newBest / oldBest);
+	if (parsed.indices->count != reference->count) {
+		printf("   %zu triangles from the reference\n", reference->count / 3);
 	}
+	else {
+		printf("   %d of %d floats differ, max %g\n", differing, floats, maxDiff);
+	}
+
+	Vector_delete(reference);
+	Vector_delete(parsed.vertices);
+	Vector_delete(parsed.indices);
+	xfree(parsed.mtllib);
 }
 
-void GAME_update() {
-	glEnable(GL_CULL_FACE);
-	glEnable(GL_DEPTH_TEST);
-	glDisable(GL_STENCIL_TEST);
+// Times what Model_load does before GL sees the mesh, parsing the OBJ and
+// packing it against mapping its cache file, which it writes first. Reading
+// every mapped byte stands in for glBufferData copying them.
+void Bench_obj_cache(const char* label, const char* path) {
+	const int runs = 5;
 
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	struct stat source;
+	if (stat(path, &source) != 0) {
+		panic("Unable to stat file %s\n", path);
+	}
+	char cachePath[4096];
+	snprintf(cachePath, sizeof(cachePath), "%s.mesh", path);
+
+	double parseBest = 1e30;
+	size_t packedSize = 0;
+	for (int r = 0; r < runs; r++) {
+		double start = time_seconds();
+		ModelData data = Model_parse(path);
+		void* packed;
+		packedSize = Model_pack(&data, &source, &packed);
+		double seconds = time_seconds() - start;
+		parseBest = seconds < parseBest ? seconds : parseBest;
+
+		if (r == 0) {
+			Cache_write(cachePath, packed, packedSize);
+		}
+		xfree(packed);
+		Vector_delete(data.vertices);
+		Vector_delete(data.indices);
+		xfree(data.mtllib);
+	}
 
-	glClearColor(0, 0, 0, 0);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+	double cacheBest = 1e30;
+	uint64_t sum = 0;
+	for (int r = 0; r < runs; r++) {
+		double start = time_seconds();
+		size_t size;
+		ModelMesh mesh;
+		void* map = Cache_map(cachePath, &size);
+		if (map == NULL || !Model_unpack(map, size, &source, &mesh)) {
+			panic("No usable cache file for %s\n", path);
+		}
+		const uint64_t* words = map;
+		for (size_t i = 0; i < size / sizeof(uint64_t); i++) {
+			sum += words[i];
+		}
+		munmap(map, size);
+		double seconds = time_seconds() - start;
+		cacheBest = seconds < cacheBest ? seconds : cacheBest;
+	}
 
-	glm_perspective(deg2rad(90), width / (float)height, 0.1f, 100, projMat);
-	
-	vec3 up = {0, 1, 0};
-	glm_lookat(Blahaj.camPos, Blahaj.pos, up, viewMat);
+	printf("%-24s %10.2f %12.3f %12.3f %8.1fx\n", label, packedSize / 1e6, parseBest * 1000, cacheBest * 1000, parseBest / cacheBest);
 
-	Sky_update();
-	Blahaj_update();
-	Fishs_update();
-	Water_update();
+	// Keeps the reads from being optimised away.
+	if (sum == 1) {
+		printf("%llu\n", (unsigned long long)sum);
+	}
+}
 
-	nvgBeginFrame(vg, width, height, 1);
+// Times Model_parse against the fgets and sscanf parser it replaced on the
+// game's models and on generated grids the size of production assets.
+void Bench_obj() {
+	const char* models[] = {"data/models/blahaj.obj", "data/models/fish.obj", "data/models/_fish.obj"};
+	const int gridSize = 512;
 
-	nvgFillColor(vg, nvgRGBA(255,192,0,255));
-	nvgFontSize(vg, 72.0f);
-	nvgFontFace(vg, "font");
-	nvgTextAlign(vg, NVG_ALIGN_TOP);
+	printf("OBJ parsing, best MB/s of at least 3 runs\n");
+	printf("%-24s %8s %10s %12s %12s %9s\n", "file", "MB", "triangles", "stdio MB/s", "mmap MB/s", "speedup");
 
-	char text[256];
-	sprintf(text, "%.2f seconds left!", timeLeft / 60.0f);
-	nvgText(vg, 0, 0, text, NULL);
+	for (int m = 0; m < sizeof(models) / sizeof(models[0]); m++) {
+		Bench_obj_file(strrchr(models[m], '/') + 1, models[m], models[m]);
+	}
 
-	sprintf(text, "Score: %d", 100 - fishes->count);
-	nvgTextAlign(vg, NVG_ALIGN_TOP | NVG_ALIGN_RIGHT);
-	nvgText(vg, width, 0, text, NULL);
+	// What indexing saves: before, every corner was its own ModelVertex drawn
+	// with glDrawArrays. After, corners with the same indices share one and
+	// the index buffer is 16-bit whenever every vertex fits.
+	printf("\nIndexed meshes\n");
+	printf("%-24s %12s %12s %10s %8s %12s %12s\n", "file", "vertices", "unique", "indices", "type", "bytes", "indexed");
+	for (int m = 0; m < sizeof(models) / sizeof(models[0]); m++) {
+		ModelData data = Model_parse(models[m]);
+		size_t indexSize = data.vertices->count <= 65536 ? sizeof(uint16_t) : sizeof(uint32_t);
+		size_t before = data.indices->count * sizeof(ModelVertex);
+		size_t after = data.vertices->count * sizeof(ModelVertex) + data.indices->count * indexSize;
+		printf("%-24s %12zu %12zu %10zu %8s %12zu %12zu   %.1fx fewer vertices\n", strrchr(models[m], '/') + 1, data.indices->count, data.vertices->count, data.indices->count, indexSize == 2 ? "u16" : "u32", before, after, (double)data.indices->count / data.vertices->count);
+		Vector_delete(data.vertices);
+		Vector_delete(data.indices);
+		xfree(data.mtllib);
+	}
+	printf("\n");
+
+	char triangles[] = "/tmp/bench_obj_XXXXXX";
+	char quads[] = "/tmp/bench_obj_XXXXXX";
+	int fd = mkstemp(triangles);
+	close(fd);
+	fd = mkstemp(quads);
+	close(fd);
+	Bench_obj_write_grid(triangles, gridSize, false);
+	Bench_obj_write_grid(quads, gridSize, true);
+
+	char label[64];
+	snprintf(label, sizeof(label), "grid %d triangles", gridSize);
+	Bench_obj_file(label, triangles, triangles);
+	snprintf(label, sizeof(label), "grid %d quads, -index", gridSize);
+	Bench_obj_file(label, quads, triangles);
+
+	printf("\nCached meshes, best ms of 5 loads before GL\n");
+	printf("%-24s %10s %12s %12s %9s\n", "file", "cache MB", "parse ms", "mmap ms", "speedup");
+	for (int m = 0; m < sizeof(models) / sizeof(models[0]); m++) {
+		Bench_obj_cache(strrchr(models[m], '/') + 1, models[m]);
+	}
+	snprintf(label, sizeof(label), "grid %d triangles", gridSize);
+	Bench_obj_cache(label, triangles);
+
+	char cachePath[64];
+	snprintf(cachePath, sizeof(cachePath), "%s.mesh", triangles);
+	unlink(cachePath);
+	unlink(triangles);
+	unlink(quads);
+}
 
-	nvgEndFrame(vg);
+// Bakes the textures of the models the game loads and the sky into their .tex
+// containers ahead of time, reporting how long baking took against mapping
+// the result, so the first start only has to map them. A BC1 bake is only
+// used where the GL has S3TC, elsewhere the game bakes it over as RGB8.
+void Bake_run(TextureFormat format) {
+	const char* models[] = {"data/models/blahaj.obj"};
+	const char* sources[2][6];
+	int counts[2];
+	char names[1][256];
+	int count = 0;
+
+	for (int m = 0; m < sizeof(models) / sizeof(models[0]); m++) {
+		ModelFile model;
+		Model_open(models[m], &model);
+		if (model.mesh.mtllib != NULL && Model_mtl_image(model.mesh.mtllib, names[count])) {
+			sources[count][0] = names[count];
+			counts[count++] = 1;
+		}
+		Model_close(&model);
+	}
+	memcpy(sources[count], skyFaces, sizeof(skyFaces));
+	counts[count++] = 6;
+
+	printf("Baking %s textures\n", format == TEXTURE_BC1 ? "BC1" : "RGB8");
+	printf("%-32s %12s %6s %7s %10s %10s %10s %9s\n", "texture", "size", "faces", "levels", "source KB", "baked KB", "bake ms", "map ms");
+	for (int t = 0; t < count; t++) {
+		double start = time_seconds();
+		TextureFile file;
+		Texture_bake(sources[t], counts[t], format, &file);
+		double decode = time_seconds() - start;
+		char size[32];
+		snprintf(size, sizeof(size), "%ux%u", file.header->width, file.header->height);
+		uint32_t levels = file.header->levels;
+		Texture_close(&file);
+
+		size_t sourceBytes = 0;
+		for (int i = 0; i < counts[t]; i++) {
+			struct stat info;
+			if (stat(sources[t][i], &info) != 0) {
+				panic("Unable to stat file %s\n", sources[t][i]);
+			}
+			sourceBytes += info.st_size;
+		}
 
-	timeLeft--;
+		// Mapping has to be the same format the GL takes, so check it the
+		// way Texture_open does, without falling back to a bake.
+		char bakePath[4096];
+		Texture_bake_path(sources[t], counts[t], bakePath);
+		start = time_seconds();
+		size_t mapSize;
+		void* map = Cache_map(bakePath, &mapSize);
+		if (map == NULL || !Texture_unpack(map, mapSize, Texture_source_key(sources[t], counts[t]), &file)) {
+			panic("Failed to map the bake of %s\n", sources[t][0]);
+		}
+		double mapped = time_seconds() - start;
+		munmap(map, mapSize);
 
-	if (timeLeft < 0) {
-		OVER_init();
+		printf("%-32s %12s %6d %7u %10zu %10zu %10.2f %9.3f\n", strrchr(sources[t][0], '/') + 1, size, counts[t], levels, sourceBytes / 1024, mapSize / 1024, decode * 1000, mapped * 1000);
+	}
+}
+
+void Bench_run(const char* name) {
+	if (strcmp(name, "impulses") == 0) {
+		Bench_water_impulses();
+	}
+	else if (strcmp(name, "blocking") == 0) {
+		Bench_water_blocking();
+	}
+	else if (strcmp(name, "half") == 0) {
+		Bench_water_half();
+	}
+	else if (strcmp(name, "async") == 0) {
+		Bench_water_async();
+	}
+	else if (strcmp(name, "sample") == 0) {
+		Bench_water_sample();
+	}
+	else if (strcmp(name, "periodic") == 0) {
+		Bench_water_periodic();
+	}
+	else if (strcmp(name, "ocean") == 0) {
+		Bench_ocean();
+	}
+	else if (strcmp(name, "nested") == 0) {
+		Bench_water_nested();
+	}
+	else if (strcmp(name, "gpu") == 0) {
+		Bench_water_gpu();
+	}
+	else if (strcmp(name, "sweep") == 0) {
+		Bench_water_sweep();
+	}
+	else if (strcmp(name, "obj") == 0) {
+		Bench_obj();
+	}
+	else {
+		panic("Unknown benchmark %s\n", name);
 	}
 }
 
 int main(int argc, char** argv) {
+	launchTime = time_seconds();
 	signal(SIGSEGV, sigsegv_func);
 
 	srand(time(NULL));
 
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--water-kernel") == 0 && i + 1 < argc) {
+			Settings.waterKernel = argv[++i];
+		}
+		else if (strcmp(argv[i], "--water-threads") == 0 && i + 1 < argc) {
+			Settings.waterThreads = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--water-sleep") == 0 && i + 1 < argc) {
+			Settings.waterSleepThreshold = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--water-wake") == 0 && i + 1 < argc) {
+			Settings.waterWakeThreshold = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--water-damping") == 0 && i + 1 < argc) {
+			Settings.waterDamping = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--water-block-steps") == 0 && i + 1 < argc) {
+			Settings.waterBlockSteps = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--water-half") == 0) {
+			Settings.waterHalf = true;
+		}
+		else if (strcmp(argv[i], "--water-async") == 0) {
+			Settings.waterAsync = true;
+		}
+		else if (strcmp(argv[i], "--water-periodic") == 0) {
+			Settings.waterPeriodic = true;
+		}
+		else if (strcmp(argv[i], "--water-stats") == 0) {
+			Settings.waterStats = true;
+		}
+		else if (strcmp(argv[i], "--asset-stats") == 0) {
+			Settings.assetStats = true;
+		}
+		else if (strcmp(argv[i], "--bake") == 0) {
+			Settings.bake = true;
+		}
+		else if (strcmp(argv[i], "--texture-bc1") == 0) {
+			Settings.textureBc1 = true;
+		}
+		else if (strcmp(argv[i], "--water-texture") == 0) {
+			Settings.waterHeightTexture = true;
+		}
+		else if (strcmp(argv[i], "--water-clipmap") == 0 && i + 1 < argc) {
+			Settings.waterClipmap = atoi(argv[++i]);
+			Settings.waterHeightTexture = true;
+		}
+		else if (strcmp(argv[i], "--water-clipmap-levels") == 0 && i + 1 < argc) {
+			Settings.waterClipmapLevels = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--water-cells") == 0 && i + 1 < argc) {
+			Settings.waterCells = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--water-nested") == 0 && i + 1 < argc) {
+			Settings.waterNested = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--gl-software") == 0) {
+			Settings.glSoftware = true;
+		}
+		else if (strcmp(argv[i], "--water-gpu") == 0) {
+			Settings.waterGpu = true;
+		}
+		else if (strcmp(argv[i], "--ocean") == 0 && i + 1 < argc) {
+			Settings.oceanSize = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+			Settings.bench = argv[++i];
+		}
+		else if (strcmp(argv[i], "--bench-json") == 0 && i + 1 < argc) {
+			Settings.benchJson = argv[++i];
+		}
+		else {
+			panic("Unknown argument %s\n", argv[i]);
+		}
+	}
+
+	// The vertex grid is indexed with 16 bits, and the rings need room for
+	// the morph band between the hole and the edge.
+	if (Settings.waterClipmap != 0 && (Settings.waterClipmap < 32 || Settings.waterClipmap > 252 || Settings.waterClipmap % 4 != 0)) {
+		panic("--water-clipmap must be a multiple of 4 between 32 and 252\n");
+	}
+	if (Settings.waterBlockSteps < 1) {
+		panic("--water-block-steps must be at least 1\n");
+	}
+	if (Settings.waterClipmapLevels < 1 || Settings.waterClipmapLevels > 16) {
+		panic("--water-clipmap-levels must be between 1 and 16\n");
+	}
+	if (Settings.waterCells < 32) {
+		panic("--water-cells must be at least 32\n");
+	}
+	if (Settings.waterNested != 0 && (Settings.waterNested < 2 || (Settings.waterCells - 1) / Settings.waterNested + 1 < 32)) {
+		panic("--water-nested must be at least 2 and leave a coarse grid of at least 32 cells\n");
+	}
+	if (Settings.waterNested != 0 && Settings.waterHeightTexture) {
+		panic("--water-nested needs the water drawn from vertex attributes, not --water-texture or --water-clipmap\n");
+	}
+	if (Settings.waterGpu && (Settings.waterHalf || Settings.waterHeightTexture || Settings.waterNested != 0)) {
+		panic("--water-gpu steps a float grid drawn from vertex attributes, without --water-half, --water-texture, --water-clipmap or --water-nested\n");
+	}
+	if (Settings.oceanSize != 0 && (Settings.oceanSize < 64 || Settings.oceanSize > 512 || (Settings.oceanSize & (Settings.oceanSize - 1)) != 0)) {
+		panic("--ocean must be a power of two between 64 and 512\n");
+	}
+
+	if (Settings.glSoftware) {
+		setenv("LIBGL_ALWAYS_SOFTWARE", "1", 1);
+	}
+
+	if (Settings.bench != NULL) {
+		Bench_run(Settings.bench);
+		return 0;
+	}
+	if (Settings.bake) {
+		Bake_run(Settings.textureBc1 ? TEXTURE_BC1 : TEXTURE_RGB8);
+		return 0;
+	}
+
 	SDL_Init(SDL_INIT_EVERYTHING);
 
 	window = SDL_CreateWindow("RoyalHackaway", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, width, height, SDL_WINDOW_OPENGL | SDL_WINDOW_FULLSCREEN_DESKTOP);
 	SDL_GetWindowSize(window, &width, &height);
 
-	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
-	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
 	SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
 	SDL_GL_SetAttribute(SDL_GL_MULTISAMPLEBUFFERS, 1);
 	SDL_GL_SetAttribute(SDL_GL_MULTISAMPLESAMPLES, 16);
 	SDL_GL_SetAttribute(SDL_GL_STENCIL_SIZE, 8);
 	SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
 	SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
-	gl = SDL_GL_CreateContext(window);
+	gl = create_gl_context(Settings.waterGpu);
 	gladLoadGLLoader(SDL_GL_GetProcAddress);
+	if (Settings.textureBc1 && gl_has_extension("GL_EXT_texture_compression_s3tc")) {
+		textureFormat = TEXTURE_BC1;
+	}
 
 	SDL_GL_SetSwapInterval(1);
 
-	texturedShader = loadShaderProg("data/shaders/shader.vs", "data/shaders/shader.fs");
+	texturedShader = Assets_shader("data/shaders/shader.vs", NULL, "data/shaders/shader.fs");
 	mat_loc = glGetUniformLocation(texturedShader, "u_mat");
 	view_loc = glGetUniformLocation(texturedShader, "u_view");
 	tex_loc = glGetUniformLocation(texturedShader, "u_tex");
 
-	Blahaj_init();
-	Water_init();
-	Sky_init();
-	Fishs_init();
+	// Everything but the menu loads in the background, see Startup_update.
+	Loader_add_model("data/models/blahaj.obj");
+	Loader_add_cubemap(skyFaces);
+	Loader_start(cpu_count());
 
 	vg = nvgCreateGL3(NVG_ANTIALIAS | NVG_STENCIL_STROKES);
 	nvgCreateFont(vg, "font", "data/Blinker-Regular.ttf");
@@ -1172,6 +8072,11 @@ int main(int argc, char** argv) {
 
 		updateKeyboard();
 
+		// The first frame goes out before any of the startup work.
+		if (!startupDone && frameNo > 0) {
+			Startup_update();
+		}
+
 		switch (state) {
 		case STATE_MENU:
 			MENU_update();
@@ -1188,9 +8093,17 @@ int main(int argc, char** argv) {
 
 		SDL_GL_SwapWindow(window);
 
+		if (frameNo == 0) {
+			printf("First frame after %.0f ms\n", (time_seconds() - launchTime) * 1000);
+		}
+
 		frameNo++;
 		globalTime = frameNo * dt;
 	}
 
+	if (Settings.assetStats) {
+		Assets_print_stats();
+	}
+
 	return 0;
 }